@@ -0,0 +1,232 @@
+#include "qemu/osdep.h"
+#include "hw/hw.h"
+#include "hw/pci/pci.h"
+#include "hw/pci/msix.h"
+#include "qapi/error.h"
+#include "qemu/atomic.h"
+#include "qemu/main-loop.h"
+#include "sysemu/iothread.h"
+#include "migration/vmstate.h"
+
+#include "hw/misc/stopwatch.h"
+#include "hw/misc/stopwatch_core.h"
+#include "../../driver/stopwatch_hw-sw.h"
+
+/*
+ * PCI transport of the stopwatch engine (stopwatch_core.c): the same
+ * registers and pass-through memory as the sysbus device, in BARs, and
+ * edge-triggered MSI-X vectors instead of the lines, so that a timeout
+ * costs no acknowledgment trap. Works on any machine with a PCI bus,
+ * see stopwatch_hw-sw.h for the layout.
+ */
+
+/*
+ * The bank timeouts, the lines with timers posted and the clock event,
+ * with the BQL held.
+ */
+static void stopwatch_pci_notify(void *opaque, uint32_t levels,
+                                 uint64_t events)
+{
+    struct StopWatchPCIState *s = opaque;
+    PCIDevice *pdev = PCI_DEVICE(s);
+    int i;
+
+    for (i = 0; i < s->core.nb_banks; i++) {
+        if (events & BIT_ULL(i)) {
+            atomic_inc(&s->core.stats.irqs);
+            msix_notify(pdev, STOPWATCH_PCI_VECTOR_BANK(i));
+        }
+    }
+
+    for (i = 0; i < s->core.nb_irqs; i++) {
+        if (events & STOPWATCH_CORE_EVENT_TIMERS(i)) {
+            atomic_inc(&s->core.stats.irqs);
+            msix_notify(pdev, STOPWATCH_PCI_VECTOR_TIMERS(s->core.nb_banks, i));
+        }
+    }
+
+    if (events & STOPWATCH_CORE_EVENT_CLOCK) {
+        atomic_inc(&s->core.stats.irqs);
+        msix_notify(pdev, STOPWATCH_PCI_VECTOR_CLOCKEVENT(s->core.nb_banks,
+                                                          s->core.nb_irqs));
+    }
+}
+
+static void stopwatch_pci_realize(PCIDevice *pdev, Error **errp)
+{
+    struct StopWatchPCIState *s = STOPWATCH_PCI(pdev);
+    uint32_t nvec;
+    AioContext *ctx;
+    int i;
+
+    /* BARs are a power of 2, the memdev starts after the RAM */
+    if (!stopwatch_mem_init(&s->mem, OBJECT(s), pow2ceil(STOPWATCH_IO_MEM_SIZE),
+                            errp)) {
+        return;
+    }
+
+    /* the timers and the doorbell run in the iothread, if any */
+    if (s->iothread) {
+        ctx = iothread_get_aio_context(s->iothread);
+    } else {
+        ctx = qemu_get_aio_context();
+    }
+
+    s->core.edge = true;
+    s->core.irq_func = stopwatch_pci_notify;
+    s->core.irq_opaque = s;
+    s->core.dirty_func = stopwatch_mem_set_dirty;
+    s->core.dirty_opaque = &s->mem;
+    if (!stopwatch_core_realize(&s->core, ctx, s->mem.ptr, errp)) {
+        stopwatch_mem_cleanup(&s->mem);
+        return;
+    }
+
+    if (!stopwatch_mem_share(&s->mem, &s->core, errp)) {
+        stopwatch_core_unrealize(&s->core);
+        stopwatch_mem_cleanup(&s->mem);
+        return;
+    }
+
+    stopwatch_regs_init(&s->regs, OBJECT(s), &s->core);
+
+    memory_region_init(&s->regs_bar, OBJECT(s), TYPE_STOPWATCH_PCI "-regs",
+                       pow2ceil(memory_region_size(&s->regs.mr)));
+    memory_region_add_subregion(&s->regs_bar, 0, &s->regs.mr);
+
+    memory_region_init(&s->mem_bar, OBJECT(s), TYPE_STOPWATCH_PCI "-mem",
+                       pow2ceil(memory_region_size(&s->mem.mr)));
+    memory_region_add_subregion(&s->mem_bar, 0, &s->mem.mr);
+
+    pci_register_bar(pdev, STOPWATCH_PCI_BAR_REGS,
+                     PCI_BASE_ADDRESS_SPACE_MEMORY, &s->regs_bar);
+    pci_register_bar(pdev, STOPWATCH_PCI_BAR_MEM,
+                     PCI_BASE_ADDRESS_SPACE_MEMORY |
+                     PCI_BASE_ADDRESS_MEM_TYPE_64 |
+                     PCI_BASE_ADDRESS_MEM_PREFETCH, &s->mem_bar);
+
+    nvec = STOPWATCH_PCI_VECTOR_CLOCKEVENT(s->core.nb_banks,
+                                           s->core.nb_irqs) + 1;
+    if (msix_init_exclusive_bar(pdev, nvec, STOPWATCH_PCI_BAR_MSIX, errp)) {
+        stopwatch_regs_cleanup(&s->regs);
+        stopwatch_core_unrealize(&s->core);
+        stopwatch_mem_cleanup(&s->mem);
+        return;
+    }
+    for (i = 0; i < nvec; i++) {
+        msix_vector_use(pdev, i);
+    }
+
+    stopwatch_core_vm_init(&s->core);
+}
+
+static void stopwatch_pci_exit(PCIDevice *pdev)
+{
+    struct StopWatchPCIState *s = STOPWATCH_PCI(pdev);
+
+    /* no notification after the vectors are gone */
+    stopwatch_core_vm_cleanup(&s->core);
+    stopwatch_regs_cleanup(&s->regs);
+    stopwatch_core_unrealize(&s->core);
+    stopwatch_mem_cleanup(&s->mem);
+
+    msix_unuse_all_vectors(pdev);
+    msix_uninit_exclusive_bar(pdev);
+}
+
+/*
+ * Migration: the shared memory is RAM and migrates on its own, the
+ * engine state is in vmstate_stopwatch_core.
+ */
+static const VMStateDescription vmstate_stopwatch_pci = {
+    .name = TYPE_STOPWATCH_PCI,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_PCI_DEVICE(dev, struct StopWatchPCIState),
+        VMSTATE_MSIX(dev, struct StopWatchPCIState),
+        VMSTATE_STRUCT(core, struct StopWatchPCIState, 1,
+                       vmstate_stopwatch_core, struct StopWatchCore),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property stopwatch_pci_properties[] = {
+    DEFINE_PROP_BOOL("start_at_boot", struct StopWatchPCIState,
+                     core.start_at_boot, true),
+    DEFINE_PROP_STRING("clock", struct StopWatchPCIState, core.clock_name),
+    DEFINE_PROP_UINT32("banks", struct StopWatchPCIState, core.nb_banks, 1),
+    DEFINE_PROP_UINT32("irqs", struct StopWatchPCIState, core.nb_irqs, 1),
+    DEFINE_PROP_STRING("trace_file", struct StopWatchPCIState,
+                       core.trace_file),
+    DEFINE_PROP_BOOL("ioeventfd", struct StopWatchPCIState, regs.ioeventfd,
+                     true),
+    DEFINE_PROP_BOOL("clock_page", struct StopWatchPCIState, core.clock_page,
+                     false),
+    DEFINE_PROP_UINT32("clock_page_us", struct StopWatchPCIState,
+                       core.clock_page_us, 10),
+    DEFINE_PROP_LINK("iothread", struct StopWatchPCIState, iothread,
+                     TYPE_IOTHREAD, IOThread *),
+    DEFINE_PROP_LINK("memdev", struct StopWatchPCIState, mem.memdev,
+                     TYPE_MEMORY_BACKEND, HostMemoryBackend *),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void stopwatch_pci_instance_init(Object *obj)
+{
+    struct StopWatchPCIState *s = STOPWATCH_PCI(obj);
+
+    object_property_add_uint64_ptr(obj, "stats-commands",
+                                   &s->core.stats.commands, &error_abort);
+    object_property_add_uint64_ptr(obj, "stats-irqs", &s->core.stats.irqs,
+                                   &error_abort);
+    object_property_add_uint64_ptr(obj, "stats-reads", &s->core.stats.reads,
+                                   &error_abort);
+    object_property_add_uint64_ptr(obj, "stats-errors", &s->core.stats.errors,
+                                   &error_abort);
+}
+
+static void stopwatch_pci_reset(DeviceState *dev)
+{
+    struct StopWatchPCIState *s = STOPWATCH_PCI(dev);
+
+    stopwatch_core_reset(&s->core);
+}
+
+static void stopwatch_pci_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    PCIDeviceClass *k = PCI_DEVICE_CLASS(klass);
+
+    k->realize = stopwatch_pci_realize;
+    k->exit = stopwatch_pci_exit;
+    k->vendor_id = STOPWATCH_PCI_VENDOR_ID;
+    k->device_id = STOPWATCH_PCI_DEVICE_ID;
+    k->revision = 1;
+    k->class_id = PCI_CLASS_OTHERS;
+
+    dc->props = stopwatch_pci_properties;
+    dc->reset = stopwatch_pci_reset;
+    dc->vmsd = &vmstate_stopwatch_pci;
+
+    set_bit(DEVICE_CATEGORY_MISC, dc->categories);
+}
+
+static const TypeInfo stopwatch_pci_info = {
+    .name           = TYPE_STOPWATCH_PCI,
+    .parent         = TYPE_PCI_DEVICE,
+    .instance_size  = sizeof(struct StopWatchPCIState),
+    .instance_init  = stopwatch_pci_instance_init,
+    .class_init     = stopwatch_pci_class_init,
+    .interfaces     = (InterfaceInfo[]) {
+        { INTERFACE_CONVENTIONAL_PCI_DEVICE },
+        { },
+    },
+};
+
+static void stopwatch_pci_register_types(void)
+{
+    type_register_static(&stopwatch_pci_info);
+}
+
+type_init(stopwatch_pci_register_types);
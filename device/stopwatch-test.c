@@ -0,0 +1,503 @@
+/*
+ * QTest of the stopwatch device: the registers and the shared memory
+ * are accessed directly, and QEMU_CLOCK_VIRTUAL only moves with
+ * clock_step(), so the expected values are exact.
+ *
+ * Run with -m perf for the host cost per command (register trap, and
+ * command ring with one doorbell per STOPWATCH_RING_SIZE commands).
+ */
+#include "qemu/osdep.h"
+#include "qemu/bitops.h"
+#include "qemu/host-utils.h"
+#include "libqtest.h"
+#include "qapi/qmp/qdict.h"
+
+#include "hw/misc/stopwatch_hw-sw.h"
+
+#define NB_BANKS 2
+#define NB_IRQS 2
+
+/*
+ * The device is the only one of the platform bus of the virt machine
+ * (VIRT_PLATFORM_BUS), which maps each region at the first free offset
+ * aligned on its size: mem first, then regs.
+ */
+#define PLATFORM_BUS_BASE 0x0c000000ULL
+
+#define MEM_SIZE QEMU_ALIGN_UP(sizeof(struct StopWatch_mem), STOPWATCH_MEM_ALIGN)
+#define REGS_SIZE (offsetof(struct StopWatch_regs, bank) + \
+                   NB_BANKS * sizeof(struct StopWatch_bank_regs))
+
+#define MEM_BASE PLATFORM_BUS_BASE
+#define REGS_BASE (PLATFORM_BUS_BASE + QEMU_ALIGN_UP(MEM_SIZE, pow2ceil(REGS_SIZE)))
+
+#define REG(field) (REGS_BASE + offsetof(struct StopWatch_regs, field))
+#define MEM(field) (MEM_BASE + offsetof(struct StopWatch_mem, field))
+
+#define PERF_COMMANDS 100000
+
+/* doorbell processed during the trap: the completions are checked right after */
+static void sw_start(void)
+{
+    qtest_start("-machine virt -device stopwatch,id=sw,start_at_boot=false,"
+                "ioeventfd=off,"
+                "banks=" stringify(NB_BANKS) ",irqs=" stringify(NB_IRQS));
+}
+
+static uint64_t sw_qom_get(const char *property)
+{
+    QDict *resp;
+    uint64_t value;
+
+    resp = qmp("{ 'execute': 'qom-get', 'arguments': "
+               "{ 'path': '/machine/peripheral/sw', 'property': %s } }",
+               property);
+    g_assert(qdict_haskey(resp, "return"));
+    value = qdict_get_int(resp, "return");
+    qobject_unref(resp);
+
+    return value;
+}
+
+static void sw_bank_cmd(int bank, uint64_t action)
+{
+    writeq(REG(bank[bank].command), action);
+}
+
+static uint64_t sw_bank_status(int bank)
+{
+    return readq(REG(bank[bank].status));
+}
+
+static void sw_read_time(int bank, struct StopWatch_time *t)
+{
+    memread(MEM(time[bank]), t, sizeof(*t));
+    g_assert_cmpuint(t->seq & 1, ==, 0); /* no update during a read */
+}
+
+/*
+ * Submit @n commands through the command ring and ring the doorbell,
+ * the completions are posted during the trap.
+ */
+static void sw_ring_submit(const struct StopWatch_cmd *cmds,
+                           struct StopWatch_cpl *cpls, uint32_t n)
+{
+    uint32_t sq_tail = readl(MEM(ring.sq_tail));
+    uint32_t cq_head = readl(MEM(ring.cq_head));
+    uint32_t i;
+
+    g_assert_cmpuint(n, <=, STOPWATCH_RING_SIZE);
+
+    for (i = 0; i < n; i++) {
+        memwrite(MEM(ring.sq[(sq_tail + i) % STOPWATCH_RING_SIZE]),
+                 &cmds[i], sizeof(cmds[i]));
+    }
+    writel(MEM(ring.sq_tail), sq_tail + n);
+    writeq(REG(doorbell), 1);
+
+    g_assert_cmpuint(readl(MEM(ring.cq_tail)) - cq_head, ==, n);
+    for (i = 0; cpls && i < n; i++) {
+        memread(MEM(ring.cq[(cq_head + i) % STOPWATCH_RING_SIZE]),
+                &cpls[i], sizeof(cpls[i]));
+        g_assert_cmpuint(cpls[i].tag, ==, cmds[i].tag);
+    }
+    writel(MEM(ring.cq_head), cq_head + n);
+}
+
+static int64_t sw_ring_cmd(uint16_t action, uint16_t flags, uint32_t index,
+                           uint64_t arg, uint64_t *value)
+{
+    struct StopWatch_cmd cmd = {
+        .action = action, .flags = flags, .index = index, .arg = arg,
+        .tag = 0x5eed,
+    };
+    struct StopWatch_cpl cpl;
+
+    sw_ring_submit(&cmd, &cpl, 1);
+    if (value) {
+        *value = cpl.value;
+    }
+
+    return cpl.result;
+}
+
+static void test_regs(void)
+{
+    sw_start();
+
+    g_assert_cmpuint(readq(REG(banks)), ==, NB_BANKS);
+    g_assert_cmpuint(readq(REG(irqs)), ==, NB_IRQS);
+    g_assert_cmpuint(readq(REG(irq_status)), ==, 0);
+    g_assert_cmpuint(sw_bank_status(0), ==, STOPWATCH_STATE_RESET);
+    g_assert_cmpuint(sw_qom_get("irq-levels"), ==, 0);
+
+    qtest_end();
+}
+
+/* the transitions of stopwatch_action, and the exact values */
+static void test_state_machine(void)
+{
+    struct StopWatch_time t;
+    uint64_t value;
+
+    sw_start();
+
+    sw_bank_cmd(0, STOPWATCH_ACTION_START);
+    g_assert_cmpuint(sw_bank_status(0), ==, STOPWATCH_STATE_RUNNING);
+    g_assert_cmpuint(sw_bank_status(1), ==, STOPWATCH_STATE_RESET);
+
+    clock_step(1000);
+    sw_bank_cmd(0, STOPWATCH_ACTION_PAUSE);
+    g_assert_cmpuint(sw_bank_status(0), ==, STOPWATCH_STATE_PAUSED);
+    sw_read_time(0, &t);
+    g_assert_cmpuint(t.status, ==, STOPWATCH_STATE_PAUSED);
+    g_assert_cmpuint(t.total_ns, ==, 1000);
+
+    /* paused: the time does not count */
+    clock_step(5000);
+    sw_bank_cmd(0, STOPWATCH_ACTION_START);
+    clock_step(500);
+    g_assert_cmpint(sw_ring_cmd(STOPWATCH_ACTION_PAUSE, 0, 0, 0, &value), ==,
+                    STOPWATCH_OK);
+    g_assert_cmpuint(value, ==, 1500);
+
+    /* invalid transitions are reported in the completion */
+    g_assert_cmpint(sw_ring_cmd(STOPWATCH_ACTION_LAP, 0, 1, 0, NULL), ==,
+                    -STOPWATCH_ERR_STATE);
+    g_assert_cmpint(sw_ring_cmd(STOPWATCH_ACTION_START, 0, 0, 0, NULL), ==,
+                    STOPWATCH_OK);
+    g_assert_cmpint(sw_ring_cmd(STOPWATCH_ACTION_START, 0, 0, 0, NULL), ==,
+                    -STOPWATCH_ERR_STATE);
+    g_assert_cmpint(sw_ring_cmd(STOPWATCH_ACTION_START, 0, NB_BANKS, 0, NULL),
+                    ==, -STOPWATCH_ERR_INVALID);
+    g_assert_cmpint(sw_ring_cmd(STOPWATCH_ACTION_LAST, 0, 0, 0, NULL), ==,
+                    -STOPWATCH_ERR_INVALID);
+
+    /* through the register, only counted: the bank is still running */
+    sw_bank_cmd(0, STOPWATCH_ACTION_START);
+    g_assert_cmpuint(sw_bank_status(0), ==, STOPWATCH_STATE_RUNNING);
+
+    /* device-wide reset */
+    writeq(REG(command), STOPWATCH_ACTION_RESET);
+    sw_read_time(0, &t);
+    g_assert_cmpuint(t.status, ==, STOPWATCH_STATE_RESET);
+    g_assert_cmpuint(t.total_ns, ==, 0);
+
+    g_assert_cmpuint(sw_qom_get("stats-errors"), ==, 5);
+
+    qtest_end();
+}
+
+/* bank timeout on line 1: raised at the deadline, lowered by the ack */
+static void test_timeout(void)
+{
+    sw_start();
+
+    g_assert_cmpint(sw_ring_cmd(STOPWATCH_ACTION_TIMEOUT, STOPWATCH_CMD_LINE(1),
+                                0, 1000, NULL), ==, STOPWATCH_OK);
+    g_assert_cmpint(sw_ring_cmd(STOPWATCH_ACTION_TIMEOUT, STOPWATCH_CMD_LINE(1),
+                                0, 1000, NULL), ==, -STOPWATCH_ERR_BUSY);
+    g_assert_cmpint(sw_ring_cmd(STOPWATCH_ACTION_TIMEOUT, 0, 0,
+                                STOPWATCH_TIMEOUT_MAX_NS + 1, NULL), ==,
+                    -STOPWATCH_ERR_RANGE);
+
+    clock_step(999);
+    g_assert_cmpuint(readq(REG(irq_status)), ==, 0);
+    g_assert_cmpuint(sw_qom_get("irq-levels"), ==, 0);
+
+    clock_step(1);
+    g_assert_cmpuint(readq(REG(irq_status)), ==, BIT(0));
+    g_assert_cmpuint(readq(REG(line[0].status)), ==, 0);
+    g_assert_cmpuint(readq(REG(line[1].status)), ==, BIT(0));
+    g_assert_cmpuint(sw_qom_get("irq-levels"), ==, BIT(1));
+
+    sw_bank_cmd(0, STOPWATCH_ACTION_TIMEOUT_ACK);
+    g_assert_cmpuint(readq(REG(irq_status)), ==, 0);
+    g_assert_cmpuint(sw_qom_get("irq-levels"), ==, 0);
+    g_assert_cmpuint(sw_qom_get("stats-irqs"), ==, 1);
+
+    /* the device-wide reset drops the armed timeouts */
+    g_assert_cmpint(sw_ring_cmd(STOPWATCH_ACTION_TIMEOUT, 0, 0, 1000, NULL),
+                    ==, STOPWATCH_OK);
+    writeq(REG(command), STOPWATCH_ACTION_RESET);
+    clock_step(1000);
+    g_assert_cmpuint(readq(REG(irq_status)), ==, 0);
+    g_assert_cmpuint(sw_qom_get("stats-irqs"), ==, 1);
+    g_assert_cmpint(sw_ring_cmd(STOPWATCH_ACTION_TIMEOUT, 0, 0, 1000, NULL),
+                    ==, STOPWATCH_OK);
+
+    qtest_end();
+}
+
+/* periodic timeout of bank 1: the periods not acknowledged are coalesced */
+static void test_periodic(void)
+{
+    struct StopWatch_periodic p;
+
+    sw_start();
+
+    g_assert_cmpint(sw_ring_cmd(STOPWATCH_ACTION_PERIODIC, 0, 1,
+                                STOPWATCH_PERIOD_MIN_NS - 1, NULL), ==,
+                    -STOPWATCH_ERR_RANGE);
+    g_assert_cmpint(sw_ring_cmd(STOPWATCH_ACTION_PERIODIC, 0, 1, 0, NULL), ==,
+                    -STOPWATCH_ERR_STATE);
+    g_assert_cmpint(sw_ring_cmd(STOPWATCH_ACTION_PERIODIC, 0, 1, 10000, NULL),
+                    ==, STOPWATCH_OK);
+
+    clock_step(10000);
+    g_assert_cmpuint(readq(REG(irq_status)), ==, BIT(1));
+    g_assert_cmpuint(sw_qom_get("irq-levels"), ==, BIT(0));
+    memread(MEM(periodic[1]), &p, sizeof(p));
+    g_assert_cmpuint(p.period_ns, ==, 10000);
+    g_assert_cmpuint(p.ticks, ==, 1);
+    g_assert_cmpuint(p.overruns, ==, 0);
+
+    /* no ack: no new IRQ, the periods are overruns */
+    clock_step(30000);
+    memread(MEM(periodic[1]), &p, sizeof(p));
+    g_assert_cmpuint(p.ticks, ==, 4);
+    g_assert_cmpuint(p.overruns, ==, 3);
+    g_assert_cmpuint(sw_qom_get("stats-irqs"), ==, 1);
+
+    /* the ack keeps the period running */
+    sw_bank_cmd(1, STOPWATCH_ACTION_TIMEOUT_ACK);
+    g_assert_cmpuint(readq(REG(irq_status)), ==, 0);
+    g_assert_cmpint(sw_ring_cmd(STOPWATCH_ACTION_TIMEOUT, 0, 1, 1000, NULL),
+                    ==, -STOPWATCH_ERR_BUSY);
+
+    clock_step(10000);
+    g_assert_cmpuint(readq(REG(irq_status)), ==, BIT(1));
+    g_assert_cmpuint(sw_qom_get("stats-irqs"), ==, 2);
+
+    /* stopped: the pending period is dropped */
+    g_assert_cmpint(sw_ring_cmd(STOPWATCH_ACTION_PERIODIC, 0, 1, 0, NULL), ==,
+                    STOPWATCH_OK);
+    g_assert_cmpuint(readq(REG(irq_status)), ==, 0);
+    g_assert_cmpuint(sw_qom_get("irq-levels"), ==, 0);
+    memread(MEM(periodic[1]), &p, sizeof(p));
+    g_assert_cmpuint(p.period_ns, ==, 0);
+    g_assert_cmpuint(p.ticks, ==, 5);
+
+    /* the reset of the bank stops it too */
+    g_assert_cmpint(sw_ring_cmd(STOPWATCH_ACTION_PERIODIC, 0, 1, 10000, NULL),
+                    ==, STOPWATCH_OK);
+    clock_step(10000);
+    g_assert_cmpuint(readq(REG(irq_status)), ==, BIT(1));
+    sw_bank_cmd(1, STOPWATCH_ACTION_RESET);
+    g_assert_cmpuint(readq(REG(irq_status)), ==, 0);
+    memread(MEM(periodic[1]), &p, sizeof(p));
+    g_assert_cmpuint(p.period_ns, ==, 0);
+    clock_step(20000);
+    g_assert_cmpuint(readq(REG(irq_status)), ==, 0);
+    g_assert_cmpuint(sw_qom_get("stats-irqs"), ==, 3);
+
+    qtest_end();
+}
+
+/* clock event on line 0: the next write acknowledges, 0 cancels */
+static void test_clockevent(void)
+{
+    int64_t now;
+
+    sw_start();
+
+    now = clock_step(5000);
+    g_assert_cmpuint(readq(REG(clock)), ==, now);
+    g_assert_cmpuint(readq(MEM(clock.resolution_ns)), ==, 0);
+
+    writeq(REG(clockevent), 2000);
+    clock_step(1999);
+    g_assert_cmpuint(readq(REG(irq_status)), ==, 0);
+
+    clock_step(1);
+    g_assert_cmpuint(readq(REG(irq_status)), ==, STOPWATCH_IRQ_CLOCKEVENT);
+    g_assert_cmpuint(readq(REG(line[0].status)), ==, STOPWATCH_IRQ_CLOCKEVENT);
+    g_assert_cmpuint(readq(REG(line[1].status)), ==, 0);
+    g_assert_cmpuint(sw_qom_get("irq-levels"), ==, BIT(0));
+
+    /* re-armed from the handler, below the minimum delta */
+    writeq(REG(clockevent), 10);
+    g_assert_cmpuint(sw_qom_get("irq-levels"), ==, 0);
+    clock_step(STOPWATCH_CLOCKEVENT_MIN_NS - 1);
+    g_assert_cmpuint(readq(REG(irq_status)), ==, 0);
+    clock_step(1);
+    g_assert_cmpuint(readq(REG(irq_status)), ==, STOPWATCH_IRQ_CLOCKEVENT);
+
+    writeq(REG(clockevent), 1000);
+    writeq(REG(clockevent), 0);
+    clock_step(10000);
+    g_assert_cmpuint(readq(REG(irq_status)), ==, 0);
+    g_assert_cmpuint(sw_qom_get("irq-levels"), ==, 0);
+    g_assert_cmpuint(sw_qom_get("stats-irqs"), ==, 2);
+
+    qtest_end();
+}
+
+/* memdev: the header of the shared memory, after the memory of the device */
+static void test_memdev(void)
+{
+    struct StopWatch_shared sh;
+    uint64_t shared;
+
+    qtest_start("-machine virt "
+                "-object memory-backend-ram,id=shm,size=64K,share=on "
+                "-device stopwatch,id=sw,start_at_boot=false,clock=realtime,"
+                "memdev=shm");
+
+    g_assert_cmpuint(readq(MEM(shared_offset)), ==, MEM_SIZE);
+    g_assert_cmpuint(readq(MEM(shared_size)), ==, 0x10000);
+    g_assert_cmpuint(readq(MEM(shared_id)), ==, 1);
+
+    shared = MEM_BASE + readq(MEM(shared_offset));
+    memread(shared, &sh, sizeof(sh));
+    g_assert_cmphex(sh.magic, ==, STOPWATCH_SHARED_MAGIC);
+    g_assert_cmpuint(sh.clock, ==, STOPWATCH_SHARED_CLOCK_REALTIME);
+    g_assert_cmpuint(sh.users, ==, 1);
+    g_assert_cmpuint(STOPWATCH_SHARED_SLOTS(0x10000), >, STOPWATCH_BANKS_MAX);
+
+    /* free and reset, then only written by their owners */
+    g_assert_cmpuint(readq(shared + sizeof(sh)), ==, 0);
+    g_assert_cmpuint(readl(shared + sizeof(sh) +
+                           offsetof(struct StopWatch_shared_slot, time.status)),
+                     ==, STOPWATCH_STATE_RESET);
+
+    qtest_end();
+}
+
+/* timer engine: expiries in deadline order, in the ring of their line */
+static void test_timers(void)
+{
+    struct StopWatch_expiry e;
+    uint64_t deadline;
+
+    sw_start();
+
+    g_assert_cmpint(sw_ring_cmd(STOPWATCH_ACTION_TIMER_ARM, 0, 7, 300,
+                                &deadline), ==, STOPWATCH_OK);
+    g_assert_cmpint(sw_ring_cmd(STOPWATCH_ACTION_TIMER_ARM, 0, 3, 200, NULL),
+                    ==, STOPWATCH_OK);
+    g_assert_cmpint(sw_ring_cmd(STOPWATCH_ACTION_TIMER_ARM,
+                                STOPWATCH_CMD_LINE(1), 9, 100, NULL), ==,
+                    STOPWATCH_OK);
+    g_assert_cmpint(sw_ring_cmd(STOPWATCH_ACTION_TIMER_CANCEL, 0, 9, 0, NULL),
+                    ==, STOPWATCH_OK);
+    g_assert_cmpint(sw_ring_cmd(STOPWATCH_ACTION_TIMER_CANCEL, 0, 9, 0, NULL),
+                    ==, -STOPWATCH_ERR_STATE);
+
+    clock_step(deadline - clock_step(0));
+    g_assert_cmpuint(readl(MEM(expiry[0].tail)), ==, 2);
+    g_assert_cmpuint(readl(MEM(expiry[1].tail)), ==, 0);
+    g_assert_cmpuint(sw_qom_get("irq-levels"), ==, BIT(0));
+
+    memread(MEM(expiry[0].entries[0]), &e, sizeof(e));
+    g_assert_cmpuint(e.id, ==, 3);
+    memread(MEM(expiry[0].entries[1]), &e, sizeof(e));
+    g_assert_cmpuint(e.id, ==, 7);
+    g_assert_cmpuint(e.deadline_ns, ==, deadline);
+
+    /* consumed and acknowledged: the line goes down */
+    writel(MEM(expiry[0].head), 2);
+    writeq(REG(line[0].ack), 1);
+    g_assert_cmpuint(sw_qom_get("irq-levels"), ==, 0);
+    g_assert_cmpuint(readq(REG(irq_status)), ==, 0);
+
+    qtest_end();
+}
+
+/* a full expiry ring holds back its line only */
+static void test_timers_full(void)
+{
+    uint64_t deadline;
+    int i;
+
+    sw_start();
+
+    for (i = 0; i <= STOPWATCH_EXPIRY_RING_SIZE; i++) {
+        g_assert_cmpint(sw_ring_cmd(STOPWATCH_ACTION_TIMER_ARM, 0, i, 100,
+                                    NULL), ==, STOPWATCH_OK);
+    }
+    g_assert_cmpint(sw_ring_cmd(STOPWATCH_ACTION_TIMER_ARM,
+                                STOPWATCH_CMD_LINE(1), i, 200, &deadline), ==,
+                    STOPWATCH_OK);
+
+    clock_step(deadline - clock_step(0));
+    g_assert_cmpuint(readl(MEM(expiry[0].tail)), ==,
+                     STOPWATCH_EXPIRY_RING_SIZE);
+    g_assert_cmpuint(readl(MEM(expiry[1].tail)), ==, 1);
+
+    /* the held timer is posted at the ack */
+    writel(MEM(expiry[0].head), STOPWATCH_EXPIRY_RING_SIZE);
+    writeq(REG(line[0].ack), 1);
+    g_assert_cmpuint(readl(MEM(expiry[0].tail)), ==,
+                     STOPWATCH_EXPIRY_RING_SIZE + 1);
+    g_assert_cmpuint(sw_qom_get("irq-levels"), ==, BIT(0) | BIT(1));
+
+    qtest_end();
+}
+
+static void perf_register(void)
+{
+    int64_t start, elapsed;
+    int i;
+
+    sw_start();
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < PERF_COMMANDS; i++) {
+        sw_bank_cmd(0, STOPWATCH_ACTION_UPDATE);
+    }
+    elapsed = g_get_monotonic_time() - start;
+
+    g_assert_cmpuint(sw_qom_get("stats-commands"), ==, PERF_COMMANDS);
+    g_test_message("register: %.0f ns/command",
+                   elapsed * 1000.0 / PERF_COMMANDS);
+
+    qtest_end();
+}
+
+static void perf_ring(void)
+{
+    struct StopWatch_cmd cmds[STOPWATCH_RING_SIZE];
+    int64_t start, elapsed;
+    int i;
+
+    sw_start();
+
+    for (i = 0; i < STOPWATCH_RING_SIZE; i++) {
+        cmds[i] = (struct StopWatch_cmd) {
+            .action = STOPWATCH_ACTION_UPDATE, .index = i % NB_BANKS, .tag = i,
+        };
+    }
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < PERF_COMMANDS / STOPWATCH_RING_SIZE; i++) {
+        sw_ring_submit(cmds, NULL, STOPWATCH_RING_SIZE);
+    }
+    elapsed = g_get_monotonic_time() - start;
+
+    g_test_message("ring: %.0f ns/command",
+                   elapsed * 1000.0 / (i * STOPWATCH_RING_SIZE));
+
+    qtest_end();
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/stopwatch/regs", test_regs);
+    qtest_add_func("/stopwatch/state_machine", test_state_machine);
+    qtest_add_func("/stopwatch/timeout", test_timeout);
+    qtest_add_func("/stopwatch/periodic", test_periodic);
+    qtest_add_func("/stopwatch/clockevent", test_clockevent);
+    qtest_add_func("/stopwatch/memdev", test_memdev);
+    qtest_add_func("/stopwatch/timers", test_timers);
+    qtest_add_func("/stopwatch/timers_full", test_timers_full);
+
+    if (g_test_perf()) {
+        qtest_add_func("/stopwatch/perf/register", perf_register);
+        qtest_add_func("/stopwatch/perf/ring", perf_ring);
+    }
+
+    return g_test_run();
+}
@@ -3,243 +3,151 @@
 #include "hw/sysbus.h"
 #include "qemu/error-report.h"
 #include "qapi/error.h"
-#include "qemu/timer.h"
+#include "qemu/atomic.h"
+#include "qemu/main-loop.h"
+#include "block/aio.h"
+#include "sysemu/iothread.h"
+#include "migration/vmstate.h"
+#include "trace.h"
 
-#include "sys/mman.h"
 #include <stddef.h>
 
 #include "hw/misc/stopwatch.h"
+#include "hw/misc/stopwatch_core.h"
 #include "../../driver/stopwatch_hw-sw.h"
 
-static double get_running_time(struct StopWatchState *s) {
-    time_t end;
-
-    time(&end);
-
-    return difftime(end, s->started_at);
-}
-
-static int stopwatch_action(struct StopWatchState *s, uint64_t command) {
-    switch(command) {
-    case STOPWATCH_ACTION_RESET:
-        STOPWATCH_PRINT("%s: COMMAND reset\n", __func__);
-
-        s->status = STOPWATCH_STATE_RESET;
-        s->total_time_s = 0;
-        s->started_at = 0;
-
-        return 0;
-        ;;
-    case STOPWATCH_ACTION_START:
-        if (s->status != STOPWATCH_STATE_RESET
-            && s->status != STOPWATCH_STATE_PAUSED) {
-            hw_error("COMMAND start: Stopwatch isn't in"
-                     " reset/paused state (%ld)", s->status);
-        }
-
-        STOPWATCH_PRINT("%s: COMMAND start\n", __func__);
-
-        s->status = STOPWATCH_STATE_RUNNING;
-        time(&s->started_at);
-
-        return 0;
-        ;;
-    case STOPWATCH_ACTION_PAUSE:
-        if (s->status == STOPWATCH_STATE_PAUSED) {
-            STOPWATCH_PRINT("%s: COMMAND pause: already paused\n", __func__);
-
-            return 0;
-        }
-        if (s->status != STOPWATCH_STATE_RUNNING) {
-            hw_error("COMMAND pause: Stopwatch wasn't running (%ld)", s->status);
-        }
-
-        STOPWATCH_PRINT("%s: COMMAND pause\n", __func__);
-
-        s->status = STOPWATCH_STATE_PAUSED;
-
-        s->total_time_s += get_running_time(s);
-
-        return 0;
-        ;;
-    case STOPWATCH_ACTION_UPDATE:
-    {
-        double time = s->total_time_s;
-        if (s->status == STOPWATCH_STATE_RUNNING) {
-            time += get_running_time(s);
-        }
-
-        snprintf(s->mem_ptr->data, STOPWATCH_MEM_DATA_LENGTH, "%.2lf seconds", time);
-        s->mem_ptr->data_len = strlen(s->mem_ptr->data) + 1;
-
-        STOPWATCH_PRINT("%s: COMMAND update: %s (len=%ld)\n", __func__,
-                        s->mem_ptr->data, s->mem_ptr->data_len);
-
-        return 0;
-        ;;
-    }
-    case STOPWATCH_ACTION_TIMEOUT:
-    {
-        uint64_t timeout = s->mem_ptr->data_len;
-        if (timeout > STOPWATCH_TIMEOUT_MAX) {
-            hw_error("COMMAND timeout: Stopwatch cannot wait more than %ds "
-                     "(%lds requested)", STOPWATCH_TIMEOUT_MAX, timeout);
-        }
-        if (s->timeout_ongoing) {
-            STOPWATCH_PRINT("%s: COMMAND timeout: timer already ongoing ...\n",
-                            __func__);
-            return 0;
-        }
-
-        s->timeout_ongoing = true;
-        timer_mod(s->timeout_timer,
-                  qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) + timeout * 1000);
-
-        STOPWATCH_PRINT("%s: COMMAND timeout: %ld-second timer started\n",
-                        __func__, timeout);
-
-        return 0;
-        ;;
-    }
-    case STOPWATCH_ACTION_TIMEOUT_ACK:
-        if (!s->timeout_ongoing) {
-            hw_error("COMMAND timeout_ack: Timeout IRQ not ongoing ...");
-        }
-        s->timeout_ongoing = false;
-        qemu_set_irq(s->timeout_irq, 0);
-
-        STOPWATCH_PRINT("%s: COMMAND timeout ack: IRQ turned off\n", __func__);
-        return 0;
-        ;;
-    default:
-        STOPWATCH_PRINT("%s: COMMAND invalid: 0x%lx\n", __func__, command);
-        ;;
-    }
-    return 1;
-}
-
-static void stopwatch_timeout_cb(void *opaque) {
-    struct StopWatchState *s = opaque;
-
-    STOPWATCH_PRINT("%s: COMMAND timeout: timeout !\n", __func__);
-    assert(s->timeout_ongoing);
-
-    qemu_set_irq(s->timeout_irq, 1);
-}
-
-
-static int stopwatch_init(struct StopWatchState *s) {
-    stopwatch_action(s, STOPWATCH_ACTION_RESET);
-
-    if (s->start_at_boot) {
-        stopwatch_action(s, STOPWATCH_ACTION_START);
-    }
-
-    s->timeout_timer = timer_new_ms(QEMU_CLOCK_VIRTUAL, stopwatch_timeout_cb, s);
-    s->timeout_ongoing = false;
-
-    return 0;
-}
-
-/***************************/
+/*
+ * Sysbus transport of the stopwatch engine (stopwatch_core.c): the
+ * registers, the pass-through memory, one IRQ per line and the FDT node.
+ */
 
-static void stopwatch_io_write(void *opaque, hwaddr offset, uint64_t command,
-                               unsigned size)
+/* level of each line, with the BQL held, see stopwatch_core_flush_irqs */
+static void stopwatch_set_irqs(void *opaque, uint32_t levels, uint64_t events)
 {
     struct StopWatchState *s = opaque;
+    int i;
 
-    switch(offset) {
-    case offsetof(struct StopWatch_regs, command):
-        STOPWATCH_PRINT("%s: COMMAND value: 0x%lx\n", __func__, command);
-        if (stopwatch_action(s, command)) {
-            hw_error("invalid action (%ld)", command);
-        }
-        break;
-        ;;
-    default:
-        STOPWATCH_PRINT("%s: offset: WRITE at %"HWADDR_PRIx" is INVALID (command: 0x%lx)\n",
-                        __func__, offset, command);
-        hw_error("invalid write");
-        ;;
+    for (i = 0; i < s->core.nb_irqs; i++) {
+        qemu_set_irq(s->irqs[i], !!(levels & BIT(i)));
     }
 }
 
-static uint64_t stopwatch_io_read(void *opaque, hwaddr offset,
-                                  unsigned size)
-{
-    struct StopWatchState *s = opaque;
-    uint64_t value = 0;
-
-    switch(offset) {
-    case offsetof(struct StopWatch_regs, status):
-        value = s->status;
-        STOPWATCH_PRINT("%s: STATUS: 0x%lx\n", __func__, value);
-        break;
-        ;;
-    default:
-        STOPWATCH_PRINT("%s: offset: READ at %"HWADDR_PRIx" is INVALID\n",
-                        __func__, offset);
-        hw_error("invalid read");
-        ;;
-    }
-    return value;
-}
-
-static const MemoryRegionOps stopwatch_regs_ops = {
-    .write = stopwatch_io_write,
-    .read = stopwatch_io_read,
-    .impl = {
-        .min_access_size = 8,
-        .max_access_size = 8,
-    },
-    .endianness = DEVICE_NATIVE_ENDIAN,
-};
-
 
 static Property stopwatch_properties[] = {
-    DEFINE_PROP_BOOL("start_at_boot", struct StopWatchState, start_at_boot,
-                     true),
+    DEFINE_PROP_BOOL("start_at_boot", struct StopWatchState,
+                     core.start_at_boot, true),
+    DEFINE_PROP_STRING("clock", struct StopWatchState, core.clock_name),
+    DEFINE_PROP_UINT32("banks", struct StopWatchState, core.nb_banks, 1),
+    DEFINE_PROP_UINT32("irqs", struct StopWatchState, core.nb_irqs, 1),
+    DEFINE_PROP_STRING("trace_file", struct StopWatchState, core.trace_file),
+    DEFINE_PROP_BOOL("ioeventfd", struct StopWatchState, regs.ioeventfd, true),
+    DEFINE_PROP_BOOL("clock_page", struct StopWatchState, core.clock_page,
+                     false),
+    DEFINE_PROP_UINT32("clock_page_us", struct StopWatchState,
+                       core.clock_page_us, 10),
+    DEFINE_PROP_LINK("iothread", struct StopWatchState, iothread,
+                     TYPE_IOTHREAD, IOThread *),
+    DEFINE_PROP_LINK("memdev", struct StopWatchState, mem.memdev,
+                     TYPE_MEMORY_BACKEND, HostMemoryBackend *),
     DEFINE_PROP_END_OF_LIST(),
 };
 
-#define STOPWATCH_IO_REGS_SIZE (sizeof(struct StopWatch_regs))
-#define STOPWATCH_IO_MEM_SIZE (sizeof(struct StopWatch_mem))
-
 static void stopwatch_realize(DeviceState *dev, Error **errp)
 {
     struct StopWatchState *s = STOPWATCH(dev);
     SysBusDevice *sbd = SYS_BUS_DEVICE(dev);
+    AioContext *ctx;
+    int i;
 
     /*
      * Instanciation of the virtual device
      */
 
-    s->mem_ptr = mmap(0, STOPWATCH_IO_MEM_SIZE, PROT_READ|PROT_WRITE,
-                      MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-    if (s->mem_ptr == MAP_FAILED) {
-        error_setg_errno(errp, errno, "Unable to allocate the stopwatch memory");
+    if (!stopwatch_mem_init(&s->mem, OBJECT(s), STOPWATCH_IO_MEM_SIZE,
+                            errp)) {
         return;
     }
 
-    memory_region_init_ram_ptr(&s->mem, OBJECT(s), TYPE_STOPWATCH"-mem",
-                               STOPWATCH_IO_MEM_SIZE, s->mem_ptr);
+    /* the timers and the doorbell run in the iothread, if any */
+    if (s->iothread) {
+        ctx = iothread_get_aio_context(s->iothread);
+    } else {
+        ctx = qemu_get_aio_context();
+    }
 
-    memory_region_init_io(&s->regs, OBJECT(s), &stopwatch_regs_ops, s,
-                          TYPE_STOPWATCH"-regs", STOPWATCH_IO_REGS_SIZE);
+    s->core.irq_func = stopwatch_set_irqs;
+    s->core.irq_opaque = s;
+    s->core.dirty_func = stopwatch_mem_set_dirty;
+    s->core.dirty_opaque = &s->mem;
+    if (!stopwatch_core_realize(&s->core, ctx, s->mem.ptr, errp)) {
+        stopwatch_mem_cleanup(&s->mem);
+        return;
+    }
 
+    if (!stopwatch_mem_share(&s->mem, &s->core, errp)) {
+        stopwatch_core_unrealize(&s->core);
+        stopwatch_mem_cleanup(&s->mem);
+        return;
+    }
 
-    sysbus_init_mmio(sbd, &s->mem);
-    sysbus_init_mmio(sbd, &s->regs);
-    sysbus_init_irq(sbd, &s->timeout_irq);
+    stopwatch_regs_init(&s->regs, OBJECT(s), &s->core);
 
-    stopwatch_init(s);
+    sysbus_init_mmio(sbd, &s->mem.mr);
+    sysbus_init_mmio(sbd, &s->regs.mr);
+    for (i = 0; i < s->core.nb_irqs; i++) {
+        sysbus_init_irq(sbd, &s->irqs[i]);
+    }
+
+    stopwatch_core_vm_init(&s->core);
 }
 
 static void stopwatch_unrealize(DeviceState *dev, Error **errp)
 {
     struct StopWatchState*s = STOPWATCH(dev);
 
-    munmap(s->mem_ptr, STOPWATCH_IO_MEM_SIZE);
+    stopwatch_core_vm_cleanup(&s->core);
+    stopwatch_regs_cleanup(&s->regs);
+    stopwatch_core_unrealize(&s->core);
+    stopwatch_mem_cleanup(&s->mem);
+}
+
+/*
+ * Migration: the shared memory is RAM and migrates on its own, the
+ * engine state is in vmstate_stopwatch_core.
+ */
+static const VMStateDescription vmstate_stopwatch = {
+    .name = TYPE_STOPWATCH,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT(core, struct StopWatchState, 1, vmstate_stopwatch_core,
+                       struct StopWatchCore),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static void stopwatch_instance_init(Object *obj)
+{
+    struct StopWatchState *s = STOPWATCH(obj);
+
+    object_property_add_uint64_ptr(obj, "stats-commands",
+                                   &s->core.stats.commands, &error_abort);
+    object_property_add_uint64_ptr(obj, "stats-irqs", &s->core.stats.irqs,
+                                   &error_abort);
+    object_property_add_uint64_ptr(obj, "stats-reads", &s->core.stats.reads,
+                                   &error_abort);
+    object_property_add_uint64_ptr(obj, "stats-errors", &s->core.stats.errors,
+                                   &error_abort);
+    /* one bit per line, for the qtest (no interception of sysbus IRQs) */
+    object_property_add_uint32_ptr(obj, "irq-levels", &s->core.irq_levels,
+                                   &error_abort);
+}
+
+static void stopwatch_reset(DeviceState *dev)
+{
+    struct StopWatchState *s = STOPWATCH(dev);
+
+    stopwatch_core_reset(&s->core);
 }
 
 static void stopwatch_class_init(ObjectClass *klass, void *data)
@@ -249,6 +157,8 @@ static void stopwatch_class_init(ObjectClass *klass, void *data)
     dc->props = stopwatch_properties;
     dc->realize = stopwatch_realize;
     dc->unrealize = stopwatch_unrealize;
+    dc->reset = stopwatch_reset;
+    dc->vmsd = &vmstate_stopwatch;
     dc->user_creatable = true;
 
     set_bit(DEVICE_CATEGORY_MISC, dc->categories);
@@ -258,6 +168,7 @@ static const TypeInfo stopwatch_info = {
     .name           = TYPE_STOPWATCH,
     .parent         = TYPE_SYS_BUS_DEVICE,
     .instance_size  = sizeof(struct StopWatchState),
+    .instance_init  = stopwatch_instance_init,
     .class_init     = stopwatch_class_init,
     .class_size     = sizeof(struct StopWatchDeviceClass),
 };
@@ -300,6 +211,7 @@ int add_stopwatch_fdt_node(SysBusDevice *sbdev, void *opaque)
     char *nodename;
     uint32_t *irq_attr, *reg_attr;
     uint64_t mmio_base, irq_number;
+    int i;
 
     const int NB_MEM_REGION = 2;
 
@@ -316,12 +228,12 @@ int add_stopwatch_fdt_node(SysBusDevice *sbdev, void *opaque)
     /* io memory region */
     mmio_base = platform_bus_get_mmio_addr(pbus, sbdev, 0);
     reg_attr[0] = cpu_to_be32(mmio_base);
-    reg_attr[1] = cpu_to_be32(memory_region_size(&stopwatch_state->mem));
+    reg_attr[1] = cpu_to_be32(memory_region_size(&stopwatch_state->mem.mr));
 
     /* regs memory region */
     mmio_base = platform_bus_get_mmio_addr(pbus, sbdev, 1);
     reg_attr[2] = cpu_to_be32(mmio_base);
-    reg_attr[3] = cpu_to_be32(memory_region_size(&stopwatch_state->regs));
+    reg_attr[3] = cpu_to_be32(memory_region_size(&stopwatch_state->regs.mr));
 
     /* main 'reg' node */
     ret = qemu_fdt_setprop(fdt, nodename, "reg", reg_attr,
@@ -331,22 +243,21 @@ int add_stopwatch_fdt_node(SysBusDevice *sbdev, void *opaque)
         goto fail;
     }
 
-#define STOPWATCH_NB_IRQ 1
-#define STOPWATCH_TIMEOUT_IRQ_IDX 0
+    /* one SPI per IRQ line, in line order */
+    irq_attr = g_new(uint32_t, stopwatch_state->core.nb_irqs * 3);
+    for (i = 0; i < stopwatch_state->core.nb_irqs; i++) {
+        irq_number = platform_bus_get_irqn(pbus, sbdev, i) + data->irq_start;
+        error_report("Register IRQ #%u for Stopwatch device (line %d)",
+                     (unsigned int) irq_number, i);
 
-    irq_attr = g_new(uint32_t, STOPWATCH_NB_IRQ * 3);
-    irq_number = platform_bus_get_irqn(pbus, sbdev ,STOPWATCH_TIMEOUT_IRQ_IDX)
-        + data->irq_start;
-    error_report("Register IRQ #%u for Stopwatch device",
-                 (unsigned int) irq_number);
-
-    irq_attr[3 * STOPWATCH_TIMEOUT_IRQ_IDX] = cpu_to_be32(GIC_FDT_IRQ_TYPE_SPI);
-    irq_attr[3 * STOPWATCH_TIMEOUT_IRQ_IDX + 1] = cpu_to_be32(irq_number);
-    irq_attr[3 * STOPWATCH_TIMEOUT_IRQ_IDX + 2] =
-                                        cpu_to_be32(GIC_FDT_IRQ_FLAGS_LEVEL_HI);
+        irq_attr[3 * i] = cpu_to_be32(GIC_FDT_IRQ_TYPE_SPI);
+        irq_attr[3 * i + 1] = cpu_to_be32(irq_number);
+        irq_attr[3 * i + 2] = cpu_to_be32(GIC_FDT_IRQ_FLAGS_LEVEL_HI);
+    }
 
     qemu_fdt_setprop(fdt, nodename, "interrupts",
-                     irq_attr, STOPWATCH_NB_IRQ * 3 * sizeof(uint32_t));
+                     irq_attr, stopwatch_state->core.nb_irqs * 3 * sizeof(uint32_t));
+    g_free(irq_attr);
 fail:
     g_free(nodename);
     g_free(reg_attr);
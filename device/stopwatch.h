@@ -1,48 +1,103 @@
 #ifndef HW_MISC_STOPWATCH_H
 #define HW_MISC_STOPWATCH_H
 
-#define TYPE_STOPWATCH            "stopwatch"
+#include "hw/sysbus.h"
+#include "hw/pci/pci.h"
+#include "qemu/event_notifier.h"
+#include "sysemu/iothread.h"
+#include "sysemu/hostmem.h"
 
-#define DEBUG_STOPWATCH
-#ifdef DEBUG_STOPWATCH
-#define STOPWATCH_PRINT(fmt, ...) \
-    do {fprintf(stderr, TYPE_STOPWATCH " - " fmt, ## __VA_ARGS__);      \
-        fflush(stdout);                                                 \
-    } while (0)
-#else
-#define STOPWATCH_PRINT(fmt, ...)
-#endif
+#include "hw/misc/stopwatch_core.h"
+
+#define TYPE_STOPWATCH            "stopwatch"
 
 #define STOPWATCH_COMPAT_STR TYPE_STOPWATCH /* Device Tree compatible string */
 
+#define TYPE_STOPWATCH_PCI        "stopwatch-pci"
+
 #define STOPWATCH(obj) \
                 OBJECT_CHECK(struct StopWatchState, (obj), TYPE_STOPWATCH)
+#define STOPWATCH_PCI(obj) \
+                OBJECT_CHECK(struct StopWatchPCIState, (obj), TYPE_STOPWATCH_PCI)
+
+/* register bank of the device, see stopwatch_mmio.c */
+struct StopWatchRegs {
+    MemoryRegion mr;
+    struct StopWatchCore *core;
+
+    bool ioeventfd; /* doorbell through an eventfd, processed asynchronously */
+    EventNotifier doorbell_notifier;
+};
+
+#define STOPWATCH_IO_MEM_SIZE \
+    QEMU_ALIGN_UP(sizeof(struct StopWatch_mem), STOPWATCH_MEM_ALIGN)
+
+/*
+ * Pass-through memory of the device, see stopwatch_mmio.c: its own RAM,
+ * then the shared memory backend, if any, at shared_offset.
+ */
+struct StopWatchMem {
+    MemoryRegion mr;
+    MemoryRegion ram;
+    MemoryRegion shared; /* alias of the memdev */
+    struct StopWatch_mem *ptr; /* the RAM */
+
+    HostMemoryBackend *memdev; /* property, NULL if not shared */
+};
+
+/* after stopwatch_core_realize: the doorbell runs in the context of @core */
+void stopwatch_regs_init(struct StopWatchRegs *r, Object *owner,
+                         struct StopWatchCore *core);
+void stopwatch_regs_cleanup(struct StopWatchRegs *r);
+/*
+ * Zeroed RAM of @size for the memory, named after the instance, followed
+ * by the memdev if set
+ */
+bool stopwatch_mem_init(struct StopWatchMem *m, Object *owner, uint64_t size,
+                        Error **errp);
+/* after stopwatch_core_realize: attach to the memdev with the clock of @core */
+bool stopwatch_mem_share(struct StopWatchMem *m, struct StopWatchCore *core,
+                         Error **errp);
+void stopwatch_mem_cleanup(struct StopWatchMem *m);
+/* StopWatchDirtyFunc of the RAM, @opaque is the struct StopWatchMem */
+void stopwatch_mem_set_dirty(void *opaque, uint64_t offset, uint64_t len);
 
 struct StopWatchState {
     /*< private >*/
     SysBusDevice dev;
 
     /*< public >*/
-    MemoryRegion regs;
+    struct StopWatchRegs regs;
 
-    MemoryRegion mem;
+    struct StopWatchMem mem;
 
-    qemu_irq timeout_irq;
+    qemu_irq irqs[STOPWATCH_IRQS_MAX];
 
     /*< properties >*/
 
-    bool start_at_boot;
+    struct StopWatchCore core; /* banks, irqs, clock, ... */
+    IOThread *iothread; /* runs the timers and the doorbell, or main loop */
+};
 
-    /*< internal state >*/
+/*
+ * PCI transport: the registers in BAR 0, the memory in BAR 2, one MSI-X
+ * vector per bank and per line of timers, see stopwatch_hw-sw.h.
+ */
+struct StopWatchPCIState {
+    /*< private >*/
+    PCIDevice dev;
+
+    /*< public >*/
+    MemoryRegion regs_bar; /* regs.mr, padded to a power of 2 */
+    struct StopWatchRegs regs;
 
-    struct StopWatch_mem *mem_ptr;
+    MemoryRegion mem_bar; /* mem.mr, padded to a power of 2 */
+    struct StopWatchMem mem;
 
-    uint64_t status;
-    time_t started_at;
-    double total_time_s;
+    /*< properties >*/
 
-    QEMUTimer *timeout_timer;
-    bool timeout_ongoing;
+    struct StopWatchCore core; /* banks, irqs, clock, ... */
+    IOThread *iothread; /* runs the timers and the doorbell, or main loop */
 };
 
 struct StopWatchDeviceClass {
@@ -0,0 +1,1546 @@
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "qapi/error.h"
+#include "qemu/timer.h"
+#include "qemu/atomic.h"
+#include "qemu/main-loop.h"
+#include "block/aio.h"
+#include "trace.h"
+
+#include <stddef.h>
+
+#include "hw/misc/stopwatch_core.h"
+#include "hw/misc/stopwatch_tracefile.h"
+#include "../../driver/stopwatch_hw-sw.h"
+
+static int64_t get_clock_ns(struct StopWatchCore *s) {
+    return qemu_clock_get_ns(s->clock_type);
+}
+
+/* trace threads: one per bank, the command ring, the timers and the lines */
+#define STOPWATCH_TRACE_TID_CMD 99
+#define STOPWATCH_TRACE_TID_TIMERS 100
+#define STOPWATCH_TRACE_TID_IRQ 200
+
+static void stopwatch_trace(struct StopWatchCore *s, const char *cat,
+                            const char *name, char ph, uint32_t tid,
+                            uint64_t id, uint64_t arg) {
+    if (s->tracefile) {
+        stopwatch_tracefile_event(s->tracefile, cat, name, ph, tid, id,
+                                  get_clock_ns(s), arg);
+    }
+}
+
+static int64_t get_running_time(struct StopWatchBank *b) {
+    return get_clock_ns(b->sw) - b->started_at_ns;
+}
+
+static void stopwatch_mem_dirty(struct StopWatchCore *s, const void *ptr,
+                                size_t len) {
+    if (s->dirty_func) {
+        s->dirty_func(s->dirty_opaque,
+                      (const uint8_t *) ptr - (const uint8_t *) s->mem_ptr,
+                      len);
+    }
+}
+
+/*
+ * Publish the stopwatch state in the time page of the pass-through
+ * memory, so that the guest can compute the current value without
+ * trapping. Odd sequence numbers mean that an update is in progress.
+ */
+static void stopwatch_publish_time(struct StopWatchBank *b) {
+    struct StopWatch_time *t = &b->sw->mem_ptr->time[b->index];
+    uint32_t seq = atomic_read(&t->seq);
+
+    atomic_set(&t->seq, seq + 1);
+    smp_wmb();
+
+    t->status = b->status;
+    t->started_at_ns = b->started_at_ns;
+    t->total_ns = b->total_time_ns;
+    t->now_ns = get_clock_ns(b->sw);
+
+    smp_wmb();
+    atomic_set(&t->seq, seq + 2);
+
+    stopwatch_mem_dirty(b->sw, t, sizeof(*t));
+}
+
+/* irq_status restricted to the banks and timers routed to @line */
+static uint64_t stopwatch_line_status(struct StopWatchCore *s, uint32_t line) {
+    uint64_t status = 0;
+    int i;
+
+    for (i = 0; i < s->nb_banks; i++) {
+        if (s->banks[i].line == line) {
+            status |= s->irq_status & BIT_ULL(i);
+        }
+    }
+    if (s->timer_irq_lines & BIT(line)) {
+        status |= STOPWATCH_IRQ_TIMERS;
+    }
+    if (line == 0) {
+        status |= s->irq_status & STOPWATCH_IRQ_CLOCKEVENT;
+    }
+    return status;
+}
+
+static uint64_t stopwatch_value(struct StopWatchBank *b) {
+    int64_t time = b->total_time_ns;
+
+    if (b->status == STOPWATCH_STATE_RUNNING) {
+        time += get_running_time(b);
+    }
+    return time;
+}
+
+/*
+ * Record a lap of @b, at stopwatch value @value, in the lap ring and the
+ * lap statistics. The guest reads them under the sequence counter.
+ */
+static void stopwatch_record_lap(struct StopWatchBank *b, uint64_t value) {
+    struct StopWatch_laps *laps = &b->sw->mem_ptr->laps[b->index];
+    uint64_t lap = value - b->last_lap_ns;
+    uint32_t seq = atomic_read(&laps->seq);
+    struct StopWatch_lap *e;
+
+    b->last_lap_ns = value;
+
+    atomic_set(&laps->seq, seq + 1);
+    smp_wmb();
+
+    e = &laps->ring[laps->tail % STOPWATCH_LAP_RING_SIZE];
+    e->value_ns = value;
+    e->lap_ns = lap;
+    laps->tail++;
+
+    if (!laps->count || lap < laps->min_ns) {
+        laps->min_ns = lap;
+    }
+    if (lap > laps->max_ns) {
+        laps->max_ns = lap;
+    }
+    laps->count++;
+    laps->sum_ns += lap;
+    laps->hist[stopwatch_hist_bucket(lap)]++;
+
+    smp_wmb();
+    atomic_set(&laps->seq, seq + 2);
+
+    stopwatch_mem_dirty(b->sw, laps, sizeof(*laps));
+
+    stopwatch_trace(b->sw, "bank", "lap", 'i', b->index, 0, lap);
+}
+
+/* The lap ring is kept, only the statistics restart */
+static void stopwatch_clear_laps(struct StopWatchBank *b) {
+    struct StopWatch_laps *laps = &b->sw->mem_ptr->laps[b->index];
+    uint32_t seq = atomic_read(&laps->seq);
+
+    atomic_set(&laps->seq, seq + 1);
+    smp_wmb();
+
+    laps->count = 0;
+    laps->min_ns = 0;
+    laps->max_ns = 0;
+    laps->sum_ns = 0;
+    memset(laps->hist, 0, sizeof(laps->hist));
+
+    smp_wmb();
+    atomic_set(&laps->seq, seq + 2);
+
+    stopwatch_mem_dirty(b->sw, laps, sizeof(*laps));
+}
+
+/*
+ * Recompute the line levels, with s->shared_lock held. The lines
+ * themselves are set by stopwatch_core_flush_irqs, once the locks are
+ * released.
+ */
+static void stopwatch_update_irq(struct StopWatchCore *s) {
+    int i;
+
+    for (i = 0; i < s->nb_irqs; i++) {
+        bool level = stopwatch_line_status(s, i) != 0;
+
+        if (level != !!(s->irq_levels & BIT(i))) {
+            s->irq_levels ^= BIT(i);
+            if (level) {
+                atomic_inc(&s->stats.irqs);
+            }
+            trace_stopwatch_irq(i, level);
+            stopwatch_trace(s, "irq", level ? "raise" : "lower", 'i',
+                            STOPWATCH_TRACE_TID_IRQ + i, 0, i);
+            atomic_set(&s->irq_pending, true);
+        }
+    }
+}
+
+/*
+ * Propagate the line levels and the events to the transport, which
+ * needs the BQL (interrupt controller, virtqueues): the iothread only
+ * takes it when something changed. The state is read after irq_pending
+ * is cleared, so the last change always wins.
+ */
+void stopwatch_core_flush_irqs(struct StopWatchCore *s) {
+    bool bql = qemu_mutex_iothread_locked();
+    uint32_t levels;
+    uint64_t events;
+
+    if (!atomic_xchg(&s->irq_pending, false)) {
+        return;
+    }
+
+    if (!bql) {
+        qemu_mutex_lock_iothread();
+    }
+
+    qemu_mutex_lock(&s->shared_lock);
+    levels = s->irq_levels;
+    events = s->irq_events;
+    s->irq_events = 0;
+    qemu_mutex_unlock(&s->shared_lock);
+
+    s->irq_func(s->irq_opaque, levels, events);
+
+    if (!bql) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
+static void stopwatch_count_command(struct StopWatchCore *s, int ret) {
+    atomic_inc(&s->stats.commands);
+    if (ret != STOPWATCH_OK) {
+        atomic_inc(&s->stats.errors);
+    }
+}
+
+/*
+ * Periodic timeout: the timeout timer of the bank is re-armed at each
+ * expiry, see stopwatch_periodic_expire. With b->lock held.
+ */
+static void stopwatch_periodic_start(struct StopWatchBank *b,
+                                     uint64_t period_ns) {
+    struct StopWatchCore *s = b->sw;
+    struct StopWatch_periodic *p = &s->mem_ptr->periodic[b->index];
+
+    if (b->period_ns) {
+        stopwatch_trace(s, "bank", "periodic", 'E', b->index, b->index, 0);
+    }
+
+    b->period_ns = period_ns;
+    b->period_deadline_ns = get_clock_ns(s) + period_ns;
+    b->period_pending = false;
+    b->timeout_ongoing = true;
+    timer_mod(b->timeout_timer, b->period_deadline_ns);
+
+    atomic_set(&p->ticks, 0);
+    atomic_set(&p->overruns, 0);
+    atomic_set(&p->next_ns, b->period_deadline_ns);
+    atomic_set(&p->period_ns, period_ns);
+    stopwatch_mem_dirty(s, p, sizeof(*p));
+
+    stopwatch_trace(s, "bank", "periodic", 'B', b->index, b->index,
+                    period_ns);
+}
+
+static void stopwatch_periodic_stop(struct StopWatchBank *b) {
+    struct StopWatchCore *s = b->sw;
+
+    timer_del(b->timeout_timer);
+    b->period_ns = 0;
+    b->period_pending = false;
+    b->timeout_ongoing = false;
+
+    /* the period not acknowledged yet is dropped with the timeout */
+    qemu_mutex_lock(&s->shared_lock);
+    s->irq_status &= ~BIT_ULL(b->index);
+    stopwatch_update_irq(s);
+    qemu_mutex_unlock(&s->shared_lock);
+
+    atomic_set(&s->mem_ptr->periodic[b->index].period_ns, 0);
+    stopwatch_mem_dirty(s, &s->mem_ptr->periodic[b->index],
+                        sizeof(s->mem_ptr->periodic[b->index]));
+
+    stopwatch_trace(s, "bank", "periodic", 'E', b->index, b->index, 0);
+}
+
+/*
+ * Drop the timeout of @b, one-shot or periodic, with its IRQ if pending.
+ * With b->lock held.
+ */
+static void stopwatch_timeout_cancel(struct StopWatchBank *b) {
+    struct StopWatchCore *s = b->sw;
+
+    if (b->period_ns) {
+        stopwatch_periodic_stop(b);
+        return;
+    }
+    if (!b->timeout_ongoing) {
+        return;
+    }
+
+    timer_del(b->timeout_timer);
+    b->timeout_ongoing = false;
+
+    qemu_mutex_lock(&s->shared_lock);
+    s->irq_status &= ~BIT_ULL(b->index);
+    stopwatch_update_irq(s);
+    qemu_mutex_unlock(&s->shared_lock);
+
+    stopwatch_trace(s, "bank", "timeout", 'e', b->index, b->index, 0);
+}
+
+/*
+ * Expiry of a period, with b->lock held: count the periods elapsed
+ * (more than one if the device was late), re-arm at the next one, and
+ * raise the timeout unless the previous one is not acknowledged yet, in
+ * which case the periods are only counted as overruns. The MSI-X
+ * vectors leave no pending status: period_pending tracks the ack.
+ */
+static void stopwatch_periodic_expire(struct StopWatchBank *b) {
+    struct StopWatchCore *s = b->sw;
+    struct StopWatch_periodic *p = &s->mem_ptr->periodic[b->index];
+    int64_t now = get_clock_ns(s);
+    uint64_t periods = (now - b->period_deadline_ns) / b->period_ns + 1;
+    bool coalesced;
+
+    b->period_deadline_ns += periods * b->period_ns;
+    timer_mod(b->timeout_timer, b->period_deadline_ns);
+
+    coalesced = b->period_pending;
+    b->period_pending = true;
+
+    qemu_mutex_lock(&s->shared_lock);
+
+    atomic_set(&p->ticks, p->ticks + periods);
+    atomic_set(&p->overruns, p->overruns + periods - !coalesced);
+    atomic_set(&p->next_ns, b->period_deadline_ns);
+    stopwatch_mem_dirty(s, p, sizeof(*p));
+
+    if (!coalesced) {
+        if (!s->edge) {
+            s->irq_status |= BIT_ULL(b->index);
+        }
+        s->irq_events |= BIT_ULL(b->index);
+        atomic_set(&s->irq_pending, true);
+        stopwatch_update_irq(s);
+    }
+    qemu_mutex_unlock(&s->shared_lock);
+
+    trace_stopwatch_period(b->index, periods, coalesced);
+    stopwatch_trace(s, "bank", "period", 'i', b->index, b->index, periods);
+}
+
+/*
+ * Run @command on bank @b, with b->lock held. @arg is the argument of the
+ * command (timeout length in ns). Returns STOPWATCH_OK or a
+ * STOPWATCH_ERR_* code.
+ */
+static int stopwatch_action(struct StopWatchBank *b, uint64_t command,
+                            uint64_t arg) {
+    struct StopWatchCore *s = b->sw;
+
+    switch(command) {
+    case STOPWATCH_ACTION_RESET:
+        if (b->status == STOPWATCH_STATE_RUNNING) {
+            stopwatch_trace(s, "bank", "running", 'E', b->index, 0, 0);
+        }
+        stopwatch_trace(s, "bank", "reset", 'i', b->index, 0, 0);
+
+        atomic_set(&b->status, STOPWATCH_STATE_RESET);
+        b->total_time_ns = 0;
+        b->started_at_ns = 0;
+        b->last_lap_ns = 0; /* the statistics are kept, see LAP_CLEAR */
+        stopwatch_timeout_cancel(b);
+
+        return STOPWATCH_OK;
+        ;;
+    case STOPWATCH_ACTION_START:
+        if (b->status != STOPWATCH_STATE_RESET
+            && b->status != STOPWATCH_STATE_PAUSED) {
+            return STOPWATCH_ERR_STATE;
+        }
+
+        atomic_set(&b->status, STOPWATCH_STATE_RUNNING);
+        b->started_at_ns = get_clock_ns(s);
+
+        stopwatch_trace(s, "bank", "running", 'B', b->index, 0,
+                        b->total_time_ns);
+
+        return STOPWATCH_OK;
+        ;;
+    case STOPWATCH_ACTION_PAUSE:
+        if (b->status == STOPWATCH_STATE_PAUSED) {
+            return STOPWATCH_OK;
+        }
+        if (b->status != STOPWATCH_STATE_RUNNING) {
+            return STOPWATCH_ERR_STATE;
+        }
+
+        atomic_set(&b->status, STOPWATCH_STATE_PAUSED);
+
+        b->total_time_ns += get_running_time(b);
+
+        stopwatch_trace(s, "bank", "running", 'E', b->index, 0,
+                        b->total_time_ns);
+
+        return STOPWATCH_OK;
+        ;;
+    case STOPWATCH_ACTION_UPDATE:
+    {
+        /* text compatibility shim, the time page is the primary interface */
+        int64_t time = b->total_time_ns;
+        if (b->status == STOPWATCH_STATE_RUNNING) {
+            time += get_running_time(b);
+        }
+
+        qemu_mutex_lock(&s->shared_lock);
+        snprintf(s->mem_ptr->data, STOPWATCH_MEM_DATA_LENGTH,
+                 "%" PRId64 ".%09" PRId64 " seconds",
+                 time / NANOSECONDS_PER_SECOND, time % NANOSECONDS_PER_SECOND);
+        s->mem_ptr->data_len = strlen(s->mem_ptr->data) + 1;
+        stopwatch_mem_dirty(s, s->mem_ptr->data, s->mem_ptr->data_len);
+        stopwatch_mem_dirty(s, &s->mem_ptr->data_len,
+                            sizeof(s->mem_ptr->data_len));
+        qemu_mutex_unlock(&s->shared_lock);
+
+        return STOPWATCH_OK;
+        ;;
+    }
+    case STOPWATCH_ACTION_TIMEOUT:
+    {
+        uint64_t timeout = arg;
+        if (timeout > STOPWATCH_TIMEOUT_MAX_NS) {
+            return STOPWATCH_ERR_RANGE;
+        }
+        if (b->timeout_ongoing) {
+            return STOPWATCH_ERR_BUSY;
+        }
+
+        b->timeout_ongoing = true;
+        timer_mod(b->timeout_timer, get_clock_ns(s) + timeout);
+        stopwatch_trace(s, "bank", "timeout", 'b', b->index, b->index,
+                        timeout);
+
+        return STOPWATCH_OK;
+        ;;
+    }
+    case STOPWATCH_ACTION_PERIODIC:
+        if (arg == 0) {
+            if (!b->period_ns) {
+                return STOPWATCH_ERR_STATE;
+            }
+            stopwatch_periodic_stop(b);
+            return STOPWATCH_OK;
+        }
+        if (arg < STOPWATCH_PERIOD_MIN_NS || arg > STOPWATCH_TIMEOUT_MAX_NS) {
+            return STOPWATCH_ERR_RANGE;
+        }
+        /* a new period restarts the ticks, a one-shot timeout must end */
+        if (b->timeout_ongoing && !b->period_ns) {
+            return STOPWATCH_ERR_BUSY;
+        }
+
+        stopwatch_periodic_start(b, arg);
+        return STOPWATCH_OK;
+        ;;
+    case STOPWATCH_ACTION_TIMEOUT_ACK:
+        if (!b->timeout_ongoing) {
+            return STOPWATCH_ERR_STATE;
+        }
+        /* the periodic timeout keeps running, the next period can raise */
+        b->timeout_ongoing = b->period_ns != 0;
+        b->period_pending = false;
+
+        qemu_mutex_lock(&s->shared_lock);
+        s->irq_status &= ~BIT_ULL(b->index);
+        stopwatch_update_irq(s);
+        qemu_mutex_unlock(&s->shared_lock);
+
+        stopwatch_trace(s, "bank", "timeout_ack", 'i', b->index, 0, 0);
+        return STOPWATCH_OK;
+        ;;
+    case STOPWATCH_ACTION_LAP:
+    {
+        uint64_t value;
+
+        if (b->status == STOPWATCH_STATE_RESET) {
+            return STOPWATCH_ERR_STATE;
+        }
+
+        value = stopwatch_value(b);
+        stopwatch_record_lap(b, value);
+        return STOPWATCH_OK;
+        ;;
+    }
+    case STOPWATCH_ACTION_LAP_CLEAR:
+        stopwatch_clear_laps(b);
+        return STOPWATCH_OK;
+        ;;
+    default:
+        ;;
+    }
+    return STOPWATCH_ERR_INVALID;
+}
+
+/*
+ * Timer engine: up to STOPWATCH_TIMERS_MAX one-shot timers, kept in a
+ * binary min-heap. The engine QEMUTimer always points at the root.
+ */
+static void stopwatch_heap_set(struct StopWatchCore *s, uint32_t pos,
+                               struct StopWatchTimer t) {
+    s->heap[pos] = t;
+    s->heap_pos[t.id] = pos;
+}
+
+static void stopwatch_heap_sift_up(struct StopWatchCore *s, uint32_t pos) {
+    struct StopWatchTimer t = s->heap[pos];
+
+    while (pos > 0) {
+        uint32_t parent = (pos - 1) / 2;
+
+        if (s->heap[parent].deadline_ns <= t.deadline_ns) {
+            break;
+        }
+        stopwatch_heap_set(s, pos, s->heap[parent]);
+        pos = parent;
+    }
+    stopwatch_heap_set(s, pos, t);
+}
+
+static void stopwatch_heap_sift_down(struct StopWatchCore *s, uint32_t pos) {
+    struct StopWatchTimer t = s->heap[pos];
+
+    while (2 * pos + 1 < s->heap_len) {
+        uint32_t child = 2 * pos + 1;
+
+        if (child + 1 < s->heap_len
+            && s->heap[child + 1].deadline_ns < s->heap[child].deadline_ns) {
+            child++;
+        }
+        if (t.deadline_ns <= s->heap[child].deadline_ns) {
+            break;
+        }
+        stopwatch_heap_set(s, pos, s->heap[child]);
+        pos = child;
+    }
+    stopwatch_heap_set(s, pos, t);
+}
+
+static void stopwatch_heap_remove(struct StopWatchCore *s, uint32_t pos) {
+    struct StopWatchTimer last = s->heap[--s->heap_len];
+
+    s->heap_pos[s->heap[pos].id] = -1;
+    if (pos == s->heap_len) {
+        return;
+    }
+
+    stopwatch_heap_set(s, pos, last);
+    stopwatch_heap_sift_down(s, pos);
+    stopwatch_heap_sift_up(s, s->heap_pos[last.id]);
+}
+
+static void stopwatch_timers_clear(struct StopWatchCore *s) {
+    int i;
+
+    for (i = 0; i < STOPWATCH_TIMERS_MAX; i++) {
+        s->heap_pos[i] = -1;
+    }
+    s->heap_len = 0;
+    timer_del(s->engine_timer);
+}
+
+/*
+ * Move the expired timers to the expiry ring of their line and raise the
+ * line, then re-arm the engine timer. The expired timers of a full ring
+ * stay in the heap, and are posted when the guest acknowledges the line;
+ * the other lines keep getting theirs.
+ */
+static void stopwatch_timers_expire(struct StopWatchCore *s) {
+    int64_t now = get_clock_ns(s);
+    uint32_t full = 0;   /* lines with a full ring */
+    uint32_t posted = 0; /* lines with new entries */
+    uint32_t nb_held = 0;
+    int i;
+
+    while (s->heap_len && s->heap[0].deadline_ns <= now) {
+        uint32_t line = s->heap[0].line;
+        struct StopWatch_expiry_ring *ring = &s->mem_ptr->expiry[line];
+        uint32_t tail = ring->tail;
+        struct StopWatch_expiry *e;
+
+        if (!(full & BIT(line))
+            && tail - atomic_read(&ring->head) >= STOPWATCH_EXPIRY_RING_SIZE) {
+            trace_stopwatch_expiry_ring_full(line);
+            full |= BIT(line);
+        }
+        if (full & BIT(line)) {
+            /* out of the way of the other lines, put back below */
+            s->held[nb_held++] = s->heap[0];
+            stopwatch_heap_remove(s, 0);
+            continue;
+        }
+
+        e = &ring->entries[tail % STOPWATCH_EXPIRY_RING_SIZE];
+        e->id = s->heap[0].id;
+        e->deadline_ns = s->heap[0].deadline_ns;
+        e->expired_ns = now;
+
+        trace_stopwatch_timer_expire(e->id, line, e->deadline_ns, now);
+
+        stopwatch_trace(s, "timer", "timer", 'e', STOPWATCH_TRACE_TID_TIMERS,
+                        e->id, 1);
+
+        smp_wmb(); /* entry before the new tail */
+        atomic_set(&ring->tail, tail + 1);
+        stopwatch_mem_dirty(s, e, sizeof(*e));
+        stopwatch_mem_dirty(s, &ring->tail, sizeof(ring->tail));
+
+        posted |= BIT(line);
+        stopwatch_heap_remove(s, 0);
+    }
+
+    /* the next deadline to come, the held timers wait for an ack */
+    if (s->heap_len) {
+        timer_mod(s->engine_timer, s->heap[0].deadline_ns);
+    } else {
+        timer_del(s->engine_timer);
+    }
+    for (i = 0; i < nb_held; i++) {
+        stopwatch_heap_set(s, s->heap_len, s->held[i]);
+        stopwatch_heap_sift_up(s, s->heap_len++);
+    }
+
+    qemu_mutex_lock(&s->shared_lock);
+    for (i = 0; i < s->nb_irqs && !s->edge; i++) {
+        struct StopWatch_expiry_ring *ring = &s->mem_ptr->expiry[i];
+
+        if (ring->tail != atomic_read(&ring->head)) {
+            /* entries left in the ring at the ack count as new */
+            if (!(s->timer_irq_lines & BIT(i))) {
+                posted |= BIT(i);
+            }
+            s->timer_irq_lines |= BIT(i);
+        }
+    }
+    if (posted) {
+        s->irq_events |= (uint64_t) posted << STOPWATCH_BANKS_MAX;
+        atomic_set(&s->irq_pending, true);
+    }
+    stopwatch_update_irq(s);
+    qemu_mutex_unlock(&s->shared_lock);
+}
+
+static void stopwatch_engine_cb(void *opaque) {
+    struct StopWatchCore *s = opaque;
+
+    qemu_mutex_lock(&s->lock);
+    if (!s->stopped) {
+        stopwatch_timers_expire(s);
+    }
+    qemu_mutex_unlock(&s->lock);
+
+    stopwatch_core_flush_irqs(s);
+}
+
+/*
+ * Arm or cancel timer @cmd->index. Returns STOPWATCH_OK or a
+ * STOPWATCH_ERR_* code, and the absolute deadline of an armed timer
+ * in @deadline_ns.
+ */
+static int stopwatch_timer_action(struct StopWatchCore *s,
+                                  const struct StopWatch_cmd *cmd,
+                                  uint64_t *deadline_ns) {
+    struct StopWatchTimer t = {
+        .id = cmd->index,
+        .line = STOPWATCH_CMD_LINE_OF(cmd->flags),
+    };
+    int64_t now = get_clock_ns(s);
+
+    if (cmd->index >= STOPWATCH_TIMERS_MAX) {
+        return STOPWATCH_ERR_INVALID;
+    }
+
+    switch(cmd->action) {
+    case STOPWATCH_ACTION_TIMER_ARM:
+        if (cmd->flags & ~(STOPWATCH_TIMER_ABS | STOPWATCH_CMD_LINE_MASK)
+            || t.line >= s->nb_irqs) {
+            return STOPWATCH_ERR_INVALID;
+        }
+        if (cmd->flags & STOPWATCH_TIMER_ABS) {
+            if (cmd->arg > INT64_MAX) {
+                return STOPWATCH_ERR_RANGE;
+            }
+            t.deadline_ns = cmd->arg;
+        } else {
+            if (cmd->arg > INT64_MAX - now) {
+                return STOPWATCH_ERR_RANGE;
+            }
+            t.deadline_ns = now + cmd->arg;
+        }
+
+        if (s->heap_pos[t.id] >= 0) { /* re-armed: move it */
+            uint32_t pos = s->heap_pos[t.id];
+
+            stopwatch_trace(s, "timer", "timer", 'e',
+                            STOPWATCH_TRACE_TID_TIMERS, t.id, 0);
+
+            stopwatch_heap_set(s, pos, t);
+            stopwatch_heap_sift_down(s, pos);
+            stopwatch_heap_sift_up(s, s->heap_pos[t.id]);
+        } else {
+            stopwatch_heap_set(s, s->heap_len, t);
+            stopwatch_heap_sift_up(s, s->heap_len++);
+        }
+        *deadline_ns = t.deadline_ns;
+
+        stopwatch_trace(s, "timer", "timer", 'b', STOPWATCH_TRACE_TID_TIMERS,
+                        t.id, t.deadline_ns);
+
+        return STOPWATCH_OK;
+        ;;
+    case STOPWATCH_ACTION_TIMER_CANCEL:
+        if (s->heap_pos[t.id] < 0) {
+            return STOPWATCH_ERR_STATE;
+        }
+        stopwatch_heap_remove(s, s->heap_pos[t.id]);
+
+        /* arg 0: cancelled or re-armed, 1: expired */
+        stopwatch_trace(s, "timer", "timer", 'e', STOPWATCH_TRACE_TID_TIMERS,
+                        t.id, 0);
+
+        return STOPWATCH_OK;
+        ;;
+    }
+    return STOPWATCH_ERR_INVALID;
+}
+
+/*
+ * Device-wide commands, applied to every bank with a single trap. Called
+ * with s->lock held.
+ */
+static int stopwatch_global_action(struct StopWatchCore *s, uint64_t command) {
+    int i;
+
+    switch(command) {
+    case STOPWATCH_ACTION_RESET:
+        for (i = 0; i < s->nb_banks; i++) {
+            struct StopWatchBank *b = &s->banks[i];
+
+            qemu_mutex_lock(&b->lock);
+            stopwatch_action(b, command, 0);
+            qemu_mutex_unlock(&b->lock);
+        }
+        /* the armed timers are dropped, the expired ones stay posted */
+        stopwatch_timers_clear(s);
+        return STOPWATCH_OK;
+        ;;
+    case STOPWATCH_ACTION_TIMEOUT_ACK:
+        /* timer engine IRQ of all the lines, see stopwatch_line_ack */
+        qemu_mutex_lock(&s->shared_lock);
+        s->timer_irq_lines = 0;
+        qemu_mutex_unlock(&s->shared_lock);
+        stopwatch_timers_expire(s);
+        return STOPWATCH_OK;
+        ;;
+    case STOPWATCH_ACTION_UPDATE:
+        /* refresh all the time pages, nothing else to do */
+        return STOPWATCH_OK;
+        ;;
+    default:
+        ;;
+    }
+    return STOPWATCH_ERR_INVALID;
+}
+
+static void stopwatch_publish_all(struct StopWatchCore *s) {
+    int i;
+
+    for (i = 0; i < s->nb_banks; i++) {
+        struct StopWatchBank *b = &s->banks[i];
+
+        qemu_mutex_lock(&b->lock);
+        stopwatch_publish_time(b);
+        qemu_mutex_unlock(&b->lock);
+    }
+}
+
+/*
+ * Run one command of the command ring or of a virtio batch, with s->lock
+ * held. Returns STOPWATCH_OK or a STOPWATCH_ERR_* code, and the value of
+ * the completion in @value.
+ */
+static int stopwatch_exec_cmd(struct StopWatchCore *s,
+                              const struct StopWatch_cmd *cmd,
+                              uint64_t *value) {
+    struct StopWatchBank *b;
+    int ret;
+
+    *value = 0;
+
+    if (cmd->action == STOPWATCH_ACTION_TIMER_ARM
+        || cmd->action == STOPWATCH_ACTION_TIMER_CANCEL) {
+        ret = stopwatch_timer_action(s, cmd, value);
+    } else if (cmd->index == STOPWATCH_RING_ALL_BANKS) {
+        ret = stopwatch_global_action(s, cmd->action);
+    } else if (cmd->index < s->nb_banks) {
+        uint32_t line = STOPWATCH_CMD_LINE_OF(cmd->flags);
+        bool routed = cmd->action == STOPWATCH_ACTION_TIMEOUT
+                      || cmd->action == STOPWATCH_ACTION_PERIODIC;
+
+        b = &s->banks[cmd->index];
+        qemu_mutex_lock(&b->lock);
+        if (!routed
+            ? cmd->flags != 0
+            : (cmd->flags & ~STOPWATCH_CMD_LINE_MASK) || line >= s->nb_irqs) {
+            ret = STOPWATCH_ERR_INVALID;
+        } else {
+            ret = stopwatch_action(b, cmd->action, cmd->arg);
+        }
+        if (ret == STOPWATCH_OK && routed) {
+            /* the expiry waits for b->lock, it sees the new line */
+            qemu_mutex_lock(&s->shared_lock);
+            b->line = line;
+            qemu_mutex_unlock(&s->shared_lock);
+        }
+        *value = stopwatch_value(b);
+        qemu_mutex_unlock(&b->lock);
+    } else {
+        ret = STOPWATCH_ERR_INVALID;
+    }
+    trace_stopwatch_ring_command(cmd->tag, cmd->index, cmd->action, cmd->arg,
+                                 ret);
+    stopwatch_count_command(s, ret);
+
+    return ret;
+}
+
+/*
+ * Drain the submission queue of the command ring, and post one
+ * completion per command. Commands are left in the queue if the
+ * completion queue is full, the guest rings the doorbell again once it
+ * has consumed completions. Called with s->lock held.
+ */
+static void stopwatch_ring_process(struct StopWatchCore *s) {
+    struct StopWatch_ring *ring = &s->mem_ptr->ring;
+    uint32_t sq_head = ring->sq_head;
+    uint32_t sq_tail = atomic_read(&ring->sq_tail);
+    uint32_t cq_tail = ring->cq_tail;
+    uint32_t count = 0;
+
+    smp_rmb(); /* read the commands after sq_tail */
+
+    while (sq_head != sq_tail) {
+        struct StopWatch_cmd cmd = ring->sq[sq_head % STOPWATCH_RING_SIZE];
+        struct StopWatch_cpl *cpl;
+        uint64_t value;
+        int ret;
+
+        if (cq_tail - atomic_read(&ring->cq_head) >= STOPWATCH_RING_SIZE) {
+            trace_stopwatch_ring_full();
+            break;
+        }
+
+        ret = stopwatch_exec_cmd(s, &cmd, &value);
+
+        cpl = &ring->cq[cq_tail % STOPWATCH_RING_SIZE];
+        cpl->tag = cmd.tag;
+        cpl->result = -ret;
+        cpl->value = value;
+        stopwatch_mem_dirty(s, cpl, sizeof(*cpl));
+
+        sq_head++;
+        cq_tail++;
+        count++;
+    }
+
+    /* timers armed in the past expire now, and the engine is re-armed */
+    stopwatch_timers_expire(s);
+
+    /* the time pages are up-to-date when the completions are visible */
+    stopwatch_publish_all(s);
+
+    smp_wmb();
+    atomic_set(&ring->sq_head, sq_head);
+    atomic_set(&ring->cq_tail, cq_tail);
+    stopwatch_mem_dirty(s, ring, offsetof(struct StopWatch_ring, sq));
+
+    trace_stopwatch_ring_process(count);
+    stopwatch_trace(s, "cmd", "doorbell", 'i', STOPWATCH_TRACE_TID_CMD, 0,
+                    count);
+}
+
+static void stopwatch_timeout_cb(void *opaque) {
+    struct StopWatchBank *b = opaque;
+    struct StopWatchCore *s = b->sw;
+
+    qemu_mutex_lock(&b->lock);
+
+    /*
+     * The timeout may have been cancelled or re-armed by the guest
+     * between the expiry and the lock.
+     */
+    if (!b->timeout_ongoing || timer_pending(b->timeout_timer)) {
+        qemu_mutex_unlock(&b->lock);
+        return;
+    }
+
+    if (s->stopped) {
+        b->timeout_deferred = true;
+        qemu_mutex_unlock(&b->lock);
+        return;
+    }
+
+    if (b->period_ns) {
+        stopwatch_periodic_expire(b);
+        qemu_mutex_unlock(&b->lock);
+        stopwatch_core_flush_irqs(s);
+        return;
+    }
+
+    trace_stopwatch_timeout(b->index);
+
+    stopwatch_trace(s, "bank", "timeout", 'e', b->index, b->index, 0);
+
+    qemu_mutex_lock(&s->shared_lock);
+    if (s->edge) {
+        b->timeout_ongoing = false; /* acknowledged by the interrupt */
+    } else {
+        s->irq_status |= BIT_ULL(b->index);
+    }
+    s->irq_events |= BIT_ULL(b->index);
+    atomic_set(&s->irq_pending, true);
+    stopwatch_update_irq(s);
+    qemu_mutex_unlock(&s->shared_lock);
+
+    qemu_mutex_unlock(&b->lock);
+
+    stopwatch_core_flush_irqs(s);
+}
+
+/* expiry of the clock event, see stopwatch_core_clockevent */
+static void stopwatch_clockevent_cb(void *opaque) {
+    struct StopWatchCore *s = opaque;
+
+    qemu_mutex_lock(&s->shared_lock);
+
+    /* cancelled or re-armed by the guest between the expiry and the lock */
+    if (!s->event_armed || timer_pending(s->event_timer)) {
+        qemu_mutex_unlock(&s->shared_lock);
+        return;
+    }
+
+    if (s->stopped) {
+        s->event_deferred = true;
+        qemu_mutex_unlock(&s->shared_lock);
+        return;
+    }
+
+    trace_stopwatch_clockevent_expire(get_clock_ns(s));
+    stopwatch_trace(s, "timer", "clockevent", 'i', STOPWATCH_TRACE_TID_TIMERS,
+                    0, 0);
+
+    s->event_armed = false;
+    if (!s->edge) {
+        s->irq_status |= STOPWATCH_IRQ_CLOCKEVENT;
+    }
+    s->irq_events |= STOPWATCH_CORE_EVENT_CLOCK;
+    atomic_set(&s->irq_pending, true);
+    stopwatch_update_irq(s);
+    qemu_mutex_unlock(&s->shared_lock);
+
+    stopwatch_core_flush_irqs(s);
+}
+
+/*
+ * Clock page: the guest reads the clock in the shared memory instead of
+ * trapping, with the resolution of the updates. The thread does nothing
+ * else, so that the clock keeps running when the device is busy. It
+ * sleeps while the VM is stopped.
+ */
+static void *stopwatch_clock_thread(void *opaque) {
+    struct StopWatchCore *s = opaque;
+    struct StopWatch_clock *c = &s->mem_ptr->clock;
+
+    while (!atomic_read(&s->clock_stop)) {
+        if (atomic_read(&s->stopped)) {
+            qemu_mutex_lock(&s->shared_lock);
+            while (s->stopped && !s->clock_stop) {
+                qemu_cond_wait(&s->clock_cond, &s->shared_lock);
+            }
+            qemu_mutex_unlock(&s->shared_lock);
+            continue;
+        }
+
+        atomic_set(&c->now_ns, get_clock_ns(s));
+        stopwatch_mem_dirty(s, &c->now_ns, sizeof(c->now_ns));
+        if (s->clock_page_us) {
+            g_usleep(s->clock_page_us);
+        }
+    }
+
+    return NULL;
+}
+
+static int stopwatch_init(struct StopWatchCore *s) {
+    int i;
+
+    s->banks = g_new0(struct StopWatchBank, s->nb_banks);
+    s->irq_status = 0;
+    s->timer_irq_lines = 0;
+
+    for (i = 0; i < s->nb_banks; i++) {
+        struct StopWatchBank *b = &s->banks[i];
+
+        b->sw = s;
+        b->index = i;
+        b->line = i % s->nb_irqs;
+        qemu_mutex_init(&b->lock);
+
+        stopwatch_action(b, STOPWATCH_ACTION_RESET, 0);
+
+        if (s->start_at_boot) {
+            stopwatch_action(b, STOPWATCH_ACTION_START, 0);
+        }
+
+        b->timeout_timer = aio_timer_new(s->ctx, s->clock_type, SCALE_NS,
+                                         stopwatch_timeout_cb, b);
+        b->timeout_ongoing = false;
+        b->period_ns = 0;
+
+        stopwatch_publish_time(b);
+    }
+
+    s->heap = g_new(struct StopWatchTimer, STOPWATCH_TIMERS_MAX);
+    s->heap_pos = g_new(int32_t, STOPWATCH_TIMERS_MAX);
+    s->held = g_new(struct StopWatchTimer, STOPWATCH_TIMERS_MAX);
+    s->engine_timer = aio_timer_new(s->ctx, s->clock_type, SCALE_NS,
+                                    stopwatch_engine_cb, s);
+    stopwatch_timers_clear(s);
+
+    s->event_timer = aio_timer_new(s->ctx, s->clock_type, SCALE_NS,
+                                   stopwatch_clockevent_cb, s);
+    s->event_armed = false;
+    s->event_deadline_ns = -1;
+
+    return 0;
+}
+
+static const struct {
+    const char *name;
+    QEMUClockType type;
+} stopwatch_clocks[] = {
+    { "virtual",  QEMU_CLOCK_VIRTUAL },
+    { "host",     QEMU_CLOCK_HOST },
+    { "realtime", QEMU_CLOCK_REALTIME },
+};
+
+static bool stopwatch_parse_clock(struct StopWatchCore *s, Error **errp)
+{
+    int i;
+
+    if (!s->clock_name) {
+        s->clock_type = QEMU_CLOCK_VIRTUAL;
+        return true;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(stopwatch_clocks); i++) {
+        if (!strcmp(s->clock_name, stopwatch_clocks[i].name)) {
+            s->clock_type = stopwatch_clocks[i].type;
+            return true;
+        }
+    }
+
+    error_setg(errp, "invalid clock '%s' (virtual, host or realtime)",
+               s->clock_name);
+    return false;
+}
+
+bool stopwatch_core_realize(struct StopWatchCore *s, AioContext *ctx,
+                            struct StopWatch_mem *mem, Error **errp)
+{
+    if (!stopwatch_parse_clock(s, errp)) {
+        return false;
+    }
+
+    if (s->nb_banks == 0 || s->nb_banks > STOPWATCH_BANKS_MAX) {
+        error_setg(errp, "invalid number of banks %u (1 to %d)",
+                   s->nb_banks, STOPWATCH_BANKS_MAX);
+        return false;
+    }
+
+    if (s->nb_irqs == 0 || s->nb_irqs > STOPWATCH_IRQS_MAX) {
+        error_setg(errp, "invalid number of IRQ lines %u (1 to %d)",
+                   s->nb_irqs, STOPWATCH_IRQS_MAX);
+        return false;
+    }
+
+    if (s->trace_file) {
+        s->tracefile = stopwatch_tracefile_open(s->trace_file, errp);
+        if (!s->tracefile) {
+            return false;
+        }
+    }
+
+    s->ctx = ctx;
+    s->mem_ptr = mem;
+    qemu_mutex_init(&s->lock);
+    qemu_mutex_init(&s->shared_lock);
+
+    stopwatch_init(s);
+
+    if (s->clock_page) {
+        s->mem_ptr->clock.now_ns = get_clock_ns(s);
+        s->mem_ptr->clock.resolution_ns =
+            MAX((uint64_t) s->clock_page_us * SCALE_US, 1);
+        s->clock_stop = false;
+        qemu_cond_init(&s->clock_cond);
+        qemu_thread_create(&s->clock_thread, "stopwatch-clock",
+                           stopwatch_clock_thread, s, QEMU_THREAD_JOINABLE);
+    }
+
+    return true;
+}
+
+void stopwatch_core_unrealize(struct StopWatchCore *s)
+{
+    int i;
+
+    if (s->clock_page) {
+        qemu_mutex_lock(&s->shared_lock);
+        atomic_set(&s->clock_stop, true);
+        qemu_cond_signal(&s->clock_cond);
+        qemu_mutex_unlock(&s->shared_lock);
+        qemu_thread_join(&s->clock_thread);
+        qemu_cond_destroy(&s->clock_cond);
+    }
+
+    for (i = 0; i < s->nb_banks; i++) {
+        timer_free(s->banks[i].timeout_timer);
+        qemu_mutex_destroy(&s->banks[i].lock);
+    }
+    g_free(s->banks);
+
+    timer_free(s->engine_timer);
+    timer_free(s->event_timer);
+    g_free(s->heap);
+    g_free(s->heap_pos);
+    g_free(s->held);
+
+    if (s->tracefile) {
+        stopwatch_tracefile_close(s->tracefile);
+        s->tracefile = NULL;
+    }
+
+    qemu_mutex_destroy(&s->lock);
+    qemu_mutex_destroy(&s->shared_lock);
+}
+
+void stopwatch_core_reset(struct StopWatchCore *s)
+{
+    struct StopWatch_mem *mem = s->mem_ptr;
+    int i;
+
+    qemu_mutex_lock(&s->lock);
+    for (i = 0; i < s->nb_banks; i++) {
+        struct StopWatchBank *b = &s->banks[i];
+
+        qemu_mutex_lock(&b->lock);
+        b->timeout_deferred = false;
+        stopwatch_action(b, STOPWATCH_ACTION_RESET, 0);
+        if (s->start_at_boot) {
+            stopwatch_action(b, STOPWATCH_ACTION_START, 0);
+        }
+
+        qemu_mutex_lock(&s->shared_lock);
+        b->line = i % s->nb_irqs;
+        qemu_mutex_unlock(&s->shared_lock);
+        qemu_mutex_unlock(&b->lock);
+    }
+    stopwatch_timers_clear(s);
+
+    /*
+     * No driver reads it during the reset. The fields from shared_offset
+     * on are set by the transport at realize and kept.
+     */
+    memset(mem, 0, offsetof(struct StopWatch_mem, shared_offset));
+    if (s->clock_page) {
+        mem->clock.now_ns = get_clock_ns(s);
+        mem->clock.resolution_ns =
+            MAX((uint64_t) s->clock_page_us * SCALE_US, 1);
+    }
+    stopwatch_mem_dirty(s, mem, offsetof(struct StopWatch_mem, shared_offset));
+
+    stopwatch_publish_all(s);
+
+    qemu_mutex_lock(&s->shared_lock);
+    timer_del(s->event_timer);
+    s->event_armed = false;
+    s->event_deferred = false;
+    s->irq_status = 0;
+    s->timer_irq_lines = 0;
+    s->irq_events = 0;
+    stopwatch_update_irq(s);
+    qemu_mutex_unlock(&s->shared_lock);
+
+    qemu_mutex_unlock(&s->lock);
+}
+
+int stopwatch_core_global_command(struct StopWatchCore *s, uint64_t command)
+{
+    int ret;
+
+    qemu_mutex_lock(&s->lock);
+    ret = stopwatch_global_action(s, command);
+    stopwatch_count_command(s, ret);
+    stopwatch_publish_all(s);
+    qemu_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+/* only the lock of the bank: the commands to different banks run in parallel */
+int stopwatch_core_bank_command(struct StopWatchCore *s, uint32_t bank,
+                                uint64_t command, uint64_t arg)
+{
+    struct StopWatchBank *b;
+    int ret;
+
+    if (bank >= s->nb_banks) {
+        return STOPWATCH_ERR_INVALID;
+    }
+    b = &s->banks[bank];
+
+    qemu_mutex_lock(&b->lock);
+    ret = stopwatch_action(b, command, arg);
+    stopwatch_count_command(s, ret);
+    stopwatch_publish_time(b);
+    qemu_mutex_unlock(&b->lock);
+
+    return ret;
+}
+
+void stopwatch_core_ring_process(struct StopWatchCore *s)
+{
+    qemu_mutex_lock(&s->lock);
+    if (!s->stopped) {
+        stopwatch_ring_process(s);
+    }
+    qemu_mutex_unlock(&s->lock);
+}
+
+void stopwatch_core_exec(struct StopWatchCore *s,
+                         const struct StopWatch_cmd *cmds,
+                         struct StopWatch_cpl *cpls, uint32_t n)
+{
+    uint32_t i;
+
+    qemu_mutex_lock(&s->lock);
+    for (i = 0; i < n; i++) {
+        uint64_t value;
+        int ret = stopwatch_exec_cmd(s, &cmds[i], &value);
+
+        cpls[i].tag = cmds[i].tag;
+        cpls[i].result = -ret;
+        cpls[i].value = value;
+    }
+    stopwatch_timers_expire(s);
+    stopwatch_publish_all(s);
+    qemu_mutex_unlock(&s->lock);
+
+    trace_stopwatch_ring_process(n);
+}
+
+void stopwatch_core_line_ack(struct StopWatchCore *s, uint32_t line)
+{
+    /* raised again if the guest left entries in the ring */
+    qemu_mutex_lock(&s->lock);
+    qemu_mutex_lock(&s->shared_lock);
+    s->timer_irq_lines &= ~BIT(line);
+    qemu_mutex_unlock(&s->shared_lock);
+    stopwatch_timers_expire(s);
+    qemu_mutex_unlock(&s->lock);
+}
+
+uint64_t stopwatch_core_irq_status(struct StopWatchCore *s)
+{
+    uint64_t value;
+
+    qemu_mutex_lock(&s->shared_lock);
+    value = s->irq_status | (s->timer_irq_lines ? STOPWATCH_IRQ_TIMERS : 0);
+    qemu_mutex_unlock(&s->shared_lock);
+
+    return value;
+}
+
+uint64_t stopwatch_core_line_status(struct StopWatchCore *s, uint32_t line)
+{
+    uint64_t value;
+
+    qemu_mutex_lock(&s->shared_lock);
+    value = stopwatch_line_status(s, line);
+    qemu_mutex_unlock(&s->shared_lock);
+
+    return value;
+}
+
+uint64_t stopwatch_core_bank_status(struct StopWatchCore *s, uint32_t bank)
+{
+    return atomic_read(&s->banks[bank].status);
+}
+
+uint64_t stopwatch_core_clock(struct StopWatchCore *s)
+{
+    return get_clock_ns(s);
+}
+
+/*
+ * Clock event of a guest clock_event_device: only the shared lock, the
+ * vCPU that programs its next tick does not wait for the commands.
+ */
+void stopwatch_core_clockevent(struct StopWatchCore *s, uint64_t delta_ns)
+{
+    trace_stopwatch_clockevent(delta_ns);
+
+    qemu_mutex_lock(&s->shared_lock);
+    s->irq_status &= ~STOPWATCH_IRQ_CLOCKEVENT;
+    s->event_armed = delta_ns != 0;
+    if (s->event_armed) {
+        timer_mod(s->event_timer, get_clock_ns(s)
+                  + MIN(MAX(delta_ns, STOPWATCH_CLOCKEVENT_MIN_NS),
+                        STOPWATCH_TIMEOUT_MAX_NS));
+    } else {
+        timer_del(s->event_timer);
+    }
+    stopwatch_update_irq(s);
+    qemu_mutex_unlock(&s->shared_lock);
+}
+
+/*
+ * Migration: the shared memory is RAM and migrates on its own. The
+ * device state is the banks and the armed timers. The values on the
+ * device clock are rebased onto the clock of the destination, so the
+ * running stopwatches and the pending timers do not count the downtime
+ * (no-op with the virtual clock, which is migrated).
+ */
+static void stopwatch_lock_all(struct StopWatchCore *s)
+{
+    int i;
+
+    qemu_mutex_lock(&s->lock);
+    for (i = 0; i < s->nb_banks; i++) {
+        qemu_mutex_lock(&s->banks[i].lock);
+    }
+    qemu_mutex_lock(&s->shared_lock);
+}
+
+static void stopwatch_unlock_all(struct StopWatchCore *s)
+{
+    int i;
+
+    qemu_mutex_unlock(&s->shared_lock);
+    for (i = s->nb_banks - 1; i >= 0; i--) {
+        qemu_mutex_unlock(&s->banks[i].lock);
+    }
+    qemu_mutex_unlock(&s->lock);
+}
+
+int stopwatch_core_pre_save(void *opaque)
+{
+    struct StopWatchCore *s = opaque;
+    int i;
+
+    stopwatch_lock_all(s);
+
+    s->saved_clock_ns = get_clock_ns(s);
+
+    /* the timers deferred by the stop expire as soon as the VM runs */
+    for (i = 0; i < s->nb_banks; i++) {
+        struct StopWatchBank *b = &s->banks[i];
+
+        b->timeout_deadline_ns = b->timeout_deferred ? s->saved_clock_ns :
+            timer_expire_time_ns(b->timeout_timer);
+    }
+
+    if (!s->event_armed) {
+        s->event_deadline_ns = -1;
+    } else if (s->event_deferred) {
+        s->event_deadline_ns = s->saved_clock_ns;
+    } else {
+        s->event_deadline_ns = timer_expire_time_ns(s->event_timer);
+    }
+
+    stopwatch_unlock_all(s);
+
+    return 0;
+}
+
+static int stopwatch_post_load_locked(struct StopWatchCore *s)
+{
+    int64_t shift = get_clock_ns(s) - s->saved_clock_ns;
+    int i;
+
+    for (i = 0; i < s->nb_banks; i++) {
+        struct StopWatchBank *b = &s->banks[i];
+
+        if (b->line >= s->nb_irqs) {
+            return -EINVAL;
+        }
+
+        if (b->status == STOPWATCH_STATE_RUNNING) {
+            b->started_at_ns += shift;
+        }
+
+        b->timeout_deferred = false;
+
+        /* the timer has fired when the IRQ is pending */
+        if (b->timeout_deadline_ns >= 0) {
+            timer_mod(b->timeout_timer, b->timeout_deadline_ns + shift);
+        } else {
+            timer_del(b->timeout_timer);
+        }
+
+        /* a periodic timeout is always armed, at the end of its period */
+        if (b->period_ns) {
+            if (b->timeout_deadline_ns < 0
+                || b->period_ns < STOPWATCH_PERIOD_MIN_NS) {
+                return -EINVAL;
+            }
+            b->period_deadline_ns = b->timeout_deadline_ns + shift;
+            atomic_set(&s->mem_ptr->periodic[i].next_ns,
+                       b->period_deadline_ns);
+            stopwatch_mem_dirty(s, &s->mem_ptr->periodic[i],
+                                sizeof(s->mem_ptr->periodic[i]));
+        }
+
+        stopwatch_publish_time(b);
+    }
+
+    /* a uniform shift keeps the heap ordered */
+    for (i = 0; i < STOPWATCH_TIMERS_MAX; i++) {
+        s->heap_pos[i] = -1;
+    }
+    for (i = 0; i < s->heap_len; i++) {
+        struct StopWatchTimer *t = &s->heap[i];
+
+        if (t->id >= STOPWATCH_TIMERS_MAX || t->line >= s->nb_irqs
+            || s->heap_pos[t->id] >= 0) {
+            return -EINVAL;
+        }
+        t->deadline_ns += shift;
+        s->heap_pos[t->id] = i;
+    }
+
+    if (s->heap_len) {
+        timer_mod(s->engine_timer, s->heap[0].deadline_ns);
+    } else {
+        timer_del(s->engine_timer);
+    }
+
+    /* not in the stream if not armed, see vmstate_stopwatch_core_clockevent */
+    s->event_armed = s->event_deadline_ns >= 0;
+    if (s->event_armed) {
+        timer_mod(s->event_timer, s->event_deadline_ns + shift);
+    } else {
+        timer_del(s->event_timer);
+    }
+    s->event_deadline_ns = -1;
+    s->event_deferred = false;
+
+    /* the clock page is RAM: refreshed before the guest runs again */
+    if (s->clock_page) {
+        atomic_set(&s->mem_ptr->clock.now_ns, get_clock_ns(s));
+        stopwatch_mem_dirty(s, &s->mem_ptr->clock.now_ns,
+                            sizeof(s->mem_ptr->clock.now_ns));
+    }
+
+    /* the line levels are migrated by the interrupt controller */
+    s->irq_levels = 0;
+    for (i = 0; i < s->nb_irqs; i++) {
+        if (stopwatch_line_status(s, i)) {
+            s->irq_levels |= BIT(i);
+        }
+    }
+
+    return 0;
+}
+
+int stopwatch_core_post_load(void *opaque, int version_id)
+{
+    struct StopWatchCore *s = opaque;
+    int ret;
+
+    stopwatch_lock_all(s);
+    ret = stopwatch_post_load_locked(s);
+    stopwatch_unlock_all(s);
+
+    if (ret) {
+        return ret;
+    }
+
+    /*
+     * Commands submitted before the migration, and not processed by the
+     * source: the doorbell is not rung again. The VM is stopped, the
+     * IRQs are raised on resume.
+     */
+    qemu_mutex_lock(&s->lock);
+    if (atomic_read(&s->mem_ptr->ring.sq_tail) != s->mem_ptr->ring.sq_head) {
+        stopwatch_ring_process(s);
+    }
+    qemu_mutex_unlock(&s->lock);
+
+    return 0;
+}
+
+void stopwatch_core_set_running(struct StopWatchCore *s, bool running)
+{
+    bool deferred;
+    int i;
+
+    /* with all the locks: no callback is in progress afterwards */
+    stopwatch_lock_all(s);
+    atomic_set(&s->stopped, !running);
+    if (s->clock_page && running) {
+        qemu_cond_signal(&s->clock_cond);
+    }
+    stopwatch_unlock_all(s);
+
+    if (!running) {
+        return;
+    }
+
+    for (i = 0; i < s->nb_banks; i++) {
+        struct StopWatchBank *b = &s->banks[i];
+
+        qemu_mutex_lock(&b->lock);
+        deferred = b->timeout_deferred;
+        b->timeout_deferred = false;
+        qemu_mutex_unlock(&b->lock);
+
+        if (deferred) {
+            stopwatch_timeout_cb(b);
+        }
+    }
+
+    qemu_mutex_lock(&s->shared_lock);
+    deferred = s->event_deferred;
+    s->event_deferred = false;
+    qemu_mutex_unlock(&s->shared_lock);
+
+    if (deferred) {
+        stopwatch_clockevent_cb(s);
+    }
+
+    /* the expired timers of the engine, and the doorbells rung meanwhile */
+    qemu_mutex_lock(&s->lock);
+    stopwatch_timers_expire(s);
+    if (atomic_read(&s->mem_ptr->ring.sq_tail) != s->mem_ptr->ring.sq_head) {
+        stopwatch_ring_process(s);
+    }
+    qemu_mutex_unlock(&s->lock);
+
+    stopwatch_core_flush_irqs(s);
+}
+
@@ -0,0 +1,216 @@
+#ifndef HW_MISC_STOPWATCH_CORE_H
+#define HW_MISC_STOPWATCH_CORE_H
+
+/*
+ * Stopwatch engine, independent of the transport: the banks, the timer
+ * engine, the command ring and the line state, on top of the shared
+ * memory. Used by the sysbus device (stopwatch.c), the virtio device
+ * (virtio-stopwatch.c) and the vhost-user daemon, which only differ in
+ * how the commands come in and how the lines go out.
+ */
+
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "block/aio.h"
+#include "migration/vmstate.h"
+#include "sysemu/sysemu.h"
+
+#include "hw/misc/stopwatch_hw-sw.h"
+
+struct StopWatchCore;
+
+struct StopWatchBank {
+    struct StopWatchCore *sw;
+    int index;
+
+    uint64_t status;
+    int64_t started_at_ns;
+    int64_t total_time_ns;
+    int64_t last_lap_ns; /* stopwatch value at the previous lap */
+
+    QemuMutex lock; /* the state and the pages of the bank */
+
+    QEMUTimer *timeout_timer;
+    bool timeout_ongoing; /* one-shot not acknowledged yet, or periodic */
+    uint32_t line; /* IRQ line of the timeout, under shared_lock */
+
+    uint64_t period_ns; /* periodic timeout, 0 if one-shot */
+    int64_t period_deadline_ns; /* expiry of the current period */
+    bool period_pending; /* raised, not acknowledged: the next coalesce */
+
+    int64_t timeout_deadline_ns; /* migration only, -1 if not armed */
+    bool timeout_deferred; /* expired while the VM was stopped */
+};
+
+/*
+ * Always-on counters, exported as the read-only 'stats-*' QOM properties
+ * (qom-get). Incremented atomically, without lock. The details are in the
+ * stopwatch_* trace events.
+ */
+struct StopWatchStats {
+    uint64_t commands; /* register and command ring commands */
+    uint64_t irqs;     /* line raises, or MSI-X notifications */
+    uint64_t reads;    /* register reads */
+    uint64_t errors;   /* commands that failed */
+};
+
+/* armed timer of the timer engine */
+struct StopWatchTimer {
+    int64_t deadline_ns;
+    uint32_t id;
+    uint32_t line; /* IRQ line of the expiry */
+};
+
+/*
+ * Called by stopwatch_core_flush_irqs, with the BQL held and none of the
+ * core locks: @levels is the level of each line, @events the bank
+ * timeouts that fired (bit b), the lines with timers posted
+ * (STOPWATCH_CORE_EVENT_TIMERS(line)) and the clock event
+ * (STOPWATCH_CORE_EVENT_CLOCK), since the previous call.
+ * Level-triggered transports only look at @levels.
+ */
+typedef void StopWatchIrqFunc(void *opaque, uint32_t levels, uint64_t events);
+
+/*
+ * Called when the device wrote @len bytes of the memory at @offset, from
+ * any thread: the guest memory is RAM, the writes are not seen by the
+ * dirty tracking of the migration otherwise.
+ */
+typedef void StopWatchDirtyFunc(void *opaque, uint64_t offset, uint64_t len);
+
+#define STOPWATCH_CORE_EVENT_BANKS MAKE_64BIT_MASK(0, STOPWATCH_BANKS_MAX)
+#define STOPWATCH_CORE_EVENT_TIMERS(line) (STOPWATCH_IRQ_TIMERS << (line))
+#define STOPWATCH_CORE_EVENT_CLOCK STOPWATCH_CORE_EVENT_TIMERS(STOPWATCH_IRQS_MAX)
+
+struct StopWatchCore {
+    /*< configuration, set before stopwatch_core_realize >*/
+
+    bool start_at_boot;
+    char *clock_name; /* virtual (default), host or realtime */
+    uint32_t nb_banks;
+    uint32_t nb_irqs;
+    char *trace_file; /* Chrome trace JSON output, see stopwatch_tracefile.h */
+    /*
+     * Edge-triggered transport (MSI-X): the events are the interrupts, a
+     * timeout is acknowledged when it fires and the lines are never
+     * raised. The 'ack' of a line only resumes a full expiry ring.
+     */
+    bool edge;
+    /* publish the clock in the shared memory, every clock_page_us */
+    bool clock_page;
+    uint32_t clock_page_us; /* 0: continuously, a host CPU busy */
+
+    StopWatchIrqFunc *irq_func;
+    void *irq_opaque;
+    StopWatchDirtyFunc *dirty_func; /* NULL: memory not in guest RAM */
+    void *dirty_opaque;
+
+    /*< internal state >*/
+
+    /*
+     * The commands run without the BQL. Lock order: lock (command ring,
+     * timer engine, device-wide commands), then the lock of a bank, then
+     * shared_lock (line state and the data buffer). The BQL is only taken
+     * with none of them held, see stopwatch_core_flush_irqs.
+     */
+    QemuMutex lock;
+    QemuMutex shared_lock;
+    AioContext *ctx;
+    bool irq_pending; /* irq_levels or irq_events changed */
+
+    struct StopWatch_mem *mem_ptr;
+
+    QEMUClockType clock_type;
+
+    struct StopWatchBank *banks;
+    uint64_t irq_status; /* banks with a timeout pending, clock event */
+    uint32_t timer_irq_lines; /* lines with expired timers not acknowledged */
+    uint32_t irq_levels; /* current level of the lines, 'irq-levels' */
+    uint64_t irq_events; /* not yet reported to irq_func */
+
+    struct StopWatchTraceFile *tracefile;
+    struct StopWatchStats stats;
+
+    int64_t saved_clock_ns; /* migration only: clock of the source */
+
+    /* clock event, under shared_lock */
+    QEMUTimer *event_timer;
+    bool event_armed; /* not expired nor cancelled */
+    int64_t event_deadline_ns; /* migration only, -1 if not armed */
+    bool event_deferred; /* expired while the VM was stopped */
+
+    /*
+     * VM stopped: the expired timers and the doorbell wait for the
+     * resume, the memory is not written, see stopwatch_core_set_running.
+     */
+    bool stopped;
+    VMChangeStateEntry *vm_state;
+
+    QemuThread clock_thread; /* clock page */
+    QemuCond clock_cond; /* with shared_lock: resume, clock_stop */
+    bool clock_stop;
+
+    /* timer engine: min-heap of the armed timers, ordered by deadline */
+    QEMUTimer *engine_timer; /* armed at the earliest deadline */
+    struct StopWatchTimer *heap;
+    uint32_t heap_len;
+    int32_t *heap_pos; /* position of each timer id in the heap, or -1 */
+    struct StopWatchTimer *held; /* expired, ring full: see timers_expire */
+};
+
+/*
+ * Validate the configuration and start the engine on @mem, zeroed by
+ * the caller. The timers run in @ctx.
+ */
+bool stopwatch_core_realize(struct StopWatchCore *s, AioContext *ctx,
+                            struct StopWatch_mem *mem, Error **errp);
+void stopwatch_core_unrealize(struct StopWatchCore *s);
+/* device reset: the state of the realize, the memory cleared */
+void stopwatch_core_reset(struct StopWatchCore *s);
+
+/*
+ * Commands. They take the core locks themselves, and leave the line
+ * updates pending: the caller runs stopwatch_core_flush_irqs once done.
+ * They return STOPWATCH_OK or a STOPWATCH_ERR_* code.
+ */
+int stopwatch_core_global_command(struct StopWatchCore *s, uint64_t command);
+int stopwatch_core_bank_command(struct StopWatchCore *s, uint32_t bank,
+                                uint64_t command, uint64_t arg);
+void stopwatch_core_ring_process(struct StopWatchCore *s);
+/* @n commands of @cmds, in order, with one completion each in @cpls */
+void stopwatch_core_exec(struct StopWatchCore *s,
+                         const struct StopWatch_cmd *cmds,
+                         struct StopWatch_cpl *cpls, uint32_t n);
+/* expiry ring of @line consumed, posts the timers that did not fit */
+void stopwatch_core_line_ack(struct StopWatchCore *s, uint32_t line);
+
+void stopwatch_core_flush_irqs(struct StopWatchCore *s);
+
+uint64_t stopwatch_core_irq_status(struct StopWatchCore *s);
+uint64_t stopwatch_core_line_status(struct StopWatchCore *s, uint32_t line);
+uint64_t stopwatch_core_bank_status(struct StopWatchCore *s, uint32_t bank);
+
+uint64_t stopwatch_core_clock(struct StopWatchCore *s);
+/* arm the clock event in @delta_ns, or cancel it if 0, and acknowledge */
+void stopwatch_core_clockevent(struct StopWatchCore *s, uint64_t delta_ns);
+
+/*
+ * Quiesce the engine while the VM is stopped, and run what was deferred
+ * on resume. Called by the VM change state handler of the devices.
+ */
+void stopwatch_core_set_running(struct StopWatchCore *s, bool running);
+
+/*
+ * Migration of the core, embedded in the vmstate of the devices
+ * (stopwatch_vmstate.c, not linked into the vhost-user daemon).
+ */
+extern const VMStateDescription vmstate_stopwatch_core;
+
+int stopwatch_core_pre_save(void *opaque);
+int stopwatch_core_post_load(void *opaque, int version_id);
+
+/* after stopwatch_core_realize: follow the run state of the VM */
+void stopwatch_core_vm_init(struct StopWatchCore *s);
+void stopwatch_core_vm_cleanup(struct StopWatchCore *s);
+
+#endif
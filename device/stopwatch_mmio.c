@@ -0,0 +1,389 @@
+#include "qemu/osdep.h"
+#include "hw/hw.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/atomic.h"
+#include "block/aio.h"
+#include "exec/memory.h"
+#include "trace.h"
+
+#include <stddef.h>
+
+#include "hw/misc/stopwatch.h"
+#include "hw/misc/stopwatch_core.h"
+#include "../../driver/stopwatch_hw-sw.h"
+
+/*
+ * Registers and pass-through memory of the stopwatch engine, shared by
+ * the sysbus (stopwatch.c) and PCI (stopwatch-pci.c) transports, which
+ * only differ in how they map them and deliver the interrupts.
+ */
+
+/* ioeventfd doorbell: the guest write did not wait for the processing */
+static void stopwatch_doorbell_cb(EventNotifier *n) {
+    struct StopWatchRegs *r = container_of(n, struct StopWatchRegs,
+                                           doorbell_notifier);
+
+    if (!event_notifier_test_and_clear(n)) {
+        return;
+    }
+
+    stopwatch_core_ring_process(r->core);
+    stopwatch_core_flush_irqs(r->core);
+}
+
+/***************************/
+
+#define STOPWATCH_BANK_REGS_OFFSET (offsetof(struct StopWatch_regs, bank))
+#define STOPWATCH_BANK_REGS_SIZE (sizeof(struct StopWatch_bank_regs))
+
+/* Returns the bank addressed by @offset or -1, its register offset in @reg */
+static int stopwatch_decode_bank(struct StopWatchRegs *r, hwaddr offset,
+                                 hwaddr *reg)
+{
+    hwaddr idx;
+
+    if (offset < STOPWATCH_BANK_REGS_OFFSET) {
+        return -1;
+    }
+
+    idx = (offset - STOPWATCH_BANK_REGS_OFFSET) / STOPWATCH_BANK_REGS_SIZE;
+    if (idx >= r->core->nb_banks) {
+        return -1;
+    }
+
+    *reg = (offset - STOPWATCH_BANK_REGS_OFFSET) % STOPWATCH_BANK_REGS_SIZE;
+
+    return idx;
+}
+
+#define STOPWATCH_LINE_REGS_OFFSET (offsetof(struct StopWatch_regs, line))
+#define STOPWATCH_LINE_REGS_SIZE (sizeof(struct StopWatch_line_regs))
+
+/* Returns the IRQ line addressed by @offset or -1, see decode_bank */
+static int stopwatch_decode_line(struct StopWatchRegs *r, hwaddr offset,
+                                 hwaddr *reg)
+{
+    hwaddr idx;
+
+    if (offset < STOPWATCH_LINE_REGS_OFFSET
+        || offset >= STOPWATCH_BANK_REGS_OFFSET) {
+        return -1;
+    }
+
+    idx = (offset - STOPWATCH_LINE_REGS_OFFSET) / STOPWATCH_LINE_REGS_SIZE;
+    if (idx >= r->core->nb_irqs) {
+        return -1;
+    }
+
+    *reg = (offset - STOPWATCH_LINE_REGS_OFFSET) % STOPWATCH_LINE_REGS_SIZE;
+
+    return idx;
+}
+
+/*
+ * Without the BQL (see stopwatch_regs_init): the bank commands only take
+ * the lock of their bank, so the vCPUs driving different banks do not
+ * serialize. The command ring, the timer engine and the device-wide
+ * commands take the core lock.
+ */
+static void stopwatch_io_write(void *opaque, hwaddr offset, uint64_t command,
+                               unsigned size)
+{
+    struct StopWatchRegs *r = opaque;
+    hwaddr reg;
+    int line;
+    int bank;
+    int ret;
+
+    trace_stopwatch_io_write(offset, command);
+
+    switch(offset) {
+    case offsetof(struct StopWatch_regs, command):
+        ret = stopwatch_core_global_command(r->core, command);
+        if (ret) {
+            hw_error("invalid device-wide action (%ld)", command);
+        }
+        goto out;
+        ;;
+    case offsetof(struct StopWatch_regs, doorbell):
+        /* without ioeventfd, processed during the trap */
+        stopwatch_core_ring_process(r->core);
+        goto out;
+        ;;
+    case offsetof(struct StopWatch_regs, clockevent):
+        stopwatch_core_clockevent(r->core, command);
+        goto out;
+        ;;
+    }
+
+    line = stopwatch_decode_line(r, offset, &reg);
+
+    if (line >= 0 && reg == offsetof(struct StopWatch_line_regs, ack)) {
+        stopwatch_core_line_ack(r->core, line);
+        goto out;
+    }
+
+    bank = stopwatch_decode_bank(r, offset, &reg);
+
+    if (bank >= 0 && reg == offsetof(struct StopWatch_bank_regs, command)) {
+        uint64_t arg = atomic_read(&r->core->mem_ptr->timeout_ns);
+
+        ret = stopwatch_core_bank_command(r->core, bank, command, arg);
+        if (ret == STOPWATCH_ERR_INVALID) {
+            hw_error("invalid action (%ld)", command);
+        }
+        /* state errors are only counted, the registers have no result */
+        goto out;
+    }
+
+    hw_error("invalid write at 0x%" HWADDR_PRIx " (command: 0x%lx)",
+             offset, command);
+
+out:
+    stopwatch_core_flush_irqs(r->core);
+}
+
+static uint64_t stopwatch_io_read(void *opaque, hwaddr offset,
+                                  unsigned size)
+{
+    struct StopWatchRegs *r = opaque;
+    uint64_t value = 0;
+    hwaddr reg;
+    int line;
+    int bank;
+
+    atomic_inc(&r->core->stats.reads);
+
+    switch(offset) {
+    case offsetof(struct StopWatch_regs, banks):
+        value = r->core->nb_banks;
+        goto out;
+        ;;
+    case offsetof(struct StopWatch_regs, irq_status):
+        value = stopwatch_core_irq_status(r->core);
+        goto out;
+        ;;
+    case offsetof(struct StopWatch_regs, irqs):
+        value = r->core->nb_irqs;
+        goto out;
+        ;;
+    case offsetof(struct StopWatch_regs, clock):
+        value = stopwatch_core_clock(r->core);
+        goto out;
+        ;;
+    }
+
+    line = stopwatch_decode_line(r, offset, &reg);
+
+    if (line >= 0 && reg == offsetof(struct StopWatch_line_regs, status)) {
+        value = stopwatch_core_line_status(r->core, line);
+        goto out;
+    }
+
+    bank = stopwatch_decode_bank(r, offset, &reg);
+
+    if (bank >= 0 && reg == offsetof(struct StopWatch_bank_regs, status)) {
+        value = stopwatch_core_bank_status(r->core, bank);
+        goto out;
+    }
+
+    hw_error("invalid read at 0x%" HWADDR_PRIx, offset);
+
+out:
+    trace_stopwatch_io_read(offset, value);
+    return value;
+}
+
+static const MemoryRegionOps stopwatch_regs_ops = {
+    .write = stopwatch_io_write,
+    .read = stopwatch_io_read,
+    .impl = {
+        .min_access_size = 8,
+        .max_access_size = 8,
+    },
+    .endianness = DEVICE_NATIVE_ENDIAN,
+};
+
+#define STOPWATCH_IO_REGS_SIZE(r) \
+    (STOPWATCH_BANK_REGS_OFFSET + (r)->core->nb_banks * STOPWATCH_BANK_REGS_SIZE)
+
+void stopwatch_regs_init(struct StopWatchRegs *r, Object *owner,
+                         struct StopWatchCore *core)
+{
+    r->core = core;
+
+    memory_region_init_io(&r->mr, owner, &stopwatch_regs_ops, r,
+                          TYPE_STOPWATCH"-regs", STOPWATCH_IO_REGS_SIZE(r));
+    /* the device locks its state, the vCPUs access it in parallel */
+    memory_region_clear_global_locking(&r->mr);
+
+    /*
+     * Doorbell writes signal an eventfd instead of trapping into the
+     * device (in the kernel with KVM): the ring is processed
+     * asynchronously, the guest polls the completion queue. Zero size:
+     * any access width rings it.
+     */
+    if (r->ioeventfd) {
+        event_notifier_init(&r->doorbell_notifier, 0);
+        memory_region_add_eventfd(&r->mr,
+                                  offsetof(struct StopWatch_regs, doorbell),
+                                  0, false, 0, &r->doorbell_notifier);
+        aio_set_event_notifier(core->ctx, &r->doorbell_notifier, true,
+                               stopwatch_doorbell_cb, NULL);
+    }
+}
+
+void stopwatch_regs_cleanup(struct StopWatchRegs *r)
+{
+    if (r->ioeventfd) {
+        aio_set_event_notifier(r->core->ctx, &r->doorbell_notifier, true,
+                               NULL, NULL);
+        memory_region_del_eventfd(&r->mr,
+                                  offsetof(struct StopWatch_regs, doorbell),
+                                  0, false, 0, &r->doorbell_notifier);
+        event_notifier_cleanup(&r->doorbell_notifier);
+    }
+}
+
+/*
+ * Guest RAM, so that it migrates during the iterative phase. The name
+ * identifies the RAM block in the migration stream, it comes from the
+ * QOM path of the device. The memdev follows, at the next
+ * STOPWATCH_MEM_ALIGN boundary; it migrates with its backend.
+ */
+bool stopwatch_mem_init(struct StopWatchMem *m, Object *owner, uint64_t size,
+                        Error **errp)
+{
+    Error *local_err = NULL;
+    uint64_t shared_size = 0;
+    char *path, *name;
+
+    if (m->memdev) {
+        if (host_memory_backend_is_mapped(m->memdev)) {
+            error_setg(errp, "memdev '%s' is already in use",
+                       object_get_canonical_path_component(OBJECT(m->memdev)));
+            return false;
+        }
+        shared_size = memory_region_size(
+            host_memory_backend_get_memory(m->memdev));
+        if (shared_size < sizeof(struct StopWatch_shared) +
+                          sizeof(struct StopWatch_shared_slot)) {
+            error_setg(errp, "memdev too small for a stopwatch slot");
+            return false;
+        }
+        if (!m->memdev->share) {
+            warn_report("stopwatch memdev without share=on: "
+                        "private to this VM");
+        }
+    }
+
+    path = object_get_canonical_path(owner);
+    name = g_strdup_printf("%s/" TYPE_STOPWATCH "-mem", path);
+    g_free(path);
+    memory_region_init_ram(&m->ram, owner, name, size, &local_err);
+    if (local_err) {
+        g_free(name);
+        error_propagate(errp, local_err);
+        return false;
+    }
+    m->ptr = memory_region_get_ram_ptr(&m->ram);
+    memset(m->ptr, 0, size);
+
+    memory_region_init(&m->mr, owner, name,
+                       QEMU_ALIGN_UP(size + shared_size, STOPWATCH_MEM_ALIGN));
+    g_free(name);
+    memory_region_add_subregion(&m->mr, 0, &m->ram);
+
+    if (m->memdev) {
+        memory_region_init_alias(&m->shared, owner, TYPE_STOPWATCH "-shared",
+                                 host_memory_backend_get_memory(m->memdev),
+                                 0, shared_size);
+        memory_region_add_subregion(&m->mr, size, &m->shared);
+        host_memory_backend_set_mapped(m->memdev, true);
+
+        m->ptr->shared_offset = size;
+        m->ptr->shared_size = shared_size;
+    }
+
+    return true;
+}
+
+static const struct {
+    QEMUClockType type;
+    uint32_t shared;
+} stopwatch_shared_clocks[] = {
+    { QEMU_CLOCK_REALTIME, STOPWATCH_SHARED_CLOCK_REALTIME },
+    { QEMU_CLOCK_HOST, STOPWATCH_SHARED_CLOCK_HOST },
+};
+
+/*
+ * The first device to attach sets up the memory, the slots belong to
+ * their owners afterwards, see struct StopWatch_shared.
+ */
+bool stopwatch_mem_share(struct StopWatchMem *m, struct StopWatchCore *core,
+                         Error **errp)
+{
+    struct StopWatch_shared *sh;
+    uint32_t clock = 0, prev;
+    int i;
+
+    if (!m->memdev) {
+        return true;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(stopwatch_shared_clocks); i++) {
+        if (stopwatch_shared_clocks[i].type == core->clock_type) {
+            clock = stopwatch_shared_clocks[i].shared;
+        }
+    }
+    if (!clock) {
+        error_setg(errp, "memdev needs a host clock (clock=realtime or host)");
+        return false;
+    }
+
+    sh = memory_region_get_ram_ptr(host_memory_backend_get_memory(m->memdev));
+
+    prev = atomic_read(&sh->magic);
+    if (prev && prev != STOPWATCH_SHARED_MAGIC) {
+        error_setg(errp, "memdev is not a stopwatch shared memory");
+        return false;
+    }
+
+    prev = atomic_cmpxchg(&sh->clock, 0, clock);
+    if (prev && prev != clock) {
+        error_setg(errp, "memdev uses another clock (%u)", prev);
+        return false;
+    }
+    if (!prev) {
+        /* not published yet: the users wait for the magic */
+        for (i = 0; i < STOPWATCH_SHARED_SLOTS(m->ptr->shared_size); i++) {
+            sh->slot[i].owner = 0;
+            sh->slot[i].time = (struct StopWatch_time) {
+                .status = STOPWATCH_STATE_RESET,
+            };
+        }
+        smp_wmb();
+        atomic_set(&sh->magic, STOPWATCH_SHARED_MAGIC);
+    }
+
+    m->ptr->shared_id = atomic_fetch_inc(&sh->users) + 1;
+    trace_stopwatch_mem_share(m->ptr->shared_id, clock, m->ptr->shared_size);
+
+    return true;
+}
+
+void stopwatch_mem_set_dirty(void *opaque, uint64_t offset, uint64_t len)
+{
+    struct StopWatchMem *m = opaque;
+
+    memory_region_set_dirty(&m->ram, offset, len);
+}
+
+void stopwatch_mem_cleanup(struct StopWatchMem *m)
+{
+    if (m->memdev) {
+        memory_region_del_subregion(&m->mr, &m->shared);
+        host_memory_backend_set_mapped(m->memdev, false);
+    }
+}
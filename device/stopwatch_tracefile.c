@@ -0,0 +1,162 @@
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/thread.h"
+
+#include "hw/misc/stopwatch.h"
+#include "hw/misc/stopwatch_tracefile.h"
+
+#define STOPWATCH_TRACE_BUF_SIZE (256 * 1024)
+#define STOPWATCH_TRACE_EVENT_MAX 256 /* length of one formatted event */
+#define STOPWATCH_TRACE_FLUSH_MS 100  /* the writer flushes at least that often */
+
+struct StopWatchTraceFile {
+    int fd;
+
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    bool stop;
+
+    /* double buffering: the vCPUs fill 'active', the writer the other */
+    char *buf[2];
+    size_t len[2];
+    int active;
+
+    uint64_t dropped;
+};
+
+static void stopwatch_tracefile_write(struct StopWatchTraceFile *tf,
+                                      const char *buf, size_t len)
+{
+    if (qemu_write_full(tf->fd, buf, len) != len) {
+        error_report(TYPE_STOPWATCH ": trace file write failed: %s",
+                     strerror(errno));
+    }
+}
+
+/*
+ * Writer thread: swaps the buffers when the active one has events, and
+ * writes the full one without holding the lock.
+ */
+static void *stopwatch_tracefile_thread(void *opaque)
+{
+    struct StopWatchTraceFile *tf = opaque;
+    bool stop;
+    int idx;
+
+    qemu_mutex_lock(&tf->lock);
+    do {
+        if (!tf->stop && tf->len[tf->active] < STOPWATCH_TRACE_BUF_SIZE / 2) {
+            qemu_cond_timedwait(&tf->cond, &tf->lock, STOPWATCH_TRACE_FLUSH_MS);
+        }
+        stop = tf->stop;
+
+        idx = tf->active;
+        if (!tf->len[idx]) {
+            continue;
+        }
+        tf->active = !idx;
+        qemu_mutex_unlock(&tf->lock);
+
+        stopwatch_tracefile_write(tf, tf->buf[idx], tf->len[idx]);
+
+        qemu_mutex_lock(&tf->lock);
+        tf->len[idx] = 0;
+    } while (!stop || tf->len[tf->active]);
+    qemu_mutex_unlock(&tf->lock);
+
+    return NULL;
+}
+
+struct StopWatchTraceFile *stopwatch_tracefile_open(const char *path,
+                                                    Error **errp)
+{
+    struct StopWatchTraceFile *tf;
+    static const char header[] = "[\n";
+    int fd;
+
+    fd = qemu_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "cannot open the trace file '%s'", path);
+        return NULL;
+    }
+
+    tf = g_new0(struct StopWatchTraceFile, 1);
+    tf->fd = fd;
+    tf->buf[0] = g_malloc(STOPWATCH_TRACE_BUF_SIZE);
+    tf->buf[1] = g_malloc(STOPWATCH_TRACE_BUF_SIZE);
+
+    /* JSON array format, every event is followed by a comma */
+    stopwatch_tracefile_write(tf, header, sizeof(header) - 1);
+
+    qemu_mutex_init(&tf->lock);
+    qemu_cond_init(&tf->cond);
+    qemu_thread_create(&tf->thread, TYPE_STOPWATCH "-trace",
+                       stopwatch_tracefile_thread, tf, QEMU_THREAD_JOINABLE);
+
+    return tf;
+}
+
+void stopwatch_tracefile_close(struct StopWatchTraceFile *tf)
+{
+    char footer[STOPWATCH_TRACE_EVENT_MAX];
+    int len;
+
+    qemu_mutex_lock(&tf->lock);
+    tf->stop = true;
+    qemu_cond_signal(&tf->cond);
+    qemu_mutex_unlock(&tf->lock);
+
+    qemu_thread_join(&tf->thread);
+
+    /* the metadata event closes the array */
+    len = snprintf(footer, sizeof(footer),
+                   "{\"name\":\"dropped_events\",\"ph\":\"M\",\"pid\":0,"
+                   "\"args\":{\"count\":%" PRIu64 "}}\n]\n", tf->dropped);
+    stopwatch_tracefile_write(tf, footer, len);
+
+    qemu_cond_destroy(&tf->cond);
+    qemu_mutex_destroy(&tf->lock);
+    close(tf->fd);
+    g_free(tf->buf[0]);
+    g_free(tf->buf[1]);
+    g_free(tf);
+}
+
+void stopwatch_tracefile_event(struct StopWatchTraceFile *tf,
+                               const char *cat, const char *name, char ph,
+                               uint32_t tid, uint64_t id, int64_t ts_ns,
+                               uint64_t arg)
+{
+    char event[STOPWATCH_TRACE_EVENT_MAX];
+    size_t *len;
+    int n;
+
+    /* formatted outside of the lock, the timestamps are in us */
+    n = snprintf(event, sizeof(event),
+                 "{\"cat\":\"%s\",\"name\":\"%s\",\"ph\":\"%c\","
+                 "\"pid\":0,\"tid\":%u,\"id\":\"0x%" PRIx64 "\","
+                 "\"ts\":%" PRId64 ".%03d,\"s\":\"t\","
+                 "\"args\":{\"arg\":%" PRIu64 "}},\n",
+                 cat, name, ph, tid, id, ts_ns / 1000, (int) (ts_ns % 1000),
+                 arg);
+    if (n < 0 || n >= sizeof(event)) {
+        return;
+    }
+
+    qemu_mutex_lock(&tf->lock);
+    len = &tf->len[tf->active];
+    if (*len + n > STOPWATCH_TRACE_BUF_SIZE) {
+        /* the writer is late, never wait for it */
+        tf->dropped++;
+    } else {
+        memcpy(tf->buf[tf->active] + *len, event, n);
+        *len += n;
+        if (*len >= STOPWATCH_TRACE_BUF_SIZE / 2) {
+            qemu_cond_signal(&tf->cond);
+        }
+    }
+    qemu_mutex_unlock(&tf->lock);
+}
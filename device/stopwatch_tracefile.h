@@ -0,0 +1,30 @@
+#ifndef HW_MISC_STOPWATCH_TRACEFILE_H
+#define HW_MISC_STOPWATCH_TRACEFILE_H
+
+/*
+ * Streaming export of the stopwatch events to a host file, in the
+ * Chrome trace JSON format (chrome://tracing, ui.perfetto.dev).
+ *
+ * The vCPU threads only append the events to an in-memory buffer. A
+ * writer thread swaps the buffers and writes them to the file, so the
+ * device never waits on the disk. When both buffers are full, the
+ * events are dropped and counted.
+ */
+
+struct StopWatchTraceFile;
+
+struct StopWatchTraceFile *stopwatch_tracefile_open(const char *path,
+                                                    Error **errp);
+void stopwatch_tracefile_close(struct StopWatchTraceFile *tf);
+
+/*
+ * Chrome trace event @name of category @cat, with phase @ph ('B'/'E'
+ * duration, 'i' instant, 'b'/'e' async with @id), on thread @tid at
+ * @ts_ns (device clock) and with the numeric argument @arg.
+ */
+void stopwatch_tracefile_event(struct StopWatchTraceFile *tf,
+                               const char *cat, const char *name, char ph,
+                               uint32_t tid, uint64_t id, int64_t ts_ns,
+                               uint64_t arg);
+
+#endif
@@ -0,0 +1 @@
+../driver/stopwatch_virtio.h
\ No newline at end of file
@@ -0,0 +1,130 @@
+#include "qemu/osdep.h"
+#include "migration/vmstate.h"
+#include "sysemu/sysemu.h"
+
+#include "hw/misc/stopwatch.h"
+#include "hw/misc/stopwatch_core.h"
+
+static bool stopwatch_heap_len_valid(void *opaque, int version_id)
+{
+    struct StopWatchCore *s = opaque;
+
+    return s->heap_len <= STOPWATCH_TIMERS_MAX;
+}
+
+static bool stopwatch_bank_periodic_needed(void *opaque)
+{
+    struct StopWatchBank *b = opaque;
+
+    return b->period_ns != 0;
+}
+
+/* the deadline of the period is the one of the timeout timer */
+static const VMStateDescription vmstate_stopwatch_bank_periodic = {
+    .name = TYPE_STOPWATCH "-bank/periodic",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = stopwatch_bank_periodic_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT64(period_ns, struct StopWatchBank),
+        VMSTATE_BOOL(period_pending, struct StopWatchBank),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_stopwatch_bank = {
+    .name = TYPE_STOPWATCH "-bank",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT64(status, struct StopWatchBank),
+        VMSTATE_INT64(started_at_ns, struct StopWatchBank),
+        VMSTATE_INT64(total_time_ns, struct StopWatchBank),
+        VMSTATE_INT64(last_lap_ns, struct StopWatchBank),
+        VMSTATE_BOOL(timeout_ongoing, struct StopWatchBank),
+        VMSTATE_INT64(timeout_deadline_ns, struct StopWatchBank),
+        VMSTATE_UINT32(line, struct StopWatchBank),
+        VMSTATE_END_OF_LIST()
+    },
+    .subsections = (const VMStateDescription*[]) {
+        &vmstate_stopwatch_bank_periodic,
+        NULL
+    }
+};
+
+static const VMStateDescription vmstate_stopwatch_timer = {
+    .name = TYPE_STOPWATCH "-timer",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_INT64(deadline_ns, struct StopWatchTimer),
+        VMSTATE_UINT32(id, struct StopWatchTimer),
+        VMSTATE_UINT32(line, struct StopWatchTimer),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static bool stopwatch_core_clockevent_needed(void *opaque)
+{
+    struct StopWatchCore *s = opaque;
+
+    return s->event_deadline_ns >= 0;
+}
+
+/* the pending clock event is in irq_status */
+static const VMStateDescription vmstate_stopwatch_core_clockevent = {
+    .name = TYPE_STOPWATCH "-core/clockevent",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = stopwatch_core_clockevent_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_INT64(event_deadline_ns, struct StopWatchCore),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+const VMStateDescription vmstate_stopwatch_core = {
+    .name = TYPE_STOPWATCH "-core",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_save = stopwatch_core_pre_save,
+    .post_load = stopwatch_core_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32_EQUAL(nb_banks, struct StopWatchCore, NULL),
+        VMSTATE_UINT32_EQUAL(nb_irqs, struct StopWatchCore, NULL),
+        VMSTATE_INT64(saved_clock_ns, struct StopWatchCore),
+        VMSTATE_UINT64(irq_status, struct StopWatchCore),
+        VMSTATE_UINT32(timer_irq_lines, struct StopWatchCore),
+        VMSTATE_STRUCT_VARRAY_POINTER_UINT32(banks, struct StopWatchCore,
+                                             nb_banks, vmstate_stopwatch_bank,
+                                             struct StopWatchBank),
+        VMSTATE_UINT32(heap_len, struct StopWatchCore),
+        VMSTATE_VALIDATE("heap_len", stopwatch_heap_len_valid),
+        VMSTATE_STRUCT_VARRAY_POINTER_UINT32(heap, struct StopWatchCore,
+                                             heap_len, vmstate_stopwatch_timer,
+                                             struct StopWatchTimer),
+        VMSTATE_END_OF_LIST()
+    },
+    .subsections = (const VMStateDescription*[]) {
+        &vmstate_stopwatch_core_clockevent,
+        NULL
+    }
+};
+
+static void stopwatch_core_vm_change(void *opaque, int running,
+                                     RunState state)
+{
+    stopwatch_core_set_running(opaque, running);
+}
+
+void stopwatch_core_vm_init(struct StopWatchCore *s)
+{
+    s->vm_state = qemu_add_vm_change_state_handler(stopwatch_core_vm_change,
+                                                   s);
+    stopwatch_core_set_running(s, runstate_is_running());
+}
+
+void stopwatch_core_vm_cleanup(struct StopWatchCore *s)
+{
+    qemu_del_vm_change_state_handler(s->vm_state);
+}
@@ -0,0 +1,380 @@
+#include "qemu/osdep.h"
+#include "qemu/iov.h"
+#include "qemu/bswap.h"
+#include "qemu/atomic.h"
+#include "qemu/main-loop.h"
+#include "qapi/error.h"
+#include "standard-headers/linux/virtio_config.h"
+#include "contrib/libvhost-user/libvhost-user-glib.h"
+
+#include <sys/un.h>
+
+#include "hw/misc/stopwatch_core.h"
+#include "hw/misc/stopwatch_virtio.h"
+
+/*
+ * vhost-user backend of vhost-user-stopwatch (hw/misc/vhost-user-stopwatch.c):
+ * the engine of virtio-stopwatch, out of the QEMU process. The queues, the
+ * timers and the engine run in the main loop of a single thread, which can
+ * be pinned to a dedicated host core. VIRTIO_F_VERSION_1 only, so the
+ * fields are little-endian.
+ *
+ * Built in the QEMU build directory with 'make vhost-user-stopwatch'.
+ */
+
+struct VuStopWatch {
+    VugDev parent;
+    struct StopWatchCore core;
+    struct StopWatch_mem *mem;
+    uint64_t timeouts; /* bank timeouts not posted yet */
+    GMainLoop *loop;
+};
+
+static struct VuStopWatch *vu_stopwatch(VuDev *dev)
+{
+    return container_of(dev, struct VuStopWatch, parent.parent);
+}
+
+static void vus_panic(VuDev *dev, const char *msg)
+{
+    fprintf(stderr, "vhost-user-stopwatch: %s\n", msg);
+    g_main_loop_quit(vu_stopwatch(dev)->loop);
+}
+
+static uint64_t vus_get_features(VuDev *dev)
+{
+    return 1ULL << VIRTIO_F_VERSION_1 |
+           1ULL << VIRTIO_RING_F_INDIRECT_DESC |
+           1ULL << VIRTIO_RING_F_EVENT_IDX |
+           1ULL << VHOST_USER_F_PROTOCOL_FEATURES;
+}
+
+static uint64_t vus_get_protocol_features(VuDev *dev)
+{
+    return 1ULL << VHOST_USER_PROTOCOL_F_CONFIG;
+}
+
+static int vus_get_config(VuDev *dev, uint8_t *config, uint32_t len)
+{
+    struct VuStopWatch *s = vu_stopwatch(dev);
+    struct StopWatch_virtio_config c = {
+        .banks = cpu_to_le32(s->core.nb_banks),
+        .timers = cpu_to_le32(STOPWATCH_TIMERS_MAX),
+    };
+
+    if (len > sizeof(c)) {
+        return -1;
+    }
+    memcpy(config, &c, len);
+
+    return 0;
+}
+
+/* see virtio_stopwatch_post */
+static bool vus_post(struct VuStopWatch *s, uint32_t type, uint32_t index,
+                     uint64_t deadline_ns, uint64_t expired_ns)
+{
+    VuDev *dev = &s->parent.parent;
+    VuVirtq *vq = vu_get_queue(dev, STOPWATCH_VIRTIO_EVENTQ);
+    struct StopWatch_virtio_event ev;
+    VuVirtqElement *elem;
+    size_t len;
+
+    elem = vu_queue_pop(dev, vq, sizeof(VuVirtqElement));
+    if (!elem) {
+        return false;
+    }
+
+    ev.type = cpu_to_le32(type);
+    ev.index = cpu_to_le32(index);
+    ev.deadline_ns = cpu_to_le64(deadline_ns);
+    ev.expired_ns = cpu_to_le64(expired_ns);
+
+    len = iov_from_buf(elem->in_sg, elem->in_num, 0, &ev, sizeof(ev));
+    vu_queue_push(dev, vq, elem, len);
+    free(elem);
+
+    return true;
+}
+
+/* see virtio_stopwatch_post_events */
+static void vus_post_events(struct VuStopWatch *s)
+{
+    VuDev *dev = &s->parent.parent;
+    VuVirtq *vq = vu_get_queue(dev, STOPWATCH_VIRTIO_EVENTQ);
+    struct StopWatch_expiry_ring *ring = &s->mem->expiry[0];
+    int64_t now = qemu_clock_get_ns(s->core.clock_type);
+    bool posted = false;
+    int i;
+
+    if (!vu_queue_started(dev, vq)) {
+        return;
+    }
+
+    for (i = 0; i < s->core.nb_banks; i++) {
+        if (!(s->timeouts & BIT_ULL(i))) {
+            continue;
+        }
+        if (!vus_post(s, STOPWATCH_VIRTIO_EVENT_TIMEOUT, i, 0, now)) {
+            goto out;
+        }
+        s->timeouts &= ~BIT_ULL(i);
+        posted = true;
+    }
+
+    while (ring->head != atomic_read(&ring->tail)) {
+        uint32_t head = ring->head;
+        uint32_t tail = atomic_read(&ring->tail);
+
+        smp_rmb(); /* entries after the tail */
+
+        for (; head != tail; head++) {
+            struct StopWatch_expiry *e =
+                &ring->entries[head % STOPWATCH_EXPIRY_RING_SIZE];
+
+            if (!vus_post(s, STOPWATCH_VIRTIO_EVENT_TIMER, e->id,
+                          e->deadline_ns, e->expired_ns)) {
+                break;
+            }
+            posted = true;
+        }
+        atomic_set(&ring->head, head);
+
+        if (head != tail) {
+            break;
+        }
+        stopwatch_core_line_ack(&s->core, 0);
+    }
+
+out:
+    /* suppressed by the guest with VIRTIO_RING_F_EVENT_IDX */
+    if (posted) {
+        vu_queue_notify(dev, vq);
+    }
+}
+
+static void vus_irq(void *opaque, uint32_t levels, uint64_t events)
+{
+    struct VuStopWatch *s = opaque;
+
+    s->timeouts |= events & STOPWATCH_CORE_EVENT_BANKS;
+    vus_post_events(s);
+}
+
+static void vus_handle_eventq(VuDev *dev, int qidx)
+{
+    struct VuStopWatch *s = vu_stopwatch(dev);
+
+    vus_post_events(s);
+    stopwatch_core_flush_irqs(&s->core);
+}
+
+/*
+ * See virtio_stopwatch_handle_cmdq. An invalid request is completed
+ * without data, which the guest driver reports as an I/O error.
+ */
+static void vus_handle_cmdq(VuDev *dev, int qidx)
+{
+    struct VuStopWatch *s = vu_stopwatch(dev);
+    VuVirtq *vq = vu_get_queue(dev, qidx);
+    VuVirtqElement *elem;
+    bool done = false;
+
+    while ((elem = vu_queue_pop(dev, vq, sizeof(VuVirtqElement)))) {
+        size_t size = iov_size(elem->out_sg, elem->out_num);
+        uint32_t n = size / sizeof(struct StopWatch_cmd);
+        struct StopWatch_cmd *cmds;
+        struct StopWatch_cpl *cpls;
+        size_t len;
+        uint32_t i;
+
+        if (!n || n > STOPWATCH_VIRTIO_CMDS_MAX
+            || size % sizeof(struct StopWatch_cmd)
+            || iov_size(elem->in_sg, elem->in_num)
+               < n * sizeof(struct StopWatch_cpl)) {
+            fprintf(stderr, "vhost-user-stopwatch: invalid request\n");
+            vu_queue_push(dev, vq, elem, 0);
+            free(elem);
+            done = true;
+            continue;
+        }
+
+        cmds = g_new(struct StopWatch_cmd, n);
+        cpls = g_new(struct StopWatch_cpl, n);
+
+        iov_to_buf(elem->out_sg, elem->out_num, 0, cmds, n * sizeof(*cmds));
+        for (i = 0; i < n; i++) {
+            cmds[i].action = le16_to_cpu(cmds[i].action);
+            cmds[i].flags = le16_to_cpu(cmds[i].flags);
+            cmds[i].index = le32_to_cpu(cmds[i].index);
+            cmds[i].arg = le64_to_cpu(cmds[i].arg);
+            cmds[i].tag = le64_to_cpu(cmds[i].tag);
+        }
+
+        stopwatch_core_exec(&s->core, cmds, cpls, n);
+
+        for (i = 0; i < n; i++) {
+            cpls[i].tag = cpu_to_le64(cpls[i].tag);
+            cpls[i].result = cpu_to_le64(cpls[i].result);
+            cpls[i].value = cpu_to_le64(cpls[i].value);
+        }
+        len = iov_from_buf(elem->in_sg, elem->in_num, 0, cpls,
+                           n * sizeof(*cpls));
+
+        vu_queue_push(dev, vq, elem, len);
+        free(elem);
+        g_free(cmds);
+        g_free(cpls);
+        done = true;
+    }
+
+    if (done) {
+        vu_queue_notify(dev, vq);
+    }
+    stopwatch_core_flush_irqs(&s->core);
+}
+
+static void vus_queue_set_started(VuDev *dev, int qidx, bool started)
+{
+    VuVirtq *vq = vu_get_queue(dev, qidx);
+    vu_queue_handler_cb handler = NULL;
+
+    if (started) {
+        handler = qidx == STOPWATCH_VIRTIO_CMDQ ? vus_handle_cmdq
+                                                : vus_handle_eventq;
+    }
+    vu_set_queue_handler(dev, vq, handler);
+}
+
+static const VuDevIface vus_iface = {
+    .get_features = vus_get_features,
+    .get_protocol_features = vus_get_protocol_features,
+    .get_config = vus_get_config,
+    .queue_set_started = vus_queue_set_started,
+};
+
+static int vus_listen(const char *path)
+{
+    struct sockaddr_un un = { .sun_family = AF_UNIX };
+    int sock;
+
+    if (strlen(path) >= sizeof(un.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(un.sun_path, path);
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    unlink(path);
+    if (bind(sock, (struct sockaddr *) &un, sizeof(un)) < 0
+        || listen(sock, 1) < 0) {
+        perror(path);
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s -s SOCKET [-b BANKS] [-c CLOCK] [-C CPU] [-t TRACE]\n"
+            "  -s SOCKET  vhost-user socket, listened to\n"
+            "  -b BANKS   number of stopwatch banks (default 1)\n"
+            "  -c CLOCK   device clock: host (default) or realtime\n"
+            "  -C CPU     pin the daemon to host CPU\n"
+            "  -t TRACE   stream the device events (Chrome trace JSON)\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    struct VuStopWatch s = { 0 };
+    const char *socket_path = NULL;
+    int opt, cpu = -1, lsock, csock;
+
+    s.core.start_at_boot = true;
+    s.core.clock_name = (char *) "host"; /* no guest clock out of QEMU */
+    s.core.nb_banks = 1;
+    s.core.nb_irqs = 1;
+
+    while ((opt = getopt(argc, argv, "s:b:c:C:t:h")) != -1) {
+        switch (opt) {
+        case 's':
+            socket_path = optarg;
+            break;
+        case 'b':
+            s.core.nb_banks = atoi(optarg);
+            break;
+        case 'c':
+            s.core.clock_name = optarg;
+            break;
+        case 'C':
+            cpu = atoi(optarg);
+            break;
+        case 't':
+            s.core.trace_file = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (!socket_path) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (cpu >= 0) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+            perror("sched_setaffinity");
+            return 1;
+        }
+    }
+
+    qemu_init_main_loop(&error_fatal);
+
+    s.mem = g_new0(struct StopWatch_mem, 1);
+    s.core.irq_func = vus_irq;
+    s.core.irq_opaque = &s;
+    stopwatch_core_realize(&s.core, qemu_get_aio_context(), s.mem,
+                           &error_fatal);
+
+    lsock = vus_listen(socket_path);
+    if (lsock < 0) {
+        return 1;
+    }
+
+    csock = accept(lsock, NULL, NULL);
+    if (csock < 0) {
+        perror("accept");
+        return 1;
+    }
+
+    s.loop = g_main_loop_new(NULL, FALSE);
+    vug_init(&s.parent, csock, vus_panic, &vus_iface);
+
+    g_main_loop_run(s.loop);
+
+    vug_deinit(&s.parent);
+    g_main_loop_unref(s.loop);
+    close(csock);
+    close(lsock);
+    unlink(socket_path);
+
+    stopwatch_core_unrealize(&s.core);
+    g_free(s.mem);
+
+    return 0;
+}
@@ -0,0 +1,77 @@
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "hw/virtio/virtio-pci.h"
+
+#include "hw/misc/virtio-stopwatch.h"
+
+/* virtio-pci proxy of vhost-user-stopwatch, modern only (virtio 1) */
+
+#define TYPE_VHOST_USER_STOPWATCH_PCI "vhost-user-stopwatch-pci"
+
+#define VHOST_USER_STOPWATCH_PCI(obj) \
+        OBJECT_CHECK(struct VHostUserStopWatchPCI, (obj), \
+                     TYPE_VHOST_USER_STOPWATCH_PCI)
+
+struct VHostUserStopWatchPCI {
+    VirtIOPCIProxy parent_obj;
+    struct VHostUserStopWatch vdev;
+};
+
+static Property vhost_user_stopwatch_pci_properties[] = {
+    DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors,
+                       DEV_NVECTORS_UNSPECIFIED),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void vhost_user_stopwatch_pci_realize(VirtIOPCIProxy *vpci_dev,
+                                         Error **errp)
+{
+    struct VHostUserStopWatchPCI *dev = VHOST_USER_STOPWATCH_PCI(vpci_dev);
+    DeviceState *vdev = DEVICE(&dev->vdev);
+
+    /* one MSI-X vector per queue, and the configuration */
+    if (vpci_dev->nvectors == DEV_NVECTORS_UNSPECIFIED) {
+        vpci_dev->nvectors = STOPWATCH_VIRTIO_QUEUES + 1;
+    }
+
+    virtio_pci_force_virtio_1(vpci_dev);
+    qdev_set_parent_bus(vdev, BUS(&vpci_dev->bus));
+    object_property_set_bool(OBJECT(vdev), true, "realized", errp);
+}
+
+static void vhost_user_stopwatch_pci_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    VirtioPCIClass *k = VIRTIO_PCI_CLASS(klass);
+    PCIDeviceClass *pcidev_k = PCI_DEVICE_CLASS(klass);
+
+    k->realize = vhost_user_stopwatch_pci_realize;
+    dc->props = vhost_user_stopwatch_pci_properties;
+    set_bit(DEVICE_CATEGORY_MISC, dc->categories);
+
+    pcidev_k->vendor_id = PCI_VENDOR_ID_REDHAT_QUMRANET;
+    pcidev_k->revision = VIRTIO_PCI_ABI_VERSION;
+    pcidev_k->class_id = PCI_CLASS_OTHERS;
+}
+
+static void vhost_user_stopwatch_pci_instance_init(Object *obj)
+{
+    struct VHostUserStopWatchPCI *dev = VHOST_USER_STOPWATCH_PCI(obj);
+
+    virtio_instance_init_common(obj, &dev->vdev, sizeof(dev->vdev),
+                                TYPE_VHOST_USER_STOPWATCH);
+}
+
+static const VirtioPCIDeviceTypeInfo vhost_user_stopwatch_pci_info = {
+    .generic_name  = TYPE_VHOST_USER_STOPWATCH_PCI,
+    .instance_size = sizeof(struct VHostUserStopWatchPCI),
+    .instance_init = vhost_user_stopwatch_pci_instance_init,
+    .class_init    = vhost_user_stopwatch_pci_class_init,
+};
+
+static void vhost_user_stopwatch_pci_register(void)
+{
+    virtio_pci_types_register(&vhost_user_stopwatch_pci_info);
+}
+
+type_init(vhost_user_stopwatch_pci_register);
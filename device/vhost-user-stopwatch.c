@@ -0,0 +1,267 @@
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "hw/virtio/virtio.h"
+#include "hw/virtio/virtio-bus.h"
+#include "hw/virtio/virtio-access.h"
+#include "hw/virtio/vhost.h"
+#include "hw/virtio/vhost-user.h"
+#include "sysemu/sysemu.h"
+
+#include "hw/misc/virtio-stopwatch.h"
+
+/*
+ * virtio-stopwatch backed by a vhost-user daemon: QEMU only sets up the
+ * virtqueues and the notifications, the commands and the events never
+ * go through it. The guest sees the same device as virtio-stopwatch.
+ */
+
+static const int vhost_user_stopwatch_feature_bits[] = {
+    VIRTIO_F_VERSION_1,
+    VIRTIO_RING_F_INDIRECT_DESC,
+    VIRTIO_RING_F_EVENT_IDX,
+    VIRTIO_F_NOTIFY_ON_EMPTY,
+    VHOST_INVALID_FEATURE_BIT
+};
+
+static void vhost_user_stopwatch_start(VirtIODevice *vdev)
+{
+    struct VHostUserStopWatch *s = VHOST_USER_STOPWATCH(vdev);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int i, ret;
+
+    if (!k->set_guest_notifiers) {
+        error_report("vhost-user-stopwatch: no guest notifiers");
+        return;
+    }
+
+    ret = vhost_dev_enable_notifiers(&s->dev, vdev);
+    if (ret < 0) {
+        error_report("vhost-user-stopwatch: host notifiers: %d", -ret);
+        return;
+    }
+
+    ret = k->set_guest_notifiers(qbus->parent, s->dev.nvqs, true);
+    if (ret < 0) {
+        error_report("vhost-user-stopwatch: guest notifiers: %d", -ret);
+        goto err_host_notifiers;
+    }
+
+    s->dev.acked_features = vdev->guest_features;
+    ret = vhost_dev_start(&s->dev, vdev);
+    if (ret < 0) {
+        error_report("vhost-user-stopwatch: start: %d", -ret);
+        goto err_guest_notifiers;
+    }
+
+    /* the transport masks the notifiers with irqfd, if any */
+    for (i = 0; i < s->dev.nvqs; i++) {
+        vhost_virtqueue_mask(&s->dev, vdev, i, false);
+    }
+
+    return;
+
+err_guest_notifiers:
+    k->set_guest_notifiers(qbus->parent, s->dev.nvqs, false);
+err_host_notifiers:
+    vhost_dev_disable_notifiers(&s->dev, vdev);
+}
+
+static void vhost_user_stopwatch_stop(VirtIODevice *vdev)
+{
+    struct VHostUserStopWatch *s = VHOST_USER_STOPWATCH(vdev);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+
+    if (!k->set_guest_notifiers) {
+        return;
+    }
+
+    vhost_dev_stop(&s->dev, vdev);
+    k->set_guest_notifiers(qbus->parent, s->dev.nvqs, false);
+    vhost_dev_disable_notifiers(&s->dev, vdev);
+}
+
+static void vhost_user_stopwatch_set_status(VirtIODevice *vdev, uint8_t status)
+{
+    struct VHostUserStopWatch *s = VHOST_USER_STOPWATCH(vdev);
+    bool should_start = status & VIRTIO_CONFIG_S_DRIVER_OK;
+
+    if (!vdev->vm_running) {
+        should_start = false;
+    }
+
+    if (s->dev.started == should_start) {
+        return;
+    }
+
+    if (should_start) {
+        vhost_user_stopwatch_start(vdev);
+    } else {
+        vhost_user_stopwatch_stop(vdev);
+    }
+}
+
+static void vhost_user_stopwatch_get_config(VirtIODevice *vdev, uint8_t *data)
+{
+    struct VHostUserStopWatch *s = VHOST_USER_STOPWATCH(vdev);
+
+    memcpy(data, &s->config, sizeof(s->config));
+}
+
+static uint64_t vhost_user_stopwatch_get_features(VirtIODevice *vdev,
+                                                  uint64_t features,
+                                                  Error **errp)
+{
+    struct VHostUserStopWatch *s = VHOST_USER_STOPWATCH(vdev);
+
+    return vhost_get_features(&s->dev, vhost_user_stopwatch_feature_bits,
+                              features);
+}
+
+/* config change signalled by the daemon */
+static int vhost_user_stopwatch_config_changed(struct vhost_dev *dev)
+{
+    struct VHostUserStopWatch *s = container_of(dev, struct VHostUserStopWatch,
+                                                dev);
+    int ret;
+
+    ret = vhost_dev_get_config(dev, (uint8_t *) &s->config,
+                               sizeof(s->config));
+    if (ret < 0) {
+        error_report("vhost-user-stopwatch: get config failed");
+        return ret;
+    }
+
+    virtio_notify_config(VIRTIO_DEVICE(s));
+
+    return 0;
+}
+
+static const VhostDevConfigOps vhost_user_stopwatch_config_ops = {
+    .vhost_dev_config_notifier = vhost_user_stopwatch_config_changed,
+};
+
+/* the daemon processes the queues, the kicks only reach QEMU before start */
+static void vhost_user_stopwatch_handle_output(VirtIODevice *vdev,
+                                               VirtQueue *vq)
+{
+}
+
+static void vhost_user_stopwatch_realize(DeviceState *dev, Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(dev);
+    struct VHostUserStopWatch *s = VHOST_USER_STOPWATCH(dev);
+    int i, ret;
+
+    if (!s->chardev.chr) {
+        error_setg(errp, "vhost-user-stopwatch: chardev is mandatory");
+        return;
+    }
+
+    s->vhost_user = vhost_user_init();
+    if (!s->vhost_user) {
+        error_setg(errp, "vhost-user-stopwatch: vhost-user init failed");
+        return;
+    }
+    s->vhost_user->chr = &s->chardev;
+
+    virtio_init(vdev, "vhost-user-stopwatch", VIRTIO_ID_STOPWATCH,
+                sizeof(struct StopWatch_virtio_config));
+
+    for (i = 0; i < STOPWATCH_VIRTIO_QUEUES; i++) {
+        virtio_add_queue(vdev, STOPWATCH_VIRTIO_QUEUE_SIZE,
+                         vhost_user_stopwatch_handle_output);
+    }
+
+    s->dev.nvqs = STOPWATCH_VIRTIO_QUEUES;
+    s->dev.vqs = s->vqs;
+    s->dev.vq_index = 0;
+    s->dev.backend_features = 0;
+
+    /* VHOST_USER_PROTOCOL_F_CONFIG is only negotiated with config ops */
+    vhost_dev_set_config_notifier(&s->dev, &vhost_user_stopwatch_config_ops);
+
+    ret = vhost_dev_init(&s->dev, s->vhost_user, VHOST_BACKEND_TYPE_USER, 0);
+    if (ret < 0) {
+        error_setg(errp, "vhost-user-stopwatch: vhost init failed: %s",
+                   strerror(-ret));
+        goto err_virtio;
+    }
+
+    /* the number of banks is an option of the daemon */
+    ret = vhost_dev_get_config(&s->dev, (uint8_t *) &s->config,
+                               sizeof(s->config));
+    if (ret < 0) {
+        error_setg(errp, "vhost-user-stopwatch: get config failed");
+        goto err_vhost;
+    }
+
+    return;
+
+err_vhost:
+    vhost_dev_cleanup(&s->dev);
+err_virtio:
+    virtio_cleanup(vdev);
+    vhost_user_cleanup(s->vhost_user);
+    g_free(s->vhost_user);
+    s->vhost_user = NULL;
+}
+
+static void vhost_user_stopwatch_unrealize(DeviceState *dev, Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(dev);
+    struct VHostUserStopWatch *s = VHOST_USER_STOPWATCH(dev);
+
+    vhost_user_stopwatch_set_status(vdev, 0);
+    vhost_dev_cleanup(&s->dev);
+    virtio_cleanup(vdev);
+
+    if (s->vhost_user) {
+        vhost_user_cleanup(s->vhost_user);
+        g_free(s->vhost_user);
+        s->vhost_user = NULL;
+    }
+}
+
+/* the engine state is in the daemon */
+static const VMStateDescription vmstate_vhost_user_stopwatch = {
+    .name = "vhost-user-stopwatch",
+    .unmigratable = 1,
+};
+
+static Property vhost_user_stopwatch_properties[] = {
+    DEFINE_PROP_CHR("chardev", struct VHostUserStopWatch, chardev),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void vhost_user_stopwatch_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    VirtioDeviceClass *vdc = VIRTIO_DEVICE_CLASS(klass);
+
+    dc->props = vhost_user_stopwatch_properties;
+    dc->vmsd = &vmstate_vhost_user_stopwatch;
+    set_bit(DEVICE_CATEGORY_MISC, dc->categories);
+
+    vdc->realize = vhost_user_stopwatch_realize;
+    vdc->unrealize = vhost_user_stopwatch_unrealize;
+    vdc->get_config = vhost_user_stopwatch_get_config;
+    vdc->get_features = vhost_user_stopwatch_get_features;
+    vdc->set_status = vhost_user_stopwatch_set_status;
+}
+
+static const TypeInfo vhost_user_stopwatch_info = {
+    .name           = TYPE_VHOST_USER_STOPWATCH,
+    .parent         = TYPE_VIRTIO_DEVICE,
+    .instance_size  = sizeof(struct VHostUserStopWatch),
+    .class_init     = vhost_user_stopwatch_class_init,
+};
+
+static void vhost_user_stopwatch_register_types(void)
+{
+    type_register_static(&vhost_user_stopwatch_info);
+}
+
+type_init(vhost_user_stopwatch_register_types);
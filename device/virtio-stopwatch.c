@@ -0,0 +1,371 @@
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/iov.h"
+#include "qemu/atomic.h"
+#include "qemu/main-loop.h"
+#include "hw/virtio/virtio.h"
+#include "hw/virtio/virtio-access.h"
+#include "migration/vmstate.h"
+#include "trace.h"
+
+#include "hw/misc/virtio-stopwatch.h"
+
+/*
+ * virtio transport of the stopwatch engine (stopwatch_core.c), see
+ * stopwatch_virtio.h. The shared memory of the engine is private to the
+ * host: the time pages are unused, and the device drains the expiry ring
+ * of its single line into the event queue.
+ */
+
+static void virtio_stopwatch_get_config(VirtIODevice *vdev, uint8_t *data)
+{
+    struct VirtIOStopWatch *v = VIRTIO_STOPWATCH(vdev);
+    struct StopWatch_virtio_config *config = (void *) data;
+
+    virtio_stl_p(vdev, &config->banks, v->core.nb_banks);
+    virtio_stl_p(vdev, &config->timers, STOPWATCH_TIMERS_MAX);
+}
+
+static uint64_t virtio_stopwatch_get_features(VirtIODevice *vdev,
+                                              uint64_t features, Error **errp)
+{
+    return features;
+}
+
+/* one event in the next buffer of the eventq, false if there is none */
+static bool virtio_stopwatch_post(struct VirtIOStopWatch *v, uint32_t type,
+                                  uint32_t index, uint64_t deadline_ns,
+                                  uint64_t expired_ns)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(v);
+    struct StopWatch_virtio_event ev;
+    VirtQueueElement *elem;
+    size_t len;
+
+    elem = virtqueue_pop(v->eventq, sizeof(VirtQueueElement));
+    if (!elem) {
+        return false;
+    }
+
+    ev.type = virtio_tswap32(vdev, type);
+    ev.index = virtio_tswap32(vdev, index);
+    ev.deadline_ns = virtio_tswap64(vdev, deadline_ns);
+    ev.expired_ns = virtio_tswap64(vdev, expired_ns);
+
+    len = iov_from_buf(elem->in_sg, elem->in_num, 0, &ev, sizeof(ev));
+    virtqueue_push(v->eventq, elem, len);
+    g_free(elem);
+
+    trace_virtio_stopwatch_event(type, index);
+
+    return true;
+}
+
+/*
+ * Post the pending bank timeouts and the expired timers, with the BQL
+ * held. What does not fit in the eventq waits for the guest to add
+ * buffers, see virtio_stopwatch_handle_eventq.
+ */
+static void virtio_stopwatch_post_events(struct VirtIOStopWatch *v)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(v);
+    struct StopWatch_expiry_ring *ring = &v->mem->expiry[0];
+    int64_t now = qemu_clock_get_ns(v->core.clock_type);
+    bool posted = false;
+    int i;
+
+    if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
+        return;
+    }
+
+    for (i = 0; i < v->core.nb_banks; i++) {
+        if (!(v->timeouts & BIT_ULL(i))) {
+            continue;
+        }
+        if (!virtio_stopwatch_post(v, STOPWATCH_VIRTIO_EVENT_TIMEOUT, i,
+                                   0, now)) {
+            goto out;
+        }
+        v->timeouts &= ~BIT_ULL(i);
+        posted = true;
+    }
+
+    while (ring->head != atomic_read(&ring->tail)) {
+        uint32_t head = ring->head;
+        uint32_t tail = atomic_read(&ring->tail);
+
+        smp_rmb(); /* entries after the tail */
+
+        for (; head != tail; head++) {
+            struct StopWatch_expiry *e =
+                &ring->entries[head % STOPWATCH_EXPIRY_RING_SIZE];
+
+            if (!virtio_stopwatch_post(v, STOPWATCH_VIRTIO_EVENT_TIMER, e->id,
+                                       e->deadline_ns, e->expired_ns)) {
+                break;
+            }
+            posted = true;
+        }
+        atomic_set(&ring->head, head);
+
+        if (head != tail) {
+            break;
+        }
+        /* the ring is empty: the timers that did not fit are posted now */
+        stopwatch_core_line_ack(&v->core, 0);
+    }
+
+out:
+    if (posted) {
+        virtio_notify(vdev, v->eventq);
+    }
+}
+
+/* see stopwatch_core_flush_irqs, the line level itself is meaningless here */
+static void virtio_stopwatch_irq(void *opaque, uint32_t levels,
+                                 uint64_t events)
+{
+    struct VirtIOStopWatch *v = opaque;
+
+    v->timeouts |= events & STOPWATCH_CORE_EVENT_BANKS;
+    virtio_stopwatch_post_events(v);
+}
+
+static void virtio_stopwatch_handle_eventq(VirtIODevice *vdev, VirtQueue *vq)
+{
+    struct VirtIOStopWatch *v = VIRTIO_STOPWATCH(vdev);
+
+    virtio_stopwatch_post_events(v);
+    stopwatch_core_flush_irqs(&v->core);
+}
+
+/*
+ * Each request is a batch of commands, run with a single pass of the
+ * engine, see stopwatch_core_exec. All the requests available are
+ * processed before the guest is notified, once.
+ */
+static void virtio_stopwatch_handle_cmdq(VirtIODevice *vdev, VirtQueue *vq)
+{
+    struct VirtIOStopWatch *v = VIRTIO_STOPWATCH(vdev);
+    VirtQueueElement *elem;
+    bool done = false;
+
+    while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
+        size_t size = iov_size(elem->out_sg, elem->out_num);
+        uint32_t n = size / sizeof(struct StopWatch_cmd);
+        struct StopWatch_cmd *cmds;
+        struct StopWatch_cpl *cpls;
+        size_t len;
+        uint32_t i;
+
+        /* returned with nothing written, the driver fails it */
+        if (!n || n > STOPWATCH_VIRTIO_CMDS_MAX
+            || size % sizeof(struct StopWatch_cmd)
+            || iov_size(elem->in_sg, elem->in_num)
+               < n * sizeof(struct StopWatch_cpl)) {
+            trace_virtio_stopwatch_invalid(size);
+            atomic_inc(&v->core.stats.errors);
+            virtqueue_push(vq, elem, 0);
+            g_free(elem);
+            done = true;
+            continue;
+        }
+
+        cmds = g_new(struct StopWatch_cmd, n);
+        cpls = g_new(struct StopWatch_cpl, n);
+
+        iov_to_buf(elem->out_sg, elem->out_num, 0, cmds, n * sizeof(*cmds));
+        for (i = 0; i < n; i++) {
+            cmds[i].action = virtio_tswap16(vdev, cmds[i].action);
+            cmds[i].flags = virtio_tswap16(vdev, cmds[i].flags);
+            cmds[i].index = virtio_tswap32(vdev, cmds[i].index);
+            cmds[i].arg = virtio_tswap64(vdev, cmds[i].arg);
+            cmds[i].tag = virtio_tswap64(vdev, cmds[i].tag);
+        }
+
+        stopwatch_core_exec(&v->core, cmds, cpls, n);
+        trace_virtio_stopwatch_cmdq(n);
+
+        for (i = 0; i < n; i++) {
+            cpls[i].tag = virtio_tswap64(vdev, cpls[i].tag);
+            cpls[i].result = virtio_tswap64(vdev, cpls[i].result);
+            cpls[i].value = virtio_tswap64(vdev, cpls[i].value);
+        }
+        len = iov_from_buf(elem->in_sg, elem->in_num, 0, cpls,
+                           n * sizeof(*cpls));
+
+        virtqueue_push(vq, elem, len);
+        g_free(elem);
+        g_free(cmds);
+        g_free(cpls);
+        done = true;
+    }
+
+    if (done) {
+        virtio_notify(vdev, vq);
+    }
+    stopwatch_core_flush_irqs(&v->core);
+}
+
+static void virtio_stopwatch_realize(DeviceState *dev, Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(dev);
+    struct VirtIOStopWatch *v = VIRTIO_STOPWATCH(dev);
+
+    v->mem = g_new0(struct StopWatch_mem, 1);
+    v->laps = v->mem->laps;
+
+    v->core.nb_irqs = 1;
+    v->core.irq_func = virtio_stopwatch_irq;
+    v->core.irq_opaque = v;
+    if (!stopwatch_core_realize(&v->core, qemu_get_aio_context(), v->mem,
+                                errp)) {
+        g_free(v->mem);
+        return;
+    }
+
+    virtio_init(vdev, "virtio-stopwatch", VIRTIO_ID_STOPWATCH,
+                sizeof(struct StopWatch_virtio_config));
+
+    v->cmdq = virtio_add_queue(vdev, STOPWATCH_VIRTIO_QUEUE_SIZE,
+                               virtio_stopwatch_handle_cmdq);
+    v->eventq = virtio_add_queue(vdev, STOPWATCH_VIRTIO_QUEUE_SIZE,
+                                 virtio_stopwatch_handle_eventq);
+
+    stopwatch_core_vm_init(&v->core);
+}
+
+/* the banks, the timers and the events not posted yet are dropped */
+static void virtio_stopwatch_reset(VirtIODevice *vdev)
+{
+    struct VirtIOStopWatch *v = VIRTIO_STOPWATCH(vdev);
+
+    stopwatch_core_reset(&v->core);
+    v->timeouts = 0;
+}
+
+static void virtio_stopwatch_unrealize(DeviceState *dev, Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(dev);
+    struct VirtIOStopWatch *v = VIRTIO_STOPWATCH(dev);
+
+    stopwatch_core_vm_cleanup(&v->core);
+    virtio_del_queue(vdev, STOPWATCH_VIRTIO_EVENTQ);
+    virtio_del_queue(vdev, STOPWATCH_VIRTIO_CMDQ);
+    virtio_cleanup(vdev);
+
+    stopwatch_core_unrealize(&v->core);
+    g_free(v->mem);
+}
+
+static const VMStateDescription vmstate_virtio_stopwatch_laps = {
+    .name = "virtio-stopwatch-laps",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(seq, struct StopWatch_laps),
+        VMSTATE_UINT32(tail, struct StopWatch_laps),
+        VMSTATE_UINT64(count, struct StopWatch_laps),
+        VMSTATE_UINT64(min_ns, struct StopWatch_laps),
+        VMSTATE_UINT64(max_ns, struct StopWatch_laps),
+        VMSTATE_UINT64(sum_ns, struct StopWatch_laps),
+        VMSTATE_UINT64_ARRAY(hist, struct StopWatch_laps,
+                             STOPWATCH_HIST_BUCKETS),
+        VMSTATE_BUFFER_UNSAFE(ring, struct StopWatch_laps, 0,
+                              sizeof(((struct StopWatch_laps *)0)->ring)),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+/* the time pages are published again by the core at load */
+static const VMStateDescription vmstate_virtio_stopwatch_mem = {
+    .name = "virtio-stopwatch-mem",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_BUFFER_UNSAFE(expiry[0], struct StopWatch_mem, 0,
+                              sizeof(struct StopWatch_expiry_ring)),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+/* the events not posted yet are in the timeouts and the expiry ring */
+static const VMStateDescription vmstate_virtio_stopwatch_device = {
+    .name = "virtio-stopwatch-device",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT(core, struct VirtIOStopWatch, 1,
+                       vmstate_stopwatch_core, struct StopWatchCore),
+        VMSTATE_UINT64(timeouts, struct VirtIOStopWatch),
+        VMSTATE_STRUCT_POINTER(mem, struct VirtIOStopWatch,
+                               vmstate_virtio_stopwatch_mem,
+                               struct StopWatch_mem),
+        VMSTATE_STRUCT_VARRAY_POINTER_UINT32(laps, struct VirtIOStopWatch,
+                                             core.nb_banks,
+                                             vmstate_virtio_stopwatch_laps,
+                                             struct StopWatch_laps),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_virtio_stopwatch = {
+    .name = "virtio-stopwatch",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_VIRTIO_DEVICE,
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property virtio_stopwatch_properties[] = {
+    DEFINE_PROP_BOOL("start_at_boot", struct VirtIOStopWatch,
+                     core.start_at_boot, true),
+    DEFINE_PROP_STRING("clock", struct VirtIOStopWatch, core.clock_name),
+    DEFINE_PROP_UINT32("banks", struct VirtIOStopWatch, core.nb_banks, 1),
+    DEFINE_PROP_STRING("trace_file", struct VirtIOStopWatch, core.trace_file),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void virtio_stopwatch_instance_init(Object *obj)
+{
+    struct VirtIOStopWatch *v = VIRTIO_STOPWATCH(obj);
+
+    object_property_add_uint64_ptr(obj, "stats-commands",
+                                   &v->core.stats.commands, &error_abort);
+    object_property_add_uint64_ptr(obj, "stats-errors", &v->core.stats.errors,
+                                   &error_abort);
+}
+
+static void virtio_stopwatch_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    VirtioDeviceClass *vdc = VIRTIO_DEVICE_CLASS(klass);
+
+    dc->props = virtio_stopwatch_properties;
+    dc->vmsd = &vmstate_virtio_stopwatch;
+    set_bit(DEVICE_CATEGORY_MISC, dc->categories);
+
+    vdc->realize = virtio_stopwatch_realize;
+    vdc->unrealize = virtio_stopwatch_unrealize;
+    vdc->get_config = virtio_stopwatch_get_config;
+    vdc->get_features = virtio_stopwatch_get_features;
+    vdc->reset = virtio_stopwatch_reset;
+    vdc->vmsd = &vmstate_virtio_stopwatch_device;
+}
+
+static const TypeInfo virtio_stopwatch_info = {
+    .name           = TYPE_VIRTIO_STOPWATCH,
+    .parent         = TYPE_VIRTIO_DEVICE,
+    .instance_size  = sizeof(struct VirtIOStopWatch),
+    .instance_init  = virtio_stopwatch_instance_init,
+    .class_init     = virtio_stopwatch_class_init,
+};
+
+static void virtio_stopwatch_register_types(void)
+{
+    type_register_static(&virtio_stopwatch_info);
+}
+
+type_init(virtio_stopwatch_register_types);
@@ -0,0 +1,64 @@
+#ifndef HW_MISC_VIRTIO_STOPWATCH_H
+#define HW_MISC_VIRTIO_STOPWATCH_H
+
+#include "hw/virtio/virtio.h"
+#include "hw/virtio/vhost.h"
+#include "hw/virtio/vhost-user.h"
+#include "chardev/char-fe.h"
+
+#include "hw/misc/stopwatch_core.h"
+#include "hw/misc/stopwatch_virtio.h"
+
+#define TYPE_VIRTIO_STOPWATCH "virtio-stopwatch-device"
+
+#define VIRTIO_STOPWATCH(obj) \
+        OBJECT_CHECK(struct VirtIOStopWatch, (obj), TYPE_VIRTIO_STOPWATCH)
+
+/* virtio transport of the engine, in QEMU */
+struct VirtIOStopWatch {
+    /*< private >*/
+    VirtIODevice parent_obj;
+
+    /*< public >*/
+    VirtQueue *cmdq;
+    VirtQueue *eventq;
+
+    /*< properties >*/
+
+    struct StopWatchCore core; /* banks, clock, ... and a single line */
+
+    /*< internal state >*/
+
+    /* host-private, only the expiry ring of the line and the laps are used */
+    struct StopWatch_mem *mem;
+    struct StopWatch_laps *laps; /* mem->laps, for the vmstate */
+    uint64_t timeouts; /* bank timeouts not posted yet in the eventq */
+};
+
+#define TYPE_VHOST_USER_STOPWATCH "vhost-user-stopwatch"
+
+#define VHOST_USER_STOPWATCH(obj) \
+        OBJECT_CHECK(struct VHostUserStopWatch, (obj), \
+                     TYPE_VHOST_USER_STOPWATCH)
+
+/*
+ * Same device, run by a vhost-user daemon (vhost-user-stopwatch in
+ * contrib/): the virtqueues are processed out of process.
+ */
+struct VHostUserStopWatch {
+    /*< private >*/
+    VirtIODevice parent_obj;
+
+    /*< properties >*/
+
+    CharBackend chardev;
+
+    /*< internal state >*/
+
+    struct vhost_dev dev;
+    struct vhost_virtqueue vqs[STOPWATCH_VIRTIO_QUEUES];
+    VhostUserState *vhost_user;
+    struct StopWatch_virtio_config config; /* from the daemon */
+};
+
+#endif
@@ -1,32 +1,93 @@
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/platform_device.h>
+#include <linux/pci.h>
 #include <linux/miscdevice.h>
 #include <linux/of.h>
 #include <linux/completion.h>
 #include <linux/io.h>
 #include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/idr.h>
+#include <linux/mutex.h>
 #include <linux/mm.h>
 #include <linux/slab.h>
 #include <linux/interrupt.h>
+#include <linux/cpumask.h>
 #include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/math64.h>
 #include <linux/moduleparam.h>
 #include <linux/uaccess.h>
+#include <linux/timekeeping.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/kfifo.h>
+#include <linux/eventfd.h>
+#include <linux/percpu.h>
+#include <linux/clocksource.h>
+#include <linux/clockchips.h>
+#include <linux/compat.h>
+#include <linux/kref.h>
 
 #include "stopwatch_hw-sw.h"
+#include "stopwatch_ioctl.h"
+
+#define STOPWATCH_MARK_EXPORT /* defines stopwatch_mark() */
+#include "stopwatch_mark.h"
+
+#define CREATE_TRACE_POINTS
+#include "stopwatch_trace.h"
 
 #define DRIVERNAME "stopwatch"
 #define DRV_VERSION "0.0.1"
 
-#define STOPWATCH_KERNEL_DEBUG
+/* dynamic debug, see Documentation/admin-guide/dynamic-debug-howto.rst */
+#define DEBUG_MSG(fmt, args...) pr_debug(DRIVERNAME ": " fmt "\n", ## args)
 
-#ifdef STOPWATCH_KERNEL_DEBUG
-#define DEBUG_MSG(fmt, args...) printk(KERN_ALERT DRIVERNAME": " fmt"\n", ## args)
-#else
-#define DEBUG_MSG(n, args...) do{} while(0)
-#endif
+#define STOPWATCH_DEVICES_MAX 16
+#define STOPWATCH_MINORS (STOPWATCH_DEVICES_MAX * STOPWATCH_BANKS_MAX)
+
+struct stopwatch_data;
+
+struct stopwatch_bank {
+	struct stopwatch_data *sw;
+	unsigned int index;
+
+	/* /dev/stopwatch<device>.<bank>, freed with its last open file */
+	struct cdev *cdev;
+	struct device *dev;
+
+	u64 timeout_irq_cnt;
+};
+
+/* IRQ line of a device, with an affinity hint to one CPU */
+struct stopwatch_line {
+	struct stopwatch_data *sw;
+	unsigned int index;
+	int irq;
+};
+
+/*
+ * Always-on counters, per CPU so that the parallel readers do not share
+ * a cache line. Summed in debugfs stopwatch<N>/counters.
+ */
+struct stopwatch_counters {
+	u64 commands; /* register and command ring commands */
+	u64 irqs;     /* IRQs handled, all lines */
+	u64 reads;    /* stopwatch values computed from the time pages */
+	u64 errors;   /* commands failed or timed out */
+};
 
 struct stopwatch_data {
+    int id;
+    char name[16];
+
+	/* the open files keep the data and the mappings after the remove */
+	struct kref ref;
+
     struct miscdevice mdev;
 
     struct StopWatch_regs __iomem *regs_base_addr;
@@ -36,70 +97,518 @@ struct stopwatch_data {
     struct StopWatch_mem  __iomem *mem_base_addr;
     resource_size_t mem_base_physaddr;
     resource_size_t mem_size;
+    /* struct StopWatch_shared in the memory, shared_size 0 if none */
+    resource_size_t shared_offset;
+    resource_size_t shared_size;
+
+	/* mark rings of the shared memory, in the 'mem' mapping */
+	struct StopWatch_mark_ring __iomem *marks;
+
+	/* serializes the command ring and the arguments in the shared memory */
+	struct mutex cmd_lock;
+	bool dead; /* under cmd_lock, device removed */
+
+	/*
+	 * device clock - guest raw monotonic clock, sampled at each command.
+	 * The last calibration wins, read locklessly, see
+	 * stopwatch_clock_offset.
+	 */
+	s64 clock_offset_ns;
+
+	struct dentry *debugfs_dir;
+
+	struct stopwatch_counters __percpu *counters;
+
+	atomic64_t timers_expired_cnt; /* timer engine expiries, all lines */
+
+	/* event subscribers (struct stopwatch_file), see stopwatch_post_event */
+	spinlock_t event_lock;
+	struct list_head event_files;
+	wait_queue_head_t event_wq;
+
+	/*
+	 * PCI: one MSI-X vector per bank and per line of timers, edge
+	 * triggered, the device acknowledges the timeouts itself.
+	 */
+	bool msix;
+
+	/*
+	 * clocksource and clock event device on the device clock, see
+	 * stopwatch_clock_register. The clock page is in the 'mem' mapping,
+	 * NULL if the device does not publish it.
+	 */
+	bool clock;
+	struct clocksource cs;
+	struct clock_event_device ced;
+	int clock_irq;
+	struct StopWatch_clock __iomem *clock_page; /* NULL: no clock page */
+
+	unsigned int nb_irqs;
+	struct stopwatch_line lines[STOPWATCH_IRQS_MAX];
+
+	unsigned int nb_banks;
+	struct stopwatch_bank banks[STOPWATCH_BANKS_MAX];
+};
+
+/* per open file of /dev/stopwatch<N>.<B> and debugfs bank<B> */
+struct stopwatch_bank_file {
+	struct stopwatch_bank *bank;
 
+	/* value of the bank, taken at open time */
+	unsigned int len;
 	char data[STOPWATCH_MEM_DATA_LENGTH];
-	unsigned int data_len;
 };
 
-struct stopwatch_data *pdata;
-atomic_t stopwatch_in_use;
+/* per open file of /dev/stopwatch<N> and debugfs 'all' */
+#define STOPWATCH_FILE_EVENTS 128
+
+struct stopwatch_file {
+	struct stopwatch_data *sw;
+
+	char *snapshot; /* all the banks, taken at open time */
+
+	/* events of the subscribed banks, protected by sw->event_lock */
+	struct list_head node;
+	u64 bank_mask;
+	DECLARE_KFIFO(events, struct stopwatch_event, STOPWATCH_FILE_EVENTS);
+	struct eventfd_ctx *eventfd;
+};
+
+/* driver-wide resources, the devices themselves are in stopwatch_idr */
+static DEFINE_IDR(stopwatch_idr);
+static DEFINE_MUTEX(stopwatch_idr_lock); /* and the references taken from it */
+static dev_t stopwatch_devt;
+static struct class *stopwatch_class;
+static struct dentry *stopwatch_debugfs_dir;
+
+/* Snapshot the device time page of a bank, without trapping */
+static void read_time(struct stopwatch_bank *bank, struct StopWatch_time *t)
+{
+	struct StopWatch_time __iomem *page =
+		&bank->sw->mem_base_addr->time[bank->index];
+	uint32_t seq;
+
+	/* readl/readq are ordered, no extra barrier needed */
+	do {
+		seq = readl(&page->seq);
+
+		t->status = readl(&page->status);
+		t->started_at_ns = readq(&page->started_at_ns);
+		t->total_ns = readq(&page->total_ns);
+		t->now_ns = readq(&page->now_ns);
+	} while ((seq & 1) || seq != readl(&page->seq));
+}
+
+/*
+ * The device published its clock in the time page of @bank while we
+ * were trapped, between @before and @after.
+ */
+static void stopwatch_calibrate(struct stopwatch_bank *bank,
+								u64 before, u64 after)
+{
+	struct StopWatch_time t;
+
+	s64 offset;
+
+	read_time(bank, &t);
+	offset = t.now_ns - (before + (after - before) / 2);
+
+	/* a single aligned word: the readers never see a torn value */
+	WRITE_ONCE(bank->sw->clock_offset_ns, offset);
+
+	/* for the userspace mappings */
+	writeq(offset, &bank->sw->mem_base_addr->clock_offset_ns);
+}
+
+/* Lockless, the readers never take cmd_lock */
+static inline s64 stopwatch_clock_offset(struct stopwatch_data *sw)
+{
+	return READ_ONCE(sw->clock_offset_ns);
+}
+
+/*
+ * The register commands need no lock, the device serializes the
+ * commands of a bank: only their arguments in the shared memory take
+ * sw->cmd_lock. The time page of @bank is used to recalibrate the clock
+ * offset.
+ */
+static void __trigger_cmd(struct stopwatch_bank *bank, uint64_t __iomem *reg,
+						  uint64_t cmd)
+{
+	u64 before, after;
+
+	before = ktime_get_raw_ns();
+    writel(cmd, reg);
+	after = ktime_get_raw_ns();
+
+	stopwatch_calibrate(bank, before, after);
+
+	this_cpu_inc(bank->sw->counters->commands);
+	trace_stopwatch_cmd(bank->sw->name, bank->index, cmd, after - before);
+}
+
+static inline void trigger_cmd(struct stopwatch_bank *bank, uint64_t cmd)
+{
+	struct stopwatch_data *sw = bank->sw;
+
+	__trigger_cmd(bank, &sw->regs_base_addr->bank[bank->index].command, cmd);
+}
+
+/* Device-wide command, applied to every bank with a single trap */
+static inline void trigger_global_cmd(struct stopwatch_data *sw, uint64_t cmd)
+{
+	mutex_lock(&sw->cmd_lock);
+	__trigger_cmd(&sw->banks[0], &sw->regs_base_addr->command, cmd);
+	mutex_unlock(&sw->cmd_lock);
+}
+
+static void trigger_timeout(struct stopwatch_bank *bank, u64 timeout_ns)
+{
+	struct stopwatch_data *sw = bank->sw;
+
+	mutex_lock(&sw->cmd_lock);
+	writeq(timeout_ns, &sw->mem_base_addr->timeout_ns);
+	__trigger_cmd(bank, &sw->regs_base_addr->bank[bank->index].command,
+				  STOPWATCH_ACTION_TIMEOUT);
+	mutex_unlock(&sw->cmd_lock);
+}
+
+/*
+ * Timeouts and timers complete on the IRQ line of the submitting CPU,
+ * line i has an affinity hint to CPU i (see stopwatch_request_irqs).
+ */
+static void stopwatch_route(struct stopwatch_data *sw, struct StopWatch_cmd *cmd)
+{
+	if (cmd->action != STOPWATCH_ACTION_TIMEOUT &&
+		cmd->action != STOPWATCH_ACTION_PERIODIC &&
+		cmd->action != STOPWATCH_ACTION_TIMER_ARM)
+		return;
+	if (cmd->index == STOPWATCH_RING_ALL_BANKS)
+		return;
+
+	cmd->flags &= ~STOPWATCH_CMD_LINE_MASK;
+	cmd->flags |= STOPWATCH_CMD_LINE(raw_smp_processor_id() % sw->nb_irqs);
+}
+
+/*
+ * After a timeout, the device may still complete the commands left in
+ * the ring: consume their completions, so that they are not taken for
+ * the ones of the next commands. With cmd_lock held.
+ */
+static int stopwatch_ring_resync(struct stopwatch_data *sw, uint32_t sq_tail,
+								 uint32_t *cq_head)
+{
+	struct StopWatch_ring __iomem *ring = &sw->mem_base_addr->ring;
+	u64 deadline = ktime_get_raw_ns() + NSEC_PER_SEC;
+	uint32_t cq_tail;
+
+	while (*cq_head != sq_tail) {
+		cq_tail = readl(&ring->cq_tail);
+		if (cq_tail != *cq_head) {
+			*cq_head = cq_tail;
+			writel(cq_tail, &ring->cq_head);
+			/* the device stops on a full completion queue */
+			writel(1, &sw->regs_base_addr->doorbell);
+			continue;
+		}
+		if (ktime_get_raw_ns() > deadline) {
+			pr_err(DRIVERNAME ": %s: command ring stuck\n", sw->name);
+			return -ETIMEDOUT;
+		}
+		cpu_relax();
+	}
+
+	return 0;
+}
+
+/*
+ * Submit @n commands through the command ring, with a single doorbell
+ * write per STOPWATCH_RING_SIZE commands, and copy their completions into
+ * @cpls. Returns 0, or -ETIMEDOUT if the device did not complete them.
+ */
+static int stopwatch_submit(struct stopwatch_data *sw,
+							const struct StopWatch_cmd *cmds,
+							struct StopWatch_cpl *cpls, unsigned int n)
+{
+	struct StopWatch_ring __iomem *ring = &sw->mem_base_addr->ring;
+	unsigned int done = 0, batch, errors = 0, i;
+	uint32_t sq_tail, cq_head;
+	u64 before = 0, after = 0, deadline;
+	int ret = 0;
+
+	if (!n)
+		return 0;
+
+	mutex_lock(&sw->cmd_lock);
+	if (sw->dead) {
+		mutex_unlock(&sw->cmd_lock);
+		return -ENODEV;
+	}
+
+	sq_tail = readl(&ring->sq_tail);
+	cq_head = readl(&ring->cq_head);
+
+	/* completions still due from a submission that timed out */
+	if (cq_head != sq_tail) {
+		ret = stopwatch_ring_resync(sw, sq_tail, &cq_head);
+		if (ret)
+			goto out;
+	}
+
+	while (done < n) {
+		batch = min_t(unsigned int, n - done, STOPWATCH_RING_SIZE);
+
+		for (i = 0; i < batch; i++) {
+			struct StopWatch_cmd cmd = cmds[done + i];
+
+			stopwatch_route(sw, &cmd);
+			memcpy_toio(&ring->sq[(sq_tail + i) % STOPWATCH_RING_SIZE],
+						&cmd, sizeof(cmd));
+		}
+		sq_tail += batch;
+
+		/* writel orders the commands before the new tail */
+		writel(sq_tail, &ring->sq_tail);
+
+		before = ktime_get_raw_ns();
+		writel(1, &sw->regs_base_addr->doorbell);
+
+		/*
+		 * With the ioeventfd doorbell, the device processes the ring
+		 * after the write has returned: poll for the completions.
+		 */
+		deadline = before + NSEC_PER_SEC;
+		while (readl(&ring->cq_tail) - cq_head < batch) {
+			if (ktime_get_raw_ns() > deadline) {
+				/* the late completions are dropped by the next submit */
+				pr_err(DRIVERNAME ": %s: command ring timeout\n", sw->name);
+				ret = -ETIMEDOUT;
+				goto out;
+			}
+			cpu_relax();
+		}
+		after = ktime_get_raw_ns();
+
+		for (i = 0; i < batch; i++) {
+			memcpy_fromio(&cpls[done + i],
+						  &ring->cq[(cq_head + i) % STOPWATCH_RING_SIZE],
+						  sizeof(*cpls));
+			if (cpls[done + i].result)
+				errors++;
+		}
+		cq_head += batch;
+		writel(cq_head, &ring->cq_head);
+
+		done += batch;
+	}
+
+	stopwatch_calibrate(&sw->banks[0], before, after);
+  out:
+	mutex_unlock(&sw->cmd_lock);
+
+	this_cpu_add(sw->counters->commands, n);
+	/* on timeout, the commands not completed count as failed */
+	this_cpu_add(sw->counters->errors, errors + (ret ? n - done : 0));
+	trace_stopwatch_submit(sw->name, n, errors, ret);
+
+	return ret;
+}
+
+/* errno of a command completion */
+static int stopwatch_errno(int64_t result)
+{
+	switch (-result) {
+	case STOPWATCH_OK:        return 0;
+	case STOPWATCH_ERR_STATE: return -EPERM;
+	case STOPWATCH_ERR_RANGE: return -ERANGE;
+	case STOPWATCH_ERR_BUSY:  return -EBUSY;
+	default:                  return -EINVAL;
+	}
+}
 
-static inline void trigger_cmd(uint64_t cmd)
+static inline uint64_t get_status(struct stopwatch_bank *bank)
 {
-    writel(cmd, &pdata->regs_base_addr->command);
+    return readl(&bank->sw->regs_base_addr->bank[bank->index].status);
 }
 
-static inline uint64_t get_status(void)
+/* stopwatch value at @now (device clock), from the time page copy @t */
+static u64 time_value_ns(const struct StopWatch_time *t, u64 now)
 {
-    return readl(&pdata->regs_base_addr->status);
+	u64 value = t->total_ns;
+
+	if (t->status == STOPWATCH_STATE_RUNNING && now > t->started_at_ns)
+		value += now - t->started_at_ns;
+
+	return value;
+}
+
+/* Current stopwatch value, computed locally from the time page */
+static u64 get_value_ns(struct stopwatch_bank *bank, uint32_t *status)
+{
+	struct StopWatch_time t;
+	u64 value;
+
+	read_time(bank, &t);
+
+	value = time_value_ns(&t, ktime_get_raw_ns() +
+						  stopwatch_clock_offset(bank->sw));
+
+	if (status)
+		*status = t.status;
+
+	this_cpu_inc(bank->sw->counters->reads);
+	trace_stopwatch_read(bank->sw->name, bank->index, value);
+
+	return value;
 }
 
-static inline void update_value(void)
+/*
+ * Lap statistics of @bank, read from the shared memory under the
+ * sequence counter of the device. The quantiles are the upper bound of
+ * their histogram bucket, clamped to [min, max].
+ */
+static void read_lap_stats(struct stopwatch_bank *bank,
+						   struct stopwatch_ioc_stats *st)
 {
-	trigger_cmd(STOPWATCH_ACTION_UPDATE);
+	struct StopWatch_laps __iomem *laps =
+		&bank->sw->mem_base_addr->laps[bank->index];
+	static const unsigned int permille[] = { 500, 990, 999 };
+	u64 *quantile[] = { &st->p50_ns, &st->p99_ns, &st->p999_ns };
+	u64 rank[ARRAY_SIZE(permille)], seen;
+	unsigned int b, i;
+	uint32_t seq;
+
+	do {
+		seq = readl(&laps->seq);
+
+		st->count = readq(&laps->count);
+		st->min_ns = readq(&laps->min_ns);
+		st->max_ns = readq(&laps->max_ns);
+		st->sum_ns = readq(&laps->sum_ns);
+
+		for (i = 0; i < ARRAY_SIZE(permille); i++) {
+			rank[i] = DIV_ROUND_UP_ULL(st->count * permille[i], 1000);
+			*quantile[i] = 0;
+		}
+
+		seen = 0;
+		i = 0;
+		for (b = 0; st->count && b < STOPWATCH_HIST_BUCKETS; b++) {
+			seen += readq(&laps->hist[b]);
+
+			for (; i < ARRAY_SIZE(permille) && seen >= rank[i]; i++)
+				*quantile[i] = clamp_t(u64, stopwatch_hist_bucket_end(b) - 1,
+									   st->min_ns, st->max_ns);
+			if (i == ARRAY_SIZE(permille))
+				break;
+		}
+	} while ((seq & 1) || seq != readl(&laps->seq));
+
+	st->mean_ns = st->count ? div64_u64(st->sum_ns, st->count) : 0;
+}
 
-	pdata->data_len = readl(&pdata->mem_base_addr->data_len);
-	BUG_ON(pdata->data_len > STOPWATCH_MEM_DATA_LENGTH);
+/* Text value of @bank into @file, private to the open file */
+static inline void update_value(struct stopwatch_bank_file *file)
+{
+	u64 value = get_value_ns(file->bank, NULL);
 
-	memcpy_fromio(pdata->data, &pdata->mem_base_addr->data, pdata->data_len);
+	file->len = snprintf(file->data, STOPWATCH_MEM_DATA_LENGTH,
+						 "%llu.%09llu seconds",
+						 value / NSEC_PER_SEC, value % NSEC_PER_SEC) + 1;
+}
 
-	BUG_ON(pdata->data[pdata->data_len-1] != '\0');
+/*
+ * Trace marks, recorded in the shared memory of the first stopwatch
+ * device. No trap and no lock: one ring per CPU, and the IRQ-safe
+ * per-CPU counter reserves the slots when marks nest.
+ */
+static struct stopwatch_data *stopwatch_marker;
+static DEFINE_PER_CPU(u64, stopwatch_mark_idx);
 
-	pr_err(DRIVERNAME ": --> %s\n", pdata->data);
+void stopwatch_mark(u32 id, u64 arg)
+{
+	struct StopWatch_mark_ring __iomem *ring;
+	struct StopWatch_mark __iomem *mark;
+	struct stopwatch_data *sw;
+	unsigned int cpu;
+	u64 idx;
+
+	/* the marker is released after a grace period, see stopwatch_remove */
+	preempt_disable_notrace();
+
+	sw = READ_ONCE(stopwatch_marker);
+	cpu = smp_processor_id();
+	if (unlikely(!sw || cpu >= STOPWATCH_MARK_CPUS))
+		goto out;
+
+	ring = &sw->marks[cpu];
+	idx = this_cpu_inc_return(stopwatch_mark_idx) - 1;
+	mark = &ring->marks[idx % STOPWATCH_MARK_RING_SIZE];
+
+	/*
+	 * Same memory type as the rest of the 'mem' region: the device
+	 * accesses are not reordered, writel() only orders them after the
+	 * normal memory accesses.
+	 */
+	writel_relaxed(0, &mark->seq); /* invalid while rewritten */
+
+	writel_relaxed(id, &mark->id);
+	writeq_relaxed(arg, &mark->arg);
+	writeq_relaxed(ktime_get_raw_ns() + stopwatch_clock_offset(sw),
+				   &mark->timestamp_ns);
+
+	writel_relaxed((u32) idx + 1, &mark->seq);
+	writeq_relaxed(idx + 1, &ring->tail);
+  out:
+	preempt_enable_notrace();
 }
+EXPORT_SYMBOL_GPL(stopwatch_mark);
 
 /****************************************************/
 /* Interactions between the userland and the device */
 /****************************************************/
 
+/*
+ * The module parameters are the legacy interface, they control the
+ * first bank of the first stopwatch device.
+ */
+static struct stopwatch_bank *stopwatch_default_bank(void)
+{
+	struct stopwatch_data *sw = idr_find(&stopwatch_idr, 0);
+
+	return sw ? &sw->banks[0] : NULL;
+}
+
 static uint64_t stopwatch_status = 0;
 
 static
 int stopwatch_status_set_ullong(const char *val, const struct kernel_param *kp)
 {
+	struct stopwatch_bank *bank = stopwatch_default_bank();
     int ret = param_set_ullong(val, kp); // Use helper for write variable
 
     if (ret) {
 		return ret;
 	}
 
+	if (!bank) {
+		return -ENODEV;
+	}
 
-	if (stopwatch_status >= STOPWATCH_ACTION_LAST) {
-		pr_err(DRIVERNAME ": INVALID STATE 0x%llx (must be < %d)\n",
-			   stopwatch_status, STOPWATCH_ACTION_LAST);
+	if (stopwatch_status > STOPWATCH_ACTION_TIMEOUT_ACK) {
+		pr_err(DRIVERNAME ": INVALID STATE 0x%llx (must be <= %d)\n",
+			   stopwatch_status, STOPWATCH_ACTION_TIMEOUT_ACK);
 
 		return -EINVAL;
 	}
 
-	trigger_cmd(stopwatch_status);
+	trigger_cmd(bank, stopwatch_status);
 
 	return 0;
 }
 
 static
 int stopwatch_status_get_ullong(char *buffer, const struct kernel_param *kp) {
-	pr_err(DRIVERNAME ": status is 0x%llx\n", stopwatch_status);
-
 	return param_get_ullong(buffer, kp);
 }
 
@@ -115,19 +624,22 @@ module_param_cb(stopwatch_status, /* filename */
 );
 
 /* --- */
-static uint64_t stopwatch_timeout_irq_cnt = 0;
-
 static uint64_t stopwatch_timeout_param = 0;
 
 static
 int stopwatch_timeout_set_ullong(const char *val, const struct kernel_param *kp)
 {
+	struct stopwatch_bank *bank = stopwatch_default_bank();
     int ret = param_set_ullong(val, kp); // Use helper for write variable
 
     if (ret) {
 		return ret;
 	}
 
+	if (!bank) {
+		return -ENODEV;
+	}
+
 	if (stopwatch_timeout_param == 0 ||
 		stopwatch_timeout_param >= STOPWATCH_TIMEOUT_MAX) {
 		pr_err(DRIVERNAME ": INVALID TIMEOUT 0x%llx (must be < %d)\n",
@@ -136,8 +648,7 @@ int stopwatch_timeout_set_ullong(const char *val, const struct kernel_param *kp)
 		return -EINVAL;
 	}
 
-	writel(stopwatch_timeout_param, &pdata->mem_base_addr->data_len);
-	trigger_cmd(STOPWATCH_ACTION_TIMEOUT);
+	trigger_timeout(bank, stopwatch_timeout_param * NSEC_PER_SEC);
 
 	/* could wait here for the interrupt, or not ... */
 	return 0;
@@ -145,9 +656,10 @@ int stopwatch_timeout_set_ullong(const char *val, const struct kernel_param *kp)
 
 static
 int stopwatch_timeout_get_ullong(char *buffer, const struct kernel_param *kp) {
-	stopwatch_timeout_param = stopwatch_timeout_irq_cnt;
+	struct stopwatch_bank *bank = stopwatch_default_bank();
+
+	stopwatch_timeout_param = bank ? bank->timeout_irq_cnt : 0;
 
-	pr_err(DRIVERNAME ": timeout irq count is 0x%llx\n", stopwatch_timeout_param);
 	return param_get_ullong(buffer, kp);
 }
 
@@ -162,25 +674,351 @@ module_param_cb(stopwatch_timeout, /* filename */
     S_IRUGO | S_IWUSR /* permissions on file */
 );
 
+/* Queue @ev to the files subscribed to its bank, and wake them up */
+static void stopwatch_post_event(struct stopwatch_data *sw,
+								 const struct stopwatch_event *ev)
+{
+	struct stopwatch_file *file;
+	unsigned long flags;
+	u64 bit = ev->type == STOPWATCH_EVENT_TIMER ?
+		STOPWATCH_SUBSCRIBE_TIMERS : BIT_ULL(ev->index);
+
+	spin_lock_irqsave(&sw->event_lock, flags);
+	list_for_each_entry(file, &sw->event_files, node) {
+		if (!(file->bank_mask & bit))
+			continue;
+
+		/* when the reader lags behind, gaps show in ev->count */
+		kfifo_put(&file->events, *ev);
+
+		if (file->eventfd)
+			eventfd_signal(file->eventfd, 1);
+	}
+	spin_unlock_irqrestore(&sw->event_lock, flags);
+
+	trace_stopwatch_event(sw->name, ev->type, ev->index, ev->count);
+
+	wake_up_interruptible(&sw->event_wq);
+}
+
+/* Deliver the entries of the expiry ring of @line, then acknowledge */
+static void stopwatch_timers_irq(struct stopwatch_line *line)
+{
+	struct stopwatch_data *sw = line->sw;
+	struct StopWatch_expiry_ring __iomem *ring =
+		&sw->mem_base_addr->expiry[line->index];
+	struct stopwatch_event ev = { .type = STOPWATCH_EVENT_TIMER };
+	u32 head = readl(&ring->head);
+	u32 tail = readl(&ring->tail);
+	bool full = tail - head >= STOPWATCH_EXPIRY_RING_SIZE;
+
+	for (; head != tail; head++) {
+		struct StopWatch_expiry __iomem *e =
+			&ring->entries[head % STOPWATCH_EXPIRY_RING_SIZE];
+
+		ev.index = readl(&e->id);
+		ev.count = atomic64_inc_return(&sw->timers_expired_cnt);
+		ev.timestamp_ns = readq(&e->expired_ns);
+		stopwatch_post_event(sw, &ev);
+	}
+	writel(head, &ring->head);
+
+	/*
+	 * The device raises the IRQ again if more timers expired meanwhile.
+	 * With MSI-X, each batch posted signals the vector: only a full ring
+	 * holds timers back until the acknowledgment.
+	 */
+	if (!sw->msix || full)
+		writel(1, &sw->regs_base_addr->line[line->index].ack);
+}
+
+/* periodic timeouts count the periods, the coalesced ones show as gaps */
+static u64 stopwatch_timeout_count(struct stopwatch_bank *bank)
+{
+	struct StopWatch_periodic __iomem *p =
+		&bank->sw->mem_base_addr->periodic[bank->index];
+
+	bank->timeout_irq_cnt++;
+
+	return readq(&p->period_ns) ? readq(&p->ticks) : bank->timeout_irq_cnt;
+}
+
+/*
+ * Guest clocksource and clock event device on the device clock (clock=1),
+ * so that the timekeeping and the hrtimers run on the host clock. Rated
+ * clock_rating: below the arch timer by default, the clocksource is then
+ * selected in /sys/devices/system/clocksource/clocksource0, and the
+ * clock event device takes over the tick of its CPU once the arch timer
+ * is unbound in /sys/devices/system/clockevents.
+ */
+static bool stopwatch_clock_enable = false;
+module_param_named(clock, stopwatch_clock_enable, bool, S_IRUGO);
+MODULE_PARM_DESC(clock, "register the devices as clocksource and clockevent "
+                 "(the module cannot be unloaded then)");
+
+static int stopwatch_clock_rating = 100;
+module_param_named(clock_rating, stopwatch_clock_rating, int, S_IRUGO);
+MODULE_PARM_DESC(clock_rating, "rating of the clocksource and clock event device "
+                 "(arch timer: 400 and 450)");
+
+/* no trap, the resolution is the update period of the device thread */
+static u64 stopwatch_cs_read_page(struct clocksource *cs)
+{
+	struct stopwatch_data *sw = container_of(cs, struct stopwatch_data, cs);
+
+	return readq_relaxed(&sw->clock_page->now_ns);
+}
+
+/* exact, one trap per read */
+static u64 stopwatch_cs_read_reg(struct clocksource *cs)
+{
+	struct stopwatch_data *sw = container_of(cs, struct stopwatch_data, cs);
+
+	return readq(&sw->regs_base_addr->clock);
+}
+
+static int stopwatch_ced_next_event(unsigned long delta,
+									struct clock_event_device *ced)
+{
+	struct stopwatch_data *sw = container_of(ced, struct stopwatch_data, ced);
+
+	writeq(delta, &sw->regs_base_addr->clockevent);
+
+	return 0;
+}
+
+static int stopwatch_ced_shutdown(struct clock_event_device *ced)
+{
+	struct stopwatch_data *sw = container_of(ced, struct stopwatch_data, ced);
+
+	writeq(0, &sw->regs_base_addr->clockevent);
+
+	return 0;
+}
+
+/*
+ * The line is acknowledged before the handler, which programs the next
+ * event (the acknowledgment cancels the pending one, if any).
+ */
+static void stopwatch_clockevent_irq(struct stopwatch_data *sw)
+{
+	if (!sw->msix)
+		writeq(0, &sw->regs_base_addr->clockevent);
+
+	/* no handler until the clock event device is in use */
+	if (sw->clock && sw->ced.event_handler)
+		sw->ced.event_handler(&sw->ced);
+}
+
+static void stopwatch_clock_register(struct stopwatch_data *sw)
+{
+	unsigned int cpu = cpumask_local_spread(0, NUMA_NO_NODE);
+
+	/* through the 'mem' mapping, see the marks in stopwatch_setup */
+	if (readq(&sw->mem_base_addr->clock.resolution_ns))
+		sw->clock_page = &sw->mem_base_addr->clock;
+
+	/*
+	 * Once registered, the clocksource and the clock event device may be
+	 * the only ones left: the module and the device stay, see
+	 * stopwatch_module_init.
+	 */
+	__module_get(THIS_MODULE);
+
+	sw->cs.name = sw->name;
+	sw->cs.rating = stopwatch_clock_rating;
+	sw->cs.read = sw->clock_page ? stopwatch_cs_read_page : stopwatch_cs_read_reg;
+	sw->cs.mask = CLOCKSOURCE_MASK(64);
+	sw->cs.flags = CLOCK_SOURCE_IS_CONTINUOUS;
+
+	sw->ced.name = sw->name;
+	sw->ced.features = CLOCK_EVT_FEAT_ONESHOT;
+	sw->ced.rating = stopwatch_clock_rating;
+	sw->ced.irq = sw->clock_irq;
+	sw->ced.cpumask = cpumask_of(cpu);
+	sw->ced.set_next_event = stopwatch_ced_next_event;
+	sw->ced.set_state_shutdown = stopwatch_ced_shutdown;
+	sw->ced.set_state_oneshot_stopped = stopwatch_ced_shutdown;
+
+	/* the line 0 already has this affinity, see stopwatch_request_irqs */
+	irq_set_affinity_hint(sw->clock_irq, sw->ced.cpumask);
+
+	sw->clock = true;
+
+	clocksource_register_hz(&sw->cs, NSEC_PER_SEC);
+	clockevents_config_and_register(&sw->ced, NSEC_PER_SEC,
+									STOPWATCH_CLOCKEVENT_MIN_NS,
+									STOPWATCH_TIMEOUT_MAX_NS);
+
+	DEBUG_MSG("%s: clocksource (%s) and clock event device on CPU %u",
+			  sw->name, sw->clock_page ? "clock page" : "register", cpu);
+}
+
+static void stopwatch_clock_unregister(struct stopwatch_data *sw)
+{
+	if (!sw->clock)
+		return;
+
+	/*
+	 * Replaced by the next best ones, if they are in use. Only a
+	 * surprise removal gets here (hot-unplug), nothing can keep the
+	 * device then.
+	 */
+	WARN(clocksource_unregister(&sw->cs),
+		 DRIVERNAME ": %s: clocksource still in use\n", sw->name);
+	WARN(clockevents_unbind_device(&sw->ced, cpumask_first(sw->ced.cpumask)),
+		 DRIVERNAME ": %s: clock event device still in use\n", sw->name);
+
+	sw->clock = false;
+	module_put(THIS_MODULE);
+}
+
 static irqreturn_t timeout_irq_handler(int irq, void *dev_id)
 {
-  DEBUG_MSG("Timeout irq ticking!");
+  struct stopwatch_line *line = dev_id;
+  struct stopwatch_data *sw = line->sw;
+  unsigned long pending = readq(&sw->regs_base_addr->line[line->index].status);
+  struct stopwatch_event ev = { .type = STOPWATCH_EVENT_TIMEOUT };
+  int i;
 
-  stopwatch_timeout_irq_cnt++;
+  if (!pending)
+    return IRQ_NONE;
 
-  trigger_cmd(STOPWATCH_ACTION_TIMEOUT_ACK);
+  this_cpu_inc(sw->counters->irqs);
+  trace_stopwatch_irq(sw->name, line->index, pending);
+
+  ev.timestamp_ns = ktime_get_raw_ns() + stopwatch_clock_offset(sw);
+
+  for_each_set_bit(i, &pending, sw->nb_banks) {
+    ev.index = i;
+    ev.count = stopwatch_timeout_count(&sw->banks[i]);
+    stopwatch_post_event(sw, &ev);
+
+    /* no argument, no need to serialize with cmd_lock */
+    writel(STOPWATCH_ACTION_TIMEOUT_ACK, &sw->regs_base_addr->bank[i].command);
+  }
+
+  if (pending & STOPWATCH_IRQ_CLOCKEVENT)
+    stopwatch_clockevent_irq(sw);
+
+  if (pending & STOPWATCH_IRQ_TIMERS)
+    stopwatch_timers_irq(line);
 
   return IRQ_HANDLED;
 }
 
+/*
+ * MSI-X vector of a bank: a one-shot timeout is already acknowledged, a
+ * period is acknowledged once posted, the next ones coalesce until then.
+ */
+static irqreturn_t stopwatch_bank_msix_handler(int irq, void *dev_id)
+{
+	struct stopwatch_bank *bank = dev_id;
+	struct stopwatch_data *sw = bank->sw;
+	struct stopwatch_event ev = {
+		.type = STOPWATCH_EVENT_TIMEOUT,
+		.index = bank->index,
+	};
+
+	this_cpu_inc(sw->counters->irqs);
+	/* no line status with MSI-X, the bank is in 'pending' */
+	trace_stopwatch_irq(sw->name, 0, BIT_ULL(bank->index));
+
+	ev.timestamp_ns = ktime_get_raw_ns() + stopwatch_clock_offset(sw);
+	ev.count = stopwatch_timeout_count(bank);
+	stopwatch_post_event(sw, &ev);
+
+	if (readq(&sw->mem_base_addr->periodic[bank->index].period_ns))
+		writel(STOPWATCH_ACTION_TIMEOUT_ACK,
+			   &sw->regs_base_addr->bank[bank->index].command);
+
+	return IRQ_HANDLED;
+}
+
+/* MSI-X vector of the timers of a line, no status register read */
+static irqreturn_t stopwatch_timers_msix_handler(int irq, void *dev_id)
+{
+	struct stopwatch_line *line = dev_id;
+	struct stopwatch_data *sw = line->sw;
+
+	this_cpu_inc(sw->counters->irqs);
+	trace_stopwatch_irq(sw->name, line->index, STOPWATCH_IRQ_TIMERS);
+
+	stopwatch_timers_irq(line);
+
+	return IRQ_HANDLED;
+}
+
+/* MSI-X vector of the clock event, no acknowledgment */
+static irqreturn_t stopwatch_clockevent_msix_handler(int irq, void *dev_id)
+{
+	struct stopwatch_data *sw = dev_id;
+
+	this_cpu_inc(sw->counters->irqs);
+	trace_stopwatch_irq(sw->name, 0, STOPWATCH_IRQ_CLOCKEVENT);
+
+	stopwatch_clockevent_irq(sw);
+
+	return IRQ_HANDLED;
+}
+
 /* --- */
 
+/* last reference: the device is removed and its files closed */
+static void stopwatch_free(struct kref *ref)
+{
+	struct stopwatch_data *sw = container_of(ref, struct stopwatch_data, ref);
+
+	if (!IS_ERR_OR_NULL(sw->regs_base_addr))
+		iounmap(sw->regs_base_addr);
+	if (!IS_ERR_OR_NULL(sw->mem_base_addr))
+		iounmap(sw->mem_base_addr);
+	free_percpu(sw->counters);
+	kfree(sw);
+}
+
+/* reference of the probe, dropped by devm once the IRQs are freed */
+static void stopwatch_put(void *data)
+{
+	struct stopwatch_data *sw = data;
+
+	kref_put(&sw->ref, stopwatch_free);
+}
+
 static int
 stopwatch_open(struct inode *inode, struct file *filp)
 {
-	/* /sys/kernel/debug/stopwatch/stopwatch opened */
+	/* /sys/kernel/debug/stopwatch/stopwatch<N>/bank<B> opened */
+	struct stopwatch_bank *bank = inode->i_private;
+	struct stopwatch_bank_file *file;
+	struct stopwatch_data *sw;
+
+	if (bank) {
+		/* debugfs_remove waits for the open in progress */
+		sw = bank->sw;
+		kref_get(&sw->ref);
+	} else { /* /dev/stopwatch<N>.<B> opened, the cdev is not in the data */
+		mutex_lock(&stopwatch_idr_lock);
+		sw = idr_find(&stopwatch_idr, iminor(inode) / STOPWATCH_BANKS_MAX);
+		if (sw)
+			kref_get(&sw->ref);
+		mutex_unlock(&stopwatch_idr_lock);
+		if (!sw)
+			return -ENODEV;
+		bank = &sw->banks[iminor(inode) % STOPWATCH_BANKS_MAX];
+	}
 
-	update_value();
+	file = kzalloc(sizeof(*file), GFP_KERNEL);
+	if (!file) {
+		kref_put(&sw->ref, stopwatch_free);
+		return -ENOMEM;
+	}
+
+	/* no lock: the time page is read under its sequence counter */
+	file->bank = bank;
+	update_value(file);
+
+	filp->private_data = file;
 
  	return 0;
 }
@@ -188,7 +1026,12 @@ stopwatch_open(struct inode *inode, struct file *filp)
 static
 int stopwatch_release(struct inode *inode, struct file *filp)
 {
-	/* /sys/kernel/debug/stopwatch/stopwatch closed */
+	/* bank file closed */
+	struct stopwatch_bank_file *file = filp->private_data;
+	struct stopwatch_data *sw = file->bank->sw;
+
+	kfree(file);
+	kref_put(&sw->ref, stopwatch_free);
 
 	return 0;
 }
@@ -197,29 +1040,100 @@ static
 ssize_t stopwatch_read(struct file *filp, char __user *buf,
 					   size_t count, loff_t *offset)
 {
-	/* /sys/kernel/debug/stopwatch/stopwatch read */
-	unsigned long len = pdata->data_len;
+	/* bank file read, from the snapshot of the open file */
+	struct stopwatch_bank_file *file = filp->private_data;
 
-	if (*offset) {
-		return 0;
-	}
+	return simple_read_from_buffer(buf, count, offset, file->data, file->len);
+}
+
+#define STOPWATCH_WRITE_CMDS_MAX 32
 
-	if (len > count)
-		len = count;
+/*
+ * Bank file write: a sequence of "reset", "start", "pause", "update",
+ * "lap" or "timeout <seconds>" commands, submitted with a single doorbell.
+ */
+static
+ssize_t stopwatch_write(struct file *filp, const char __user *buf,
+						size_t count, loff_t *offset)
+{
+	struct stopwatch_bank_file *file = filp->private_data;
+	struct stopwatch_bank *bank = file->bank;
+	struct StopWatch_cmd *cmds;
+	struct StopWatch_cpl *cpls;
+	char *str, *cur, *word;
+	unsigned int timeout, n = 0, i;
+	int ret = 0;
+
+	if (count > PAGE_SIZE)
+		return -EINVAL;
 
-	if (copy_to_user(buf, pdata->data, len)) {
-		pr_err(DRIVERNAME ": ERROR with copy_to_user\n");
+	str = memdup_user_nul(buf, count);
+	if (IS_ERR(str))
+		return PTR_ERR(str);
 
-		return -EFAULT;
+	cmds = kcalloc(STOPWATCH_WRITE_CMDS_MAX, sizeof(*cmds), GFP_KERNEL);
+	cpls = kcalloc(STOPWATCH_WRITE_CMDS_MAX, sizeof(*cpls), GFP_KERNEL);
+	if (!cmds || !cpls) {
+		ret = -ENOMEM;
+		goto out;
 	}
 
-	/* Most read functions return the number of bytes put into the buffer */
-	return len;
+	cur = str;
+	while ((word = strsep(&cur, " \t\n;")) != NULL) {
+		if (!*word)
+			continue;
+
+		if (n == STOPWATCH_WRITE_CMDS_MAX) {
+			ret = -E2BIG;
+			goto out;
+		}
+
+		cmds[n].index = bank->index;
+		cmds[n].tag = n;
+
+		if (!strcmp(word, "reset")) {
+			cmds[n].action = STOPWATCH_ACTION_RESET;
+		} else if (!strcmp(word, "start")) {
+			cmds[n].action = STOPWATCH_ACTION_START;
+		} else if (!strcmp(word, "pause")) {
+			cmds[n].action = STOPWATCH_ACTION_PAUSE;
+		} else if (!strcmp(word, "update")) {
+			cmds[n].action = STOPWATCH_ACTION_UPDATE;
+		} else if (!strcmp(word, "lap")) {
+			cmds[n].action = STOPWATCH_ACTION_LAP;
+		} else if (!strcmp(word, "timeout")) {
+			word = strsep(&cur, " \t\n;");
+			if (!word || kstrtouint(word, 10, &timeout) ||
+				timeout == 0 || timeout >= STOPWATCH_TIMEOUT_MAX) {
+				ret = -EINVAL;
+				goto out;
+			}
+			cmds[n].action = STOPWATCH_ACTION_TIMEOUT;
+			cmds[n].arg = timeout * NSEC_PER_SEC;
+		} else {
+			ret = -EINVAL;
+			goto out;
+		}
+		n++;
+	}
+
+	ret = stopwatch_submit(bank->sw, cmds, cpls, n);
+
+	for (i = 0; !ret && i < n; i++)
+		ret = stopwatch_errno(cpls[i].result);
+
+  out:
+	kfree(cpls);
+	kfree(cmds);
+	kfree(str);
+
+	return ret ? ret : count;
 }
 
 static loff_t stopwatch_llseek(struct file *filp, loff_t off, int whence) {
+	struct stopwatch_bank_file *file = filp->private_data;
 
-	return pdata->data_len;
+	return fixed_size_llseek(filp, off, whence, file->len);
 }
 
 
@@ -228,131 +1142,1132 @@ static const struct file_operations stopwatch_fops =
 	.owner = THIS_MODULE,
 	.open = stopwatch_open,
 	.read = stopwatch_read,
+	.write = stopwatch_write,
 	.release = stopwatch_release,
 	.llseek =  stopwatch_llseek,
 };
 
-static struct dentry *stopwatch_debugfs_dir;
-
-
-static int stopwatch_init(void)
+static const char *stopwatch_state_name(uint32_t status)
 {
-    stopwatch_debugfs_dir = debugfs_create_dir("stopwatch", 0);
+	switch (status) {
+	case STOPWATCH_STATE_RUNNING: return "running";
+	case STOPWATCH_STATE_RESET:   return "reset";
+	case STOPWATCH_STATE_PAUSED:  return "paused";
+	default:                      return "invalid";
+	}
+}
 
-    debugfs_create_file("stopwatch", 0, stopwatch_debugfs_dir, NULL,
-						&stopwatch_fops);
+/* debugfs stopwatch<N>/stats: lap statistics of the banks with laps */
+static int stopwatch_stats_show(struct seq_file *m, void *unused)
+{
+	struct stopwatch_data *sw = m->private;
+	struct stopwatch_ioc_stats st;
+	int i;
+
+	for (i = 0; i < sw->nb_banks; i++) {
+		read_lap_stats(&sw->banks[i], &st);
+		if (!st.count)
+			continue;
+
+		seq_printf(m, "bank%d: laps %llu min %llu mean %llu max %llu "
+				   "p50 %llu p99 %llu p999 %llu (ns)\n", i, st.count,
+				   st.min_ns, st.mean_ns, st.max_ns,
+				   st.p50_ns, st.p99_ns, st.p999_ns);
+	}
 
-    return 0;
+	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(stopwatch_stats);
 
-static void stopwatch_exit(void)
+/* debugfs stopwatch<N>/counters: sum of the per-CPU counters */
+static int stopwatch_counters_show(struct seq_file *m, void *unused)
 {
-    debugfs_remove_recursive(stopwatch_debugfs_dir);
+	struct stopwatch_data *sw = m->private;
+	struct stopwatch_counters sum = {};
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct stopwatch_counters *c = per_cpu_ptr(sw->counters, cpu);
 
-	trigger_cmd(STOPWATCH_ACTION_RESET);
+		sum.commands += READ_ONCE(c->commands);
+		sum.irqs += READ_ONCE(c->irqs);
+		sum.reads += READ_ONCE(c->reads);
+		sum.errors += READ_ONCE(c->errors);
+	}
+
+	seq_printf(m, "commands %llu\nirqs %llu\nreads %llu\nerrors %llu\n",
+			   sum.commands, sum.irqs, sum.reads, sum.errors);
 
-    DEBUG_MSG("Bye bye Stopwatch module");
+	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(stopwatch_counters);
 
-/****************************************/
-/* Misc device functions and structures */
-/****************************************/
+/*
+ * Snapshot of all the banks of a device, one line per bank. The values
+ * are computed from the time pages, so the sweep does not trap.
+ */
+static int stopwatch_all_open(struct inode *inode, struct file *filp)
+{
+	struct stopwatch_data *sw = inode->i_private;
+	struct stopwatch_file *file;
+	char *snapshot;
+	int i, len = 0;
+
+	if (!sw) /* /dev/stopwatch<N> opened */
+		sw = container_of(filp->private_data, struct stopwatch_data, mdev);
+
+	/* misc_deregister and debugfs_remove wait for the open in progress */
+	if (READ_ONCE(sw->dead))
+		return -ENODEV;
+
+	file = kzalloc(sizeof(*file), GFP_KERNEL);
+	snapshot = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!file || !snapshot) {
+		kfree(snapshot);
+		kfree(file);
+		return -ENOMEM;
+	}
 
-static const struct file_operations stopwatch_misc_ops = {
-    .owner      = THIS_MODULE,
-};
+	for (i = 0; i < sw->nb_banks; i++) {
+		uint32_t status;
+		u64 value = get_value_ns(&sw->banks[i], &status);
 
+		len += scnprintf(snapshot + len, PAGE_SIZE - len,
+						 "bank%d: %llu.%09llu seconds (%s)\n", i,
+						 value / NSEC_PER_SEC, value % NSEC_PER_SEC,
+						 stopwatch_state_name(status));
+	}
 
-static int stopwatch_remove(struct platform_device *pdev)
+	kref_get(&sw->ref);
+	file->sw = sw;
+	file->snapshot = snapshot;
+	INIT_LIST_HEAD(&file->node);
+	INIT_KFIFO(file->events);
+	filp->private_data = file;
+
+	return nonseekable_open(inode, filp);
+}
+
+static ssize_t stopwatch_all_read(struct file *filp, char __user *buf,
+								  size_t count, loff_t *offset)
 {
-    stopwatch_exit();
+	struct stopwatch_file *file = filp->private_data;
 
-    misc_deregister(&pdata->mdev);
-    kfree(pdata);
-    return 0;
+	return simple_read_from_buffer(buf, count, offset, file->snapshot,
+								   strlen(file->snapshot));
 }
 
-static int stopwatch_probe(struct platform_device *pdev)
+static int stopwatch_all_release(struct inode *inode, struct file *filp)
 {
-    struct device *dev = &pdev->dev;
-    struct resource *mem_res, *regs_res;
-	int timeout_irq_no;
-    int ret = 0;
+	struct stopwatch_file *file = filp->private_data;
+	struct stopwatch_data *sw = file->sw;
 
-    DEBUG_MSG(" --- ");
-    DEBUG_MSG("Loading the Stopwatch module ... ");
+	spin_lock_irq(&sw->event_lock);
+	list_del(&file->node);
+	spin_unlock_irq(&sw->event_lock);
 
-    /* Allocate driver private data */
-    pdata = kzalloc(sizeof(struct stopwatch_data), GFP_KERNEL);
+	if (file->eventfd)
+		eventfd_ctx_put(file->eventfd);
 
-    /* Map the IO regions */
+	kfree(file->snapshot);
+	kfree(file);
 
-    /* the memory region */
-    mem_res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
-    pdata->mem_base_physaddr = mem_res->start;
-    pdata->mem_size = mem_res->end - mem_res->start + 1;
+	kref_put(&sw->ref, stopwatch_free);
 
-    pdata->mem_base_addr = devm_ioremap_resource(dev, mem_res);
+	return 0;
+}
 
-    DEBUG_MSG("mapped region 0/mem,  physaddr: 0x%lx, size: 0x%lx",
-              (unsigned long) pdata->mem_base_physaddr,
-              (unsigned long) pdata->mem_size);
+static const struct file_operations stopwatch_all_fops = {
+	.owner = THIS_MODULE,
+	.open = stopwatch_all_open,
+	.read = stopwatch_all_read,
+	.release = stopwatch_all_release,
+	.llseek = no_llseek,
+};
 
-    if (IS_ERR(pdata->mem_base_addr)) {
-        pr_err(DRIVERNAME ": could not map the 'mem' memory region\n");
+static int stopwatch_init(struct stopwatch_data *sw)
+{
+    char name[16];
+    int i;
+
+    /* first clock calibration, the time pages are read locally afterwards */
+    trigger_global_cmd(sw, STOPWATCH_ACTION_UPDATE);
+
+    sw->debugfs_dir = debugfs_create_dir(sw->name, stopwatch_debugfs_dir);
 
-        ret = PTR_ERR(pdata->mem_base_addr);
-        goto fail;
+    debugfs_create_file("all", 0400, sw->debugfs_dir, sw,
+						&stopwatch_all_fops);
+    debugfs_create_file("stats", 0400, sw->debugfs_dir, sw,
+						&stopwatch_stats_fops);
+    debugfs_create_file("counters", 0400, sw->debugfs_dir, sw,
+						&stopwatch_counters_fops);
+
+    for (i = 0; i < sw->nb_banks; i++) {
+        snprintf(name, sizeof(name), "bank%d", i);
+        debugfs_create_file(name, 0400, sw->debugfs_dir, &sw->banks[i],
+							&stopwatch_fops);
     }
 
-    /* the regs memory region */
-    regs_res = platform_get_resource(pdev, IORESOURCE_MEM, 1);
-    pdata->regs_base_physaddr = regs_res->start;
-    pdata->regs_size = regs_res->end - regs_res->start + 1;
-    pdata->regs_base_addr = devm_ioremap_resource(dev, regs_res);
+    return 0;
+}
 
-    DEBUG_MSG("mapped region 1/regs, physaddr: 0x%lx, size: 0x%lx",
-              (unsigned long) pdata->regs_base_physaddr,
-              (unsigned long) pdata->regs_size);
+static void stopwatch_exit(struct stopwatch_data *sw)
+{
+    debugfs_remove_recursive(sw->debugfs_dir);
 
-    if (IS_ERR(pdata->regs_base_addr)) {
-        pr_err(DRIVERNAME ": could not map the 'regs' memory region\n");
+	trigger_global_cmd(sw, STOPWATCH_ACTION_RESET);
 
-        ret = PTR_ERR(pdata->regs_base_addr);
-        goto fail;
-    }
+    DEBUG_MSG("Bye bye Stopwatch %s", sw->name);
+}
 
-	/* register the timeout IRQ */
-	timeout_irq_no = platform_get_irq(pdev, 0);
-	DEBUG_MSG("register irq %d for timeout notifications", timeout_irq_no);
+/*****************************************/
+/* Char device functions and structures */
+/*****************************************/
 
-	ret = devm_request_irq(dev, timeout_irq_no, timeout_irq_handler, 0,
-						   "stopwatch timeout", NULL);
-	if (ret) {
-		pr_err(DRIVERNAME ": could not register the timeout handler "
-			   "on irq %d...\n", timeout_irq_no);
-		goto fail;
+/* Commands address a bank, except the timer engine ones (timer id) */
+static bool stopwatch_op_valid(struct stopwatch_data *sw, uint16_t action,
+							   uint32_t index, uint16_t flags)
+{
+	switch (action) {
+	case STOPWATCH_ACTION_TIMER_ARM:
+		return index < STOPWATCH_TIMERS_MAX && !(flags & ~STOPWATCH_TIMER_ABS);
+	case STOPWATCH_ACTION_TIMER_CANCEL:
+		return index < STOPWATCH_TIMERS_MAX && !flags;
+	default:
+		return index < sw->nb_banks && !flags;
 	}
+}
 
-    /* Register the misc device */
-    pdata->mdev.minor = MISC_DYNAMIC_MINOR;
-    pdata->mdev.name = DRIVERNAME;
-    pdata->mdev.fops = &stopwatch_misc_ops;
-    ret = misc_register(&pdata->mdev);
+/* Single command through the ring, the device reports errors gracefully */
+static int stopwatch_exec(struct stopwatch_data *sw, uint16_t action,
+						  uint32_t bank, uint64_t arg, uint64_t *value_ns)
+{
+	struct StopWatch_cmd cmd = {
+		.action = action,
+		.index = bank,
+		.arg = arg,
+	};
+	struct StopWatch_cpl cpl;
+	int ret;
+
+	if (!stopwatch_op_valid(sw, action, bank, 0))
+		return -EINVAL;
 
-    if (ret) {
-        pr_err(DRIVERNAME ": unable to register misc device\n");
-        goto fail;
-    }
+	ret = stopwatch_submit(sw, &cmd, &cpl, 1);
+	if (ret)
+		return ret;
 
-    stopwatch_init();
+	if (value_ns)
+		*value_ns = cpl.value;
 
-    DEBUG_MSG("Registered stopwatch misc device");
+	return stopwatch_errno(cpl.result);
+}
 
-    return 0;
+/*
+ * Single command through the command register of the bank, see
+ * STOPWATCH_IOC_CMD_REG. The register has no result: the transition is
+ * checked on the time page first.
+ */
+static int stopwatch_exec_reg(struct stopwatch_data *sw, uint16_t action,
+							  uint32_t index)
+{
+	struct stopwatch_bank *bank;
+	struct StopWatch_time t;
+	bool valid;
+
+	if (READ_ONCE(sw->dead))
+		return -ENODEV;
+	if (index >= sw->nb_banks)
+		return -EINVAL;
+	bank = &sw->banks[index];
+
+	read_time(bank, &t);
+
+	switch (action) {
+	case STOPWATCH_ACTION_START:
+		valid = t.status == STOPWATCH_STATE_RESET
+			|| t.status == STOPWATCH_STATE_PAUSED;
+		break;
+	case STOPWATCH_ACTION_PAUSE:
+		valid = t.status != STOPWATCH_STATE_RESET;
+		break;
+	case STOPWATCH_ACTION_LAP:
+		valid = t.status != STOPWATCH_STATE_RESET;
+		break;
+	default: /* STOPWATCH_ACTION_RESET */
+		valid = true;
+		break;
+	}
+
+	if (!valid)
+		return -EPERM;
+
+	trigger_cmd(bank, action);
+
+	return 0;
+}
+
+static long stopwatch_ioctl_snapshot(struct stopwatch_data *sw,
+									 void __user *argp)
+{
+	struct stopwatch_ioc_snapshot snap;
+	struct stopwatch_bank *bank;
+	struct StopWatch_time t;
+
+	if (copy_from_user(&snap, argp, sizeof(snap)))
+		return -EFAULT;
+
+	if (snap.bank >= sw->nb_banks)
+		return -EINVAL;
+
+	bank = &sw->banks[snap.bank];
+
+	/* no trap: one copy of the time page, and the local clock */
+	read_time(bank, &t);
+	snap.now_ns = ktime_get_raw_ns() + stopwatch_clock_offset(sw);
+	snap.status = t.status;
+	snap.value_ns = time_value_ns(&t, snap.now_ns);
+	snap.started_at_ns = t.started_at_ns;
+	snap.total_ns = t.total_ns;
+
+	this_cpu_inc(sw->counters->reads);
+	trace_stopwatch_read(sw->name, bank->index, snap.value_ns);
+
+	if (copy_to_user(argp, &snap, sizeof(snap)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/*
+ * Array of operations, submitted to the device through the command
+ * ring: one syscall and one doorbell trap for the whole batch.
+ */
+static long stopwatch_ioctl_batch(struct stopwatch_data *sw,
+								  void __user *argp)
+{
+	struct stopwatch_ioc_batch batch;
+	struct stopwatch_ioc_op *ops = NULL;
+	struct stopwatch_ioc_result *results = NULL;
+	struct StopWatch_cmd *cmds = NULL;
+	struct StopWatch_cpl *cpls = NULL;
+	unsigned int i;
+	long ret;
+
+	if (copy_from_user(&batch, argp, sizeof(batch)))
+		return -EFAULT;
+
+	if (batch.count == 0)
+		return 0;
+	if (batch.count > STOPWATCH_BATCH_MAX || batch.flags)
+		return -EINVAL;
+
+	ops = memdup_user(u64_to_user_ptr(batch.ops),
+					  batch.count * sizeof(*ops));
+	if (IS_ERR(ops))
+		return PTR_ERR(ops);
+
+	results = kcalloc(batch.count, sizeof(*results), GFP_KERNEL);
+	cmds = kcalloc(batch.count, sizeof(*cmds), GFP_KERNEL);
+	cpls = kcalloc(batch.count, sizeof(*cpls), GFP_KERNEL);
+	if (!results || !cmds || !cpls) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < batch.count; i++) {
+		if (!stopwatch_op_valid(sw, ops[i].action, ops[i].bank,
+								ops[i].flags)) {
+			ret = -EINVAL;
+			goto out;
+		}
+		cmds[i].action = ops[i].action;
+		cmds[i].flags = ops[i].flags;
+		cmds[i].index = ops[i].bank;
+		cmds[i].arg = ops[i].arg;
+		cmds[i].tag = i;
+	}
+
+	ret = stopwatch_submit(sw, cmds, cpls, batch.count);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < batch.count; i++) {
+		results[i].error = stopwatch_errno(cpls[i].result);
+		results[i].value_ns = cpls[i].value;
+	}
+
+	if (copy_to_user(u64_to_user_ptr(batch.results), results,
+					 batch.count * sizeof(*results)))
+		ret = -EFAULT;
+
+  out:
+	kfree(cpls);
+	kfree(cmds);
+	kfree(results);
+	kfree(ops);
+
+	return ret;
+}
+
+static long stopwatch_ioctl_stats(struct stopwatch_data *sw, void __user *argp)
+{
+	struct stopwatch_ioc_stats st;
+
+	if (copy_from_user(&st, argp, sizeof(st)))
+		return -EFAULT;
+
+	if (st.bank >= sw->nb_banks)
+		return -EINVAL;
+
+	/* no trap: the statistics are maintained by the device in memory */
+	read_lap_stats(&sw->banks[st.bank], &st);
+
+	return copy_to_user(argp, &st, sizeof(st)) ? -EFAULT : 0;
+}
+
+static long stopwatch_ioctl_timer(struct stopwatch_data *sw, unsigned int cmd,
+								  void __user *argp)
+{
+	struct stopwatch_ioc_timer timer;
+	struct StopWatch_cmd swcmd = {};
+	struct StopWatch_cpl cpl;
+	long ret;
+
+	if (copy_from_user(&timer, argp, sizeof(timer)))
+		return -EFAULT;
+
+	swcmd.action = cmd == STOPWATCH_IOC_TIMER_ARM ?
+		STOPWATCH_ACTION_TIMER_ARM : STOPWATCH_ACTION_TIMER_CANCEL;
+	swcmd.flags = timer.flags;
+	swcmd.index = timer.id;
+	swcmd.arg = timer.deadline_ns;
+
+	if (timer.flags > U16_MAX ||
+		!stopwatch_op_valid(sw, swcmd.action, swcmd.index, swcmd.flags))
+		return -EINVAL;
+
+	ret = stopwatch_submit(sw, &swcmd, &cpl, 1);
+	if (ret)
+		return ret;
+
+	ret = stopwatch_errno(cpl.result);
+	if (ret || cmd != STOPWATCH_IOC_TIMER_ARM)
+		return ret;
+
+	timer.deadline_ns = cpl.value;
+
+	return copy_to_user(argp, &timer, sizeof(timer)) ? -EFAULT : 0;
+}
+
+static long stopwatch_ioctl_subscribe(struct stopwatch_file *file,
+									  u64 __user *argp)
+{
+	struct stopwatch_data *sw = file->sw;
+	u64 mask;
+
+	if (get_user(mask, argp))
+		return -EFAULT;
+
+	if (mask & ~(GENMASK_ULL(sw->nb_banks - 1, 0) | STOPWATCH_SUBSCRIBE_TIMERS))
+		return -EINVAL;
+
+	spin_lock_irq(&sw->event_lock);
+	file->bank_mask = mask;
+	list_del_init(&file->node);
+	if (mask)
+		list_add_tail(&file->node, &sw->event_files);
+	spin_unlock_irq(&sw->event_lock);
+
+	return 0;
+}
+
+static long stopwatch_ioctl_set_eventfd(struct stopwatch_file *file,
+										s32 __user *argp)
+{
+	struct stopwatch_data *sw = file->sw;
+	struct eventfd_ctx *eventfd = NULL, *old;
+	s32 fd;
+
+	if (get_user(fd, argp))
+		return -EFAULT;
+
+	if (fd >= 0) {
+		eventfd = eventfd_ctx_fdget(fd);
+		if (IS_ERR(eventfd))
+			return PTR_ERR(eventfd);
+	}
+
+	spin_lock_irq(&sw->event_lock);
+	old = file->eventfd;
+	file->eventfd = eventfd;
+	spin_unlock_irq(&sw->event_lock);
+
+	if (old)
+		eventfd_ctx_put(old);
+
+	return 0;
+}
+
+static long stopwatch_ioctl(struct file *filp, unsigned int cmd,
+							unsigned long arg)
+{
+	struct stopwatch_file *file = filp->private_data;
+	struct stopwatch_data *sw = file->sw;
+	void __user *argp = (void __user *) arg;
+	struct stopwatch_ioc_version version;
+	struct stopwatch_ioc_cmd ioc;
+
+	if (READ_ONCE(sw->dead))
+		return -ENODEV;
+
+	switch (cmd) {
+	case STOPWATCH_IOC_VERSION:
+		version.version = STOPWATCH_IOCTL_VERSION;
+		version.banks = sw->nb_banks;
+
+		return copy_to_user(argp, &version, sizeof(version)) ? -EFAULT : 0;
+	case STOPWATCH_IOC_START:
+	case STOPWATCH_IOC_PAUSE:
+	case STOPWATCH_IOC_RESET:
+	case STOPWATCH_IOC_TIMEOUT:
+	case STOPWATCH_IOC_PERIODIC:
+	case STOPWATCH_IOC_LAP:
+		if (copy_from_user(&ioc, argp, sizeof(ioc)))
+			return -EFAULT;
+		if (ioc.flags & ~STOPWATCH_IOC_CMD_REG ||
+			(ioc.flags && (cmd == STOPWATCH_IOC_TIMEOUT ||
+						   cmd == STOPWATCH_IOC_PERIODIC)))
+			return -EINVAL;
+		break;
+	case STOPWATCH_IOC_SNAPSHOT:
+		return stopwatch_ioctl_snapshot(sw, argp);
+	case STOPWATCH_IOC_BATCH:
+		return stopwatch_ioctl_batch(sw, argp);
+	case STOPWATCH_IOC_STATS:
+		return stopwatch_ioctl_stats(sw, argp);
+	case STOPWATCH_IOC_TIMER_ARM:
+	case STOPWATCH_IOC_TIMER_CANCEL:
+		return stopwatch_ioctl_timer(sw, cmd, argp);
+	case STOPWATCH_IOC_SUBSCRIBE:
+		return stopwatch_ioctl_subscribe(file, argp);
+	case STOPWATCH_IOC_SET_EVENTFD:
+		return stopwatch_ioctl_set_eventfd(file, argp);
+	default:
+		return -ENOTTY;
+	}
+
+	if (ioc.flags & STOPWATCH_IOC_CMD_REG) {
+		switch (cmd) {
+		case STOPWATCH_IOC_START:
+			return stopwatch_exec_reg(sw, STOPWATCH_ACTION_START, ioc.bank);
+		case STOPWATCH_IOC_PAUSE:
+			return stopwatch_exec_reg(sw, STOPWATCH_ACTION_PAUSE, ioc.bank);
+		case STOPWATCH_IOC_RESET:
+			return stopwatch_exec_reg(sw, STOPWATCH_ACTION_RESET, ioc.bank);
+		default: /* STOPWATCH_IOC_LAP */
+			return stopwatch_exec_reg(sw, STOPWATCH_ACTION_LAP, ioc.bank);
+		}
+	}
+
+	switch (cmd) {
+	case STOPWATCH_IOC_START:
+		return stopwatch_exec(sw, STOPWATCH_ACTION_START, ioc.bank, 0, NULL);
+	case STOPWATCH_IOC_PAUSE:
+		return stopwatch_exec(sw, STOPWATCH_ACTION_PAUSE, ioc.bank, 0, NULL);
+	case STOPWATCH_IOC_RESET:
+		return stopwatch_exec(sw, STOPWATCH_ACTION_RESET, ioc.bank, 0, NULL);
+	case STOPWATCH_IOC_LAP:
+		return stopwatch_exec(sw, STOPWATCH_ACTION_LAP, ioc.bank, 0, NULL);
+	case STOPWATCH_IOC_PERIODIC:
+		return stopwatch_exec(sw, STOPWATCH_ACTION_PERIODIC, ioc.bank,
+							  ioc.arg, NULL);
+	default: /* STOPWATCH_IOC_TIMEOUT */
+		return stopwatch_exec(sw, STOPWATCH_ACTION_TIMEOUT, ioc.bank, ioc.arg,
+							  NULL);
+	}
+}
+
+/*
+ * read() of /dev/stopwatch<N>: the text snapshot of the banks, or the
+ * events once the file subscribed to some banks.
+ */
+static ssize_t stopwatch_misc_read(struct file *filp, char __user *buf,
+								   size_t count, loff_t *offset)
+{
+	struct stopwatch_file *file = filp->private_data;
+	struct stopwatch_data *sw = file->sw;
+	struct stopwatch_event ev;
+	size_t done = 0;
+	int ret;
+
+	if (!file->bank_mask)
+		return stopwatch_all_read(filp, buf, count, offset);
+
+	if (count < sizeof(ev))
+		return -EINVAL;
+
+	while (done + sizeof(ev) <= count) {
+		spin_lock_irq(&sw->event_lock);
+		ret = kfifo_get(&file->events, &ev);
+		spin_unlock_irq(&sw->event_lock);
+
+		if (!ret) {
+			if (done)
+				break;
+			if (filp->f_flags & O_NONBLOCK)
+				return -EAGAIN;
+
+			ret = wait_event_interruptible(sw->event_wq,
+										   !kfifo_is_empty(&file->events) ||
+										   READ_ONCE(sw->dead));
+			if (ret)
+				return ret;
+			if (kfifo_is_empty(&file->events))
+				return -ENODEV;
+			continue;
+		}
+
+		if (copy_to_user(buf + done, &ev, sizeof(ev)))
+			return -EFAULT;
+		done += sizeof(ev);
+	}
+
+	return done;
+}
+
+static __poll_t stopwatch_poll(struct file *filp, poll_table *wait)
+{
+	struct stopwatch_file *file = filp->private_data;
+
+	if (!file->bank_mask) /* the snapshot is always readable */
+		return EPOLLIN | EPOLLRDNORM;
+
+	poll_wait(filp, &file->sw->event_wq, wait);
+
+	if (!kfifo_is_empty(&file->events))
+		return EPOLLIN | EPOLLRDNORM;
+
+	return READ_ONCE(file->sw->dead) ? EPOLLHUP | EPOLLERR : 0;
+}
+
+static bool stopwatch_mmap_rw = false;
+module_param_named(mmap_rw, stopwatch_mmap_rw, bool, S_IRUGO);
+MODULE_PARM_DESC(mmap_rw, "allow writable mappings of the shared memory");
+
+/*
+ * Map the pass-through memory of the device in userspace. The mapping
+ * is read-only unless the mmap_rw module parameter is set: the time
+ * pages and the clock offset are enough to compute the stopwatch values
+ * without any syscall. The shared memory (memdev), from shared_offset,
+ * is mapped apart, write-back like its other users.
+ */
+static int stopwatch_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct stopwatch_file *file = filp->private_data;
+    struct stopwatch_data *sw = file->sw;
+
+    if (READ_ONCE(sw->dead)) {
+        return -ENODEV;
+    }
+
+    if (sw->shared_size &&
+        (vma->vm_pgoff << PAGE_SHIFT) >= sw->shared_offset) {
+        /*
+         * Always writable, whatever mmap_rw: its users claim the slots
+         * with atomic compare-and-swaps, see struct StopWatch_shared,
+         * and it holds no state of this device.
+         */
+        return vm_iomap_memory(vma, sw->mem_base_physaddr,
+                               sw->shared_offset + sw->shared_size);
+    }
+
+    if (!stopwatch_mmap_rw) {
+        if (vma->vm_flags & VM_WRITE) {
+            return -EPERM;
+        }
+        vma->vm_flags &= ~VM_MAYWRITE;
+    }
+
+    /* same memory type as the kernel mapping (ioremap), not the shared part */
+    vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+
+    return vm_iomap_memory(vma, sw->mem_base_physaddr,
+                           sw->shared_size ? sw->shared_offset : sw->mem_size);
+}
+
+#ifdef CONFIG_COMPAT
+/*
+ * No pointer-size dependent field, only the argument pointer to convert
+ * (compat_ptr_ioctl, from Linux 5.5).
+ */
+static long stopwatch_compat_ioctl(struct file *filp, unsigned int cmd,
+								   unsigned long arg)
+{
+	return stopwatch_ioctl(filp, cmd, (unsigned long) compat_ptr(arg));
+}
+#endif
+
+static const struct file_operations stopwatch_misc_ops = {
+    .owner      = THIS_MODULE,
+    .open       = stopwatch_all_open,
+    .read       = stopwatch_misc_read,
+    .poll       = stopwatch_poll,
+    .release    = stopwatch_all_release,
+    .mmap       = stopwatch_mmap,
+    .unlocked_ioctl = stopwatch_ioctl,
+#ifdef CONFIG_COMPAT
+    .compat_ioctl   = stopwatch_compat_ioctl,
+#endif
+    .llseek     = no_llseek,
+};
+
+static void stopwatch_del_banks(struct stopwatch_data *sw, int nb_banks)
+{
+    int i;
+
+    for (i = 0; i < nb_banks; i++) {
+        device_destroy(stopwatch_class, sw->banks[i].cdev->dev);
+        cdev_del(sw->banks[i].cdev);
+    }
+}
+
+static int stopwatch_add_banks(struct stopwatch_data *sw, struct device *parent)
+{
+    struct stopwatch_bank *bank;
+    dev_t devt;
+    int i, ret;
+
+    for (i = 0; i < sw->nb_banks; i++) {
+        bank = &sw->banks[i];
+        devt = MKDEV(MAJOR(stopwatch_devt),
+                     sw->id * STOPWATCH_BANKS_MAX + i);
+
+        bank->cdev = cdev_alloc();
+        if (!bank->cdev) {
+            ret = -ENOMEM;
+            goto fail;
+        }
+        bank->cdev->ops = &stopwatch_fops;
+        bank->cdev->owner = THIS_MODULE;
+
+        ret = cdev_add(bank->cdev, devt, 1);
+        if (ret) {
+            kobject_put(&bank->cdev->kobj);
+            goto fail;
+        }
+
+        bank->dev = device_create(stopwatch_class, parent, devt, bank,
+                                  "%s.%d", sw->name, i);
+        if (IS_ERR(bank->dev)) {
+            ret = PTR_ERR(bank->dev);
+            cdev_del(bank->cdev);
+            goto fail;
+        }
+    }
+
+    return 0;
 
   fail:
-    kfree(pdata);
+    pr_err(DRIVERNAME ": unable to register %s.%d\n", sw->name, i);
+    stopwatch_del_banks(sw, i);
+    return ret;
+}
+
+/*
+ * One handler per IRQ line, line i with an affinity hint to the i-th
+ * CPU so that completions are delivered where they were armed.
+ */
+static int stopwatch_request_irqs(struct stopwatch_data *sw,
+                                  struct platform_device *pdev)
+{
+    struct stopwatch_line *line;
+    int i, ret;
+
+    for (i = 0; i < sw->nb_irqs; i++) {
+        line = &sw->lines[i];
+        line->sw = sw;
+        line->index = i;
+        line->irq = platform_get_irq(pdev, i);
+        if (line->irq < 0) {
+            pr_err(DRIVERNAME ": %s: IRQ line %d missing\n", sw->name, i);
+            return line->irq;
+        }
+
+        DEBUG_MSG("register irq %d for %s timeout notifications (line %d)",
+                  line->irq, sw->name, i);
+
+        /* line 0 also carries the clock event */
+        ret = devm_request_irq(&pdev->dev, line->irq, timeout_irq_handler,
+                               i || !stopwatch_clock_enable ? 0 : IRQF_TIMER,
+                               "stopwatch timeout", line);
+        if (ret) {
+            pr_err(DRIVERNAME ": could not register the timeout handler "
+                   "on irq %d...\n", line->irq);
+            return ret;
+        }
+
+        irq_set_affinity_hint(line->irq,
+                              cpumask_of(cpumask_local_spread(i, NUMA_NO_NODE)));
+    }
+    sw->clock_irq = sw->lines[0].irq;
+
+    return 0;
+}
+
+/*
+ * One MSI-X vector per bank, then one per line of timers and the clock
+ * event, see STOPWATCH_PCI_VECTOR_*. The lines keep their affinity hint.
+ */
+static int stopwatch_request_msix(struct stopwatch_data *sw,
+                                  struct pci_dev *pdev)
+{
+    unsigned int nvec =
+        STOPWATCH_PCI_VECTOR_CLOCKEVENT(sw->nb_banks, sw->nb_irqs) + 1;
+    struct stopwatch_line *line;
+    int i, irq, ret;
+
+    ret = pci_alloc_irq_vectors(pdev, nvec, nvec, PCI_IRQ_MSIX);
+    if (ret < 0) {
+        pr_err(DRIVERNAME ": %s: could not allocate %u MSI-X vectors\n",
+               sw->name, nvec);
+        return ret;
+    }
+    sw->msix = true;
+
+    for (i = 0; i < sw->nb_banks; i++) {
+        irq = pci_irq_vector(pdev, STOPWATCH_PCI_VECTOR_BANK(i));
+
+        ret = devm_request_irq(&pdev->dev, irq, stopwatch_bank_msix_handler,
+                               0, "stopwatch timeout", &sw->banks[i]);
+        if (ret) {
+            pr_err(DRIVERNAME ": could not register the timeout handler "
+                   "on irq %d...\n", irq);
+            return ret;
+        }
+    }
+
+    for (i = 0; i < sw->nb_irqs; i++) {
+        line = &sw->lines[i];
+        line->sw = sw;
+        line->index = i;
+        line->irq = pci_irq_vector(pdev,
+                                   STOPWATCH_PCI_VECTOR_TIMERS(sw->nb_banks, i));
+
+        DEBUG_MSG("register irq %d for %s timer notifications (line %d)",
+                  line->irq, sw->name, i);
+
+        ret = devm_request_irq(&pdev->dev, line->irq,
+                               stopwatch_timers_msix_handler, 0,
+                               "stopwatch timers", line);
+        if (ret) {
+            pr_err(DRIVERNAME ": could not register the timers handler "
+                   "on irq %d...\n", line->irq);
+            return ret;
+        }
+
+        irq_set_affinity_hint(line->irq,
+                              cpumask_of(cpumask_local_spread(i, NUMA_NO_NODE)));
+    }
+
+    if (!stopwatch_clock_enable) {
+        return 0;
+    }
+
+    irq = pci_irq_vector(pdev, STOPWATCH_PCI_VECTOR_CLOCKEVENT(sw->nb_banks,
+                                                               sw->nb_irqs));
+    ret = devm_request_irq(&pdev->dev, irq, stopwatch_clockevent_msix_handler,
+                           IRQF_TIMER, "stopwatch clockevent", sw);
+    if (ret) {
+        pr_err(DRIVERNAME ": could not register the clock event handler "
+               "on irq %d...\n", irq);
+        return ret;
+    }
+    sw->clock_irq = irq;
+
+    return 0;
+}
+
+static void stopwatch_free_irqs(struct stopwatch_data *sw)
+{
+    int i;
+
+    /* the hints must be cleared before devm frees the IRQs */
+    for (i = 0; i < sw->nb_irqs; i++) {
+        if (sw->lines[i].sw)
+            irq_set_affinity_hint(sw->lines[i].irq, NULL);
+    }
+    if (sw->clock_irq > 0)
+        irq_set_affinity_hint(sw->clock_irq, NULL);
+}
+
+/*
+ * Reserve @res for the device and map its first @size bytes. The
+ * reservation goes with the device, the mapping with the last
+ * reference, see stopwatch_free.
+ */
+static void __iomem *stopwatch_map(struct device *dev, struct resource *res,
+                                   resource_size_t size)
+{
+    void __iomem *addr;
+
+    if (size > resource_size(res)) {
+        return IOMEM_ERR_PTR(-EINVAL);
+    }
+    if (!devm_request_mem_region(dev, res->start, resource_size(res),
+                                 dev_name(dev))) {
+        return IOMEM_ERR_PTR(-EBUSY);
+    }
+
+    addr = ioremap(res->start, size);
+    return addr ? addr : IOMEM_ERR_PTR(-ENOMEM);
+}
+
+/*
+ * Common part of the probes: allocate the driver data, map the memory
+ * and the registers, and reserve the device id. The transport then
+ * requests its IRQs and calls stopwatch_register.
+ */
+static struct stopwatch_data *stopwatch_setup(struct device *dev,
+                                              struct resource *mem_res,
+                                              struct resource *regs_res)
+{
+    struct stopwatch_data *sw;
+    int i, ret;
+
+    DEBUG_MSG(" --- ");
+    DEBUG_MSG("Loading the Stopwatch module ... ");
+
+    /*
+     * Allocate driver private data, released with the device and the
+     * files still open. The devm action goes before the IRQs: it runs
+     * after they are freed.
+     */
+    sw = kzalloc(sizeof(struct stopwatch_data), GFP_KERNEL);
+    if (!sw) {
+        return ERR_PTR(-ENOMEM);
+    }
+    kref_init(&sw->ref);
+
+    ret = devm_add_action_or_reset(dev, stopwatch_put, sw);
+    if (ret) {
+        return ERR_PTR(ret);
+    }
+
+    sw->counters = alloc_percpu(struct stopwatch_counters);
+    if (!sw->counters) {
+        return ERR_PTR(-ENOMEM);
+    }
+
+    mutex_init(&sw->cmd_lock);
+    spin_lock_init(&sw->event_lock);
+    INIT_LIST_HEAD(&sw->event_files);
+    init_waitqueue_head(&sw->event_wq);
+
+    /* Map the IO regions */
+
+    /* the memory region */
+    sw->mem_base_physaddr = mem_res->start;
+    sw->mem_size = resource_size(mem_res);
+
+    /*
+     * Only struct StopWatch_mem, as Device memory: the shared memory
+     * from shared_offset is mapped write-back in userspace, and the
+     * kernel does not use it, so it has no kernel mapping.
+     */
+    sw->mem_base_addr = stopwatch_map(dev, mem_res,
+                                      PAGE_ALIGN(sizeof(struct StopWatch_mem)));
+
+    DEBUG_MSG("mapped region 0/mem,  physaddr: 0x%lx, size: 0x%lx",
+              (unsigned long) sw->mem_base_physaddr,
+              (unsigned long) sw->mem_size);
+
+    if (IS_ERR(sw->mem_base_addr)) {
+        pr_err(DRIVERNAME ": could not map the 'mem' memory region\n");
+
+        return ERR_CAST(sw->mem_base_addr);
+    }
+
+    sw->shared_size = readq(&sw->mem_base_addr->shared_size);
+    sw->shared_offset = readq(&sw->mem_base_addr->shared_offset);
+    DEBUG_MSG("shared memory at offset 0x%lx, size: 0x%lx",
+              (unsigned long) sw->shared_offset,
+              (unsigned long) sw->shared_size);
+
+    if (sw->shared_size &&
+        (sw->shared_offset < PAGE_ALIGN(sizeof(struct StopWatch_mem)) ||
+         !PAGE_ALIGNED(sw->shared_offset) ||
+         sw->shared_size > sw->mem_size - sw->shared_offset)) {
+        pr_err(DRIVERNAME ": invalid shared memory at offset 0x%lx\n",
+               (unsigned long) sw->shared_offset);
+
+        return ERR_PTR(-EINVAL);
+    }
+
+    /*
+     * No second, cacheable mapping of the marks: mismatched memory
+     * attributes for the same physical pages are not allowed on arm64.
+     */
+    sw->marks = sw->mem_base_addr->marks;
+
+    /* the regs memory region */
+    sw->regs_base_physaddr = regs_res->start;
+    sw->regs_size = resource_size(regs_res);
+    sw->regs_base_addr = stopwatch_map(dev, regs_res, sw->regs_size);
+
+    DEBUG_MSG("mapped region 1/regs, physaddr: 0x%lx, size: 0x%lx",
+              (unsigned long) sw->regs_base_physaddr,
+              (unsigned long) sw->regs_size);
+
+    if (IS_ERR(sw->regs_base_addr)) {
+        pr_err(DRIVERNAME ": could not map the 'regs' memory region\n");
+
+        return ERR_CAST(sw->regs_base_addr);
+    }
+
+    sw->nb_banks = readl(&sw->regs_base_addr->banks);
+    if (sw->nb_banks == 0 || sw->nb_banks > STOPWATCH_BANKS_MAX) {
+        pr_err(DRIVERNAME ": invalid number of banks (%u)\n", sw->nb_banks);
+
+        return ERR_PTR(-EINVAL);
+    }
+
+    sw->nb_irqs = readl(&sw->regs_base_addr->irqs);
+    if (sw->nb_irqs == 0 || sw->nb_irqs > STOPWATCH_IRQS_MAX) {
+        pr_err(DRIVERNAME ": invalid number of IRQ lines (%u)\n", sw->nb_irqs);
+
+        return ERR_PTR(-EINVAL);
+    }
+
+    for (i = 0; i < sw->nb_banks; i++) {
+        sw->banks[i].sw = sw;
+        sw->banks[i].index = i;
+    }
+
+    mutex_lock(&stopwatch_idr_lock);
+    sw->id = idr_alloc(&stopwatch_idr, sw, 0, STOPWATCH_DEVICES_MAX,
+                       GFP_KERNEL);
+    mutex_unlock(&stopwatch_idr_lock);
+    if (sw->id < 0) {
+        pr_err(DRIVERNAME ": too many stopwatch devices\n");
+
+        return ERR_PTR(sw->id);
+    }
+    snprintf(sw->name, sizeof(sw->name), DRIVERNAME "%d", sw->id);
+
+    return sw;
+}
+
+/* Register the devices, once the IRQs are requested */
+static int stopwatch_register(struct stopwatch_data *sw, struct device *dev)
+{
+    int ret;
+
+    /* Register the misc device, for the whole device */
+    sw->mdev.minor = MISC_DYNAMIC_MINOR;
+    sw->mdev.name = sw->name;
+    sw->mdev.fops = &stopwatch_misc_ops;
+    sw->mdev.parent = dev;
+    ret = misc_register(&sw->mdev);
+
+    if (ret) {
+        pr_err(DRIVERNAME ": unable to register misc device\n");
+        return ret;
+    }
+
+    /* and one char device per bank */
+    ret = stopwatch_add_banks(sw, dev);
+    if (ret) {
+        misc_deregister(&sw->mdev);
+        return ret;
+    }
+
+    stopwatch_init(sw);
+
+    if (stopwatch_clock_enable) {
+        stopwatch_clock_register(sw);
+    }
+
+    if (sw->id == 0) {
+        WRITE_ONCE(stopwatch_marker, sw);
+    }
+
+    DEBUG_MSG("Registered stopwatch misc device %s (%u banks%s)", sw->name,
+              sw->nb_banks, sw->msix ? ", MSI-X" : "");
+
+    return 0;
+}
+
+static void stopwatch_idr_remove(struct stopwatch_data *sw)
+{
+    mutex_lock(&stopwatch_idr_lock);
+    idr_remove(&stopwatch_idr, sw->id);
+    mutex_unlock(&stopwatch_idr_lock);
+}
+
+/*
+ * The files still open keep the data: their commands fail with -ENODEV
+ * and their reads return -ENODEV once the events are consumed.
+ */
+static void stopwatch_unregister(struct stopwatch_data *sw)
+{
+    if (stopwatch_marker == sw) {
+        WRITE_ONCE(stopwatch_marker, NULL);
+        synchronize_rcu(); /* stopwatch_mark runs with preemption disabled */
+    }
+
+    stopwatch_clock_unregister(sw);
+    stopwatch_exit(sw);
+    stopwatch_idr_remove(sw);
+
+    mutex_lock(&sw->cmd_lock);
+    WRITE_ONCE(sw->dead, true);
+    mutex_unlock(&sw->cmd_lock);
+    wake_up_interruptible(&sw->event_wq);
+
+    stopwatch_free_irqs(sw);
+
+    stopwatch_del_banks(sw, sw->nb_banks);
+    misc_deregister(&sw->mdev);
+}
+
+static int stopwatch_remove(struct platform_device *pdev)
+{
+    stopwatch_unregister(platform_get_drvdata(pdev));
+
+    return 0;
+}
+
+static int stopwatch_probe(struct platform_device *pdev)
+{
+    struct stopwatch_data *sw;
+    int ret;
+
+    sw = stopwatch_setup(&pdev->dev,
+                         platform_get_resource(pdev, IORESOURCE_MEM, 0),
+                         platform_get_resource(pdev, IORESOURCE_MEM, 1));
+    if (IS_ERR(sw)) {
+        return PTR_ERR(sw);
+    }
+
+	/* register the timeout IRQs, one per line */
+	ret = stopwatch_request_irqs(sw, pdev);
+	if (ret) {
+		goto fail_irqs;
+	}
+
+    ret = stopwatch_register(sw, &pdev->dev);
+    if (ret) {
+        goto fail_irqs;
+    }
+
+    platform_set_drvdata(pdev, sw);
+
+    return 0;
+
+  fail_irqs:
+    stopwatch_free_irqs(sw);
+    stopwatch_idr_remove(sw);
     return ret;
 }
 
@@ -370,7 +2285,122 @@ static struct platform_driver stopwatch_driver = {
     },
 };
 
-module_platform_driver_probe(stopwatch_driver, stopwatch_probe);
+/* PCI variant (stopwatch-pci), same device behind BARs and MSI-X */
+static int stopwatch_pci_probe(struct pci_dev *pdev,
+                               const struct pci_device_id *id)
+{
+    struct stopwatch_data *sw;
+    int ret;
+
+    ret = pcim_enable_device(pdev);
+    if (ret) {
+        return ret;
+    }
+    pci_set_master(pdev); /* MSI-X writes */
+
+    sw = stopwatch_setup(&pdev->dev,
+                         &pdev->resource[STOPWATCH_PCI_BAR_MEM],
+                         &pdev->resource[STOPWATCH_PCI_BAR_REGS]);
+    if (IS_ERR(sw)) {
+        return PTR_ERR(sw);
+    }
+
+    ret = stopwatch_request_msix(sw, pdev);
+    if (ret) {
+        goto fail_irqs;
+    }
+
+    ret = stopwatch_register(sw, &pdev->dev);
+    if (ret) {
+        goto fail_irqs;
+    }
+
+    pci_set_drvdata(pdev, sw);
+
+    return 0;
+
+  fail_irqs:
+    stopwatch_free_irqs(sw);
+    stopwatch_idr_remove(sw);
+    return ret;
+}
+
+static void stopwatch_pci_remove(struct pci_dev *pdev)
+{
+    stopwatch_unregister(pci_get_drvdata(pdev));
+}
+
+static const struct pci_device_id stopwatch_pci_ids[] = {
+    { PCI_DEVICE(STOPWATCH_PCI_VENDOR_ID, STOPWATCH_PCI_DEVICE_ID) },
+    {}
+};
+MODULE_DEVICE_TABLE(pci, stopwatch_pci_ids);
+
+static struct pci_driver stopwatch_pci_driver = {
+    .name = DRIVERNAME,
+    .id_table = stopwatch_pci_ids,
+    .probe = stopwatch_pci_probe,
+    .remove = stopwatch_pci_remove,
+};
+
+static int __init stopwatch_module_init(void)
+{
+    int ret;
+
+    ret = alloc_chrdev_region(&stopwatch_devt, 0, STOPWATCH_MINORS,
+                              DRIVERNAME);
+    if (ret) {
+        return ret;
+    }
+
+    stopwatch_class = class_create(THIS_MODULE, DRIVERNAME);
+    if (IS_ERR(stopwatch_class)) {
+        ret = PTR_ERR(stopwatch_class);
+        goto fail_class;
+    }
+
+    stopwatch_debugfs_dir = debugfs_create_dir("stopwatch", NULL);
+
+    /* no unbind from sysfs under a registered clock, see stopwatch_clock_register */
+    stopwatch_driver.driver.suppress_bind_attrs = stopwatch_clock_enable;
+    stopwatch_pci_driver.driver.suppress_bind_attrs = stopwatch_clock_enable;
+
+    /* registered, not probed once: the devices may come from either bus */
+    ret = platform_driver_register(&stopwatch_driver);
+    if (ret) {
+        goto fail_driver;
+    }
+
+    ret = pci_register_driver(&stopwatch_pci_driver);
+    if (ret) {
+        goto fail_pci;
+    }
+
+    return 0;
+
+  fail_pci:
+    platform_driver_unregister(&stopwatch_driver);
+  fail_driver:
+    debugfs_remove_recursive(stopwatch_debugfs_dir);
+    class_destroy(stopwatch_class);
+  fail_class:
+    unregister_chrdev_region(stopwatch_devt, STOPWATCH_MINORS);
+    return ret;
+}
+
+static void __exit stopwatch_module_exit(void)
+{
+    pci_unregister_driver(&stopwatch_pci_driver);
+    platform_driver_unregister(&stopwatch_driver);
+
+    debugfs_remove_recursive(stopwatch_debugfs_dir);
+    class_destroy(stopwatch_class);
+    unregister_chrdev_region(stopwatch_devt, STOPWATCH_MINORS);
+    idr_destroy(&stopwatch_idr);
+}
+
+module_init(stopwatch_module_init);
+module_exit(stopwatch_module_exit);
 
 MODULE_AUTHOR("Kevin Pouget <blog.qemu_stopwatch@972.ovh>");
 MODULE_DESCRIPTION("Stopwatch guest device driver (Qemu virtual device)");
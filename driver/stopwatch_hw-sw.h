@@ -1,30 +1,397 @@
 #ifndef STOPWATCH_HW_SW_H
 #define STOPWATCH_HW_SW_H
 
-struct StopWatch_regs {
+#ifndef __KERNEL__
+#include <stdint.h> /* also included by userspace, see mmap(/dev/stopwatch<N>) */
+#endif
+
+#define STOPWATCH_BANKS_MAX 32
+#define STOPWATCH_IRQS_MAX 8
+
+struct StopWatch_bank_regs {
 	uint64_t command;
 	uint64_t status;
 };
 
+/*
+ * IRQ line: the banks and timers routed to it. A bank timeout goes to
+ * the line of its last STOPWATCH_ACTION_TIMEOUT or PERIODIC command
+ * (bank index % irqs by default), a timer to the line of its
+ * STOPWATCH_ACTION_TIMER_ARM command, see STOPWATCH_CMD_LINE().
+ */
+struct StopWatch_line_regs {
+	uint64_t status; // RO: irq_status, restricted to the line
+	uint64_t ack;    // WO: acknowledge the expiry ring of the line
+};
+
+struct StopWatch_regs {
+	uint64_t banks;      // RO: number of stopwatch banks
+	uint64_t command;    // device-wide command, applied to every bank
+	uint64_t irq_status; // RO: bitmap of the banks with a timeout pending,
+	                     // STOPWATCH_IRQ_TIMERS and STOPWATCH_IRQ_CLOCKEVENT
+	uint64_t doorbell;   // WO: process the pending commands of the ring
+	uint64_t irqs;       // RO: number of IRQ lines
+	uint64_t clock;      // RO: device clock, ns
+	uint64_t clockevent; // WO: clock event in ns from now, 0 to cancel,
+	                     // acknowledges STOPWATCH_IRQ_CLOCKEVENT
+
+	struct StopWatch_line_regs line[STOPWATCH_IRQS_MAX]; // only 'irqs' used
+	struct StopWatch_bank_regs bank[STOPWATCH_BANKS_MAX]; // only 'banks' mapped
+};
+
+/*
+ * Time page, published by the device after every command. The guest
+ * computes the current value locally (no trap): it retries while `seq`
+ * is odd or has changed during the read.
+ */
+struct StopWatch_time {
+	uint32_t seq;
+	uint32_t status;
+	uint64_t started_at_ns; // device clock, meaningful when RUNNING
+	uint64_t total_ns;      // time accumulated before the last start
+	uint64_t now_ns;        // device clock when the page was published
+};
+
+/*
+ * Batched command submission: the guest queues commands in the
+ * submission queue, advances sq_tail and rings the doorbell once. The
+ * device processes all the pending commands in the same trap, and posts
+ * one completion per command. Indexes are free-running, the slot of
+ * index i is i % STOPWATCH_RING_SIZE.
+ */
+#define STOPWATCH_RING_SIZE 256
+#define STOPWATCH_RING_ALL_BANKS 0xffffffff // index of device-wide commands
+
+/* IRQ line of STOPWATCH_ACTION_TIMEOUT and TIMER_ARM, in the command flags */
+#define STOPWATCH_CMD_LINE_SHIFT 8
+#define STOPWATCH_CMD_LINE_MASK (0xff << STOPWATCH_CMD_LINE_SHIFT)
+#define STOPWATCH_CMD_LINE(line) ((line) << STOPWATCH_CMD_LINE_SHIFT)
+#define STOPWATCH_CMD_LINE_OF(flags) \
+	(((flags) & STOPWATCH_CMD_LINE_MASK) >> STOPWATCH_CMD_LINE_SHIFT)
+
+struct StopWatch_cmd {
+	uint16_t action; // STOPWATCH_ACTION_*
+	uint16_t flags;  // STOPWATCH_ACTION_TIMER_ARM: STOPWATCH_TIMER_*
+	                 // STOPWATCH_ACTION_TIMEOUT/PERIODIC/TIMER_ARM:
+	                 //   STOPWATCH_CMD_LINE()
+	uint32_t index;  // bank index, STOPWATCH_RING_ALL_BANKS or timer id
+	uint64_t arg;    // STOPWATCH_ACTION_TIMEOUT: timeout in ns
+	                 // STOPWATCH_ACTION_PERIODIC: period in ns, 0 to stop
+	                 // STOPWATCH_ACTION_TIMER_ARM: deadline in ns
+	uint64_t tag;    // opaque, copied into the completion
+};
+
+struct StopWatch_cpl {
+	uint64_t tag;
+	int64_t result;  // STOPWATCH_OK or -STOPWATCH_ERR_*
+	uint64_t value;  // stopwatch value (ns) after the command,
+	                 // or absolute deadline of STOPWATCH_ACTION_TIMER_ARM
+};
+
+struct StopWatch_ring {
+	uint32_t sq_head; // written by the device
+	uint32_t sq_tail; // written by the guest
+	uint32_t cq_head; // written by the guest
+	uint32_t cq_tail; // written by the device
+
+	struct StopWatch_cmd sq[STOPWATCH_RING_SIZE];
+	struct StopWatch_cpl cq[STOPWATCH_RING_SIZE];
+};
+
+/*
+ * Timer engine: one-shot timers, armed and cancelled through the command
+ * ring with STOPWATCH_ACTION_TIMER_ARM/CANCEL, the command index being
+ * the timer id. Arming an armed timer moves its deadline. The device
+ * posts the expired timers in the expiry ring of their IRQ line and
+ * raises STOPWATCH_IRQ_TIMERS on the line. The guest consumes the
+ * entries, advances head and acknowledges in the 'ack' register of the
+ * line (the device-wide STOPWATCH_ACTION_TIMEOUT_ACK acknowledges all
+ * the lines).
+ */
+#define STOPWATCH_TIMERS_MAX 4096
+#define STOPWATCH_TIMER_ABS 0x1 // deadline on the device clock, else relative
+#define STOPWATCH_IRQ_TIMERS (1ULL << STOPWATCH_BANKS_MAX) // irq_status bit
+
+#define STOPWATCH_EXPIRY_RING_SIZE 1024 // per IRQ line
+
+struct StopWatch_expiry {
+	uint32_t id;
+	uint32_t pad;
+	uint64_t deadline_ns;
+	uint64_t expired_ns; // device clock when the timer was posted
+};
+
+struct StopWatch_expiry_ring {
+	uint32_t head; // written by the guest
+	uint32_t tail; // written by the device
+
+	struct StopWatch_expiry entries[STOPWATCH_EXPIRY_RING_SIZE];
+};
+
+/*
+ * Laps: STOPWATCH_ACTION_LAP records the stopwatch value, and the time
+ * since the previous lap (or since the reset), in the lap ring of the
+ * bank. The ring overwrites the oldest laps, tail is free-running. The
+ * device also keeps running statistics of the lap times, under `seq`
+ * like the time page: count, min, max, sum and a log-linear histogram.
+ */
+#define STOPWATCH_LAP_RING_SIZE 64
+
+/*
+ * Histogram buckets: exact below STOPWATCH_HIST_SUB ns, then
+ * STOPWATCH_HIST_SUB buckets per power of two (12.5% wide), up to
+ * 2^STOPWATCH_HIST_MAX_BITS ns (~18 min). The last bucket holds the
+ * larger values.
+ */
+#define STOPWATCH_HIST_SUB_BITS 3
+#define STOPWATCH_HIST_SUB (1 << STOPWATCH_HIST_SUB_BITS)
+#define STOPWATCH_HIST_MAX_BITS 40
+#define STOPWATCH_HIST_BUCKETS \
+	((STOPWATCH_HIST_MAX_BITS - STOPWATCH_HIST_SUB_BITS + 1) * STOPWATCH_HIST_SUB + 1)
+
+static inline unsigned int stopwatch_hist_bucket(uint64_t ns)
+{
+	unsigned int msb;
+
+	if (ns < STOPWATCH_HIST_SUB)
+		return ns;
+
+	msb = 63 - __builtin_clzll(ns);
+	if (msb >= STOPWATCH_HIST_MAX_BITS)
+		return STOPWATCH_HIST_BUCKETS - 1;
+
+	return (msb - STOPWATCH_HIST_SUB_BITS + 1) * STOPWATCH_HIST_SUB
+		+ ((ns >> (msb - STOPWATCH_HIST_SUB_BITS)) & (STOPWATCH_HIST_SUB - 1));
+}
+
+/* smallest value of the next bucket, the last one is unbounded */
+static inline uint64_t stopwatch_hist_bucket_end(unsigned int bucket)
+{
+	unsigned int shift;
+
+	if (bucket < STOPWATCH_HIST_SUB)
+		return bucket + 1;
+	if (bucket >= STOPWATCH_HIST_BUCKETS - 1)
+		return ~0ULL;
+
+	shift = bucket / STOPWATCH_HIST_SUB - 1;
+
+	return (uint64_t) (STOPWATCH_HIST_SUB + bucket % STOPWATCH_HIST_SUB + 1)
+		<< shift;
+}
+
+struct StopWatch_lap {
+	uint64_t value_ns; // stopwatch value at the lap
+	uint64_t lap_ns;   // since the previous lap
+};
+
+struct StopWatch_laps {
+	uint32_t seq;  // statistics update in progress when odd
+	uint32_t tail; // index of the next lap in the ring
+
+	uint64_t count;
+	uint64_t min_ns;
+	uint64_t max_ns;
+	uint64_t sum_ns;
+	uint64_t hist[STOPWATCH_HIST_BUCKETS];
+
+	struct StopWatch_lap ring[STOPWATCH_LAP_RING_SIZE];
+};
+
+/*
+ * Trace marks of the guest kernel (stopwatch_mark()), one ring per CPU,
+ * written without trapping. The ring overwrites the oldest marks. A
+ * mark is valid when its `seq` is its free-running index + 1 (written
+ * last). `tail` is a hint of the number of marks written, it can lag
+ * briefly when marks nest on a CPU.
+ */
+#define STOPWATCH_MARK_CPUS 8
+#define STOPWATCH_MARK_RING_SIZE 2048
+
+struct StopWatch_mark {
+	uint32_t seq;
+	uint32_t id;
+	uint64_t timestamp_ns; // device clock
+	uint64_t arg;
+};
+
+struct StopWatch_mark_ring {
+	uint64_t tail;
+
+	struct StopWatch_mark marks[STOPWATCH_MARK_RING_SIZE];
+};
+
+/*
+ * Periodic timeout of a bank, STOPWATCH_ACTION_PERIODIC: the device
+ * re-arms the timeout every period_ns by itself, the IRQ is the one of
+ * the one-shot timeout. The periods that expire while the previous IRQ
+ * is not acknowledged (STOPWATCH_ACTION_TIMEOUT_ACK), or that the
+ * device itself was late for, raise no new IRQ: they are coalesced and
+ * counted in `overruns`. The fields are written by the device, each
+ * one atomically, before the IRQ.
+ */
+#define STOPWATCH_PERIOD_MIN_NS 10000 // 100 kHz
+
+struct StopWatch_periodic {
+	uint64_t period_ns; // 0 when stopped
+	uint64_t ticks;     // periods expired since the start
+	uint64_t overruns;  // periods coalesced into a previous IRQ
+	uint64_t next_ns;   // next expiry, device clock
+};
+
+/*
+ * Clock page: with the clock_page property, a host thread of the device
+ * stores the device clock in `now_ns` every `resolution_ns` (10 us by
+ * default, continuously when 1), so that the guest reads the time
+ * without trapping. The updates pause while the VM is stopped. The
+ * 'clock' register gives the exact value, with a trap.
+ */
+struct StopWatch_clock {
+	uint64_t now_ns;
+	uint64_t resolution_ns; // 0 when the clock page is off
+};
+
+/*
+ * Clock event: one-shot, armed by the 'clockevent' register. It raises
+ * STOPWATCH_IRQ_CLOCKEVENT on line 0 until the next write of the
+ * register.
+ */
+#define STOPWATCH_IRQ_CLOCKEVENT (STOPWATCH_IRQ_TIMERS << 1) // irq_status bit
+#define STOPWATCH_CLOCKEVENT_MIN_NS 1000
+
+/*
+ * Shared stopwatches (memdev property): a host memory backend, shared
+ * by several VMs and host tools, mapped in the region of each device at
+ * shared_offset, after its own StopWatch_mem. It holds stopwatch slots
+ * on a common timebase, the host clock of the devices (clock=realtime
+ * or host, checked when the device attaches), read and updated directly
+ * in memory, without trapping nor lock:
+ *
+ * - a slot has at most one writer, its owner. A user claims a free slot
+ *   with a compare-and-swap of `owner` from 0 to its id, and gives it
+ *   back with a compare-and-swap to 0. The id is the shared_id of its
+ *   device in the upper 32 bits, and a local identifier (e.g. the pid)
+ *   in the lower ones, unique among the users of the memory.
+ * - the owner updates the time page of the slot as the device does for
+ *   the banks, and any user reads it the same way: no lock, retry while
+ *   `seq` is odd or has changed.
+ *
+ * The first device to attach sets `clock` with a compare-and-swap from
+ * 0, resets the slots, then sets `magic`: the users wait for it. The
+ * next devices check that they use the same clock. The memory outlives
+ * the VMs: the slots of a dead owner stay claimed until a
+ * compare-and-swap from its id.
+ */
+#define STOPWATCH_SHARED_MAGIC 0x48535753 // "SWSH"
+
+#define STOPWATCH_SHARED_CLOCK_REALTIME 1 // host CLOCK_MONOTONIC
+#define STOPWATCH_SHARED_CLOCK_HOST 2     // host CLOCK_REALTIME
+
+struct StopWatch_shared_slot {
+	uint64_t owner; // 0 when free
+	struct StopWatch_time time;
+};
+
+struct StopWatch_shared {
+	uint32_t magic;
+	uint32_t clock; // STOPWATCH_SHARED_CLOCK_*
+	uint64_t users; // devices attached since the creation, last shared_id
+
+	struct StopWatch_shared_slot slot[]; // up to shared_size
+};
+
+#define STOPWATCH_SHARED_SLOTS(size) \
+	(((size) - sizeof(struct StopWatch_shared)) / \
+	 sizeof(struct StopWatch_shared_slot))
+
 #define STOPWATCH_MEM_DATA_LENGTH 128
 struct StopWatch_mem {
 	uint64_t data_len;
 	char data[STOPWATCH_MEM_DATA_LENGTH];
+
+	struct StopWatch_time time[STOPWATCH_BANKS_MAX];
+
+	/*
+	 * Written by the guest driver: device clock - guest
+	 * CLOCK_MONOTONIC_RAW, to compute the running values from userspace.
+	 */
+	int64_t clock_offset_ns;
+
+	uint64_t timeout_ns; // argument of STOPWATCH_ACTION_TIMEOUT and PERIODIC
+
+	struct StopWatch_ring ring;
+
+	struct StopWatch_expiry_ring expiry[STOPWATCH_IRQS_MAX];
+
+	struct StopWatch_laps laps[STOPWATCH_BANKS_MAX];
+
+	struct StopWatch_mark_ring marks[STOPWATCH_MARK_CPUS]; // one per CPU
+
+	struct StopWatch_periodic periodic[STOPWATCH_BANKS_MAX];
+
+	struct StopWatch_clock clock;
+
+	/* struct StopWatch_shared in the region, shared_size 0 if none */
+	uint64_t shared_offset;
+	uint64_t shared_size;
+	uint64_t shared_id; // of the device, see struct StopWatch_shared
 };
 
+/* the memory region is padded to the largest guest page size, for mmap */
+#define STOPWATCH_MEM_ALIGN 0x10000
+
+/*
+ * PCI transport (stopwatch-pci): the registers in BAR 0, the shared
+ * memory in BAR 2 and the MSI-X table in BAR 4. Vector b signals the
+ * timeout of bank b, vector banks + l the expiry ring of line l, and
+ * vector banks + irqs the clock event. The
+ * vectors are edge-triggered: the device acknowledges a one-shot bank
+ * timeout when it fires (STOPWATCH_ACTION_TIMEOUT_ACK fails), the status
+ * registers read 0, and the 'ack' of a line is only needed after
+ * draining a full expiry ring, for the timers that did not fit. The
+ * periods of a periodic timeout still wait for STOPWATCH_ACTION_TIMEOUT_ACK
+ * to raise again, they are coalesced meanwhile.
+ */
+#define STOPWATCH_PCI_VENDOR_ID 0x1b36 // Red Hat, Inc. (QEMU)
+#define STOPWATCH_PCI_DEVICE_ID 0x10f0 // not allocated, private use
+
+#define STOPWATCH_PCI_BAR_REGS 0
+#define STOPWATCH_PCI_BAR_MEM  2 // 64-bit, prefetchable
+#define STOPWATCH_PCI_BAR_MSIX 4
+
+#define STOPWATCH_PCI_VECTOR_BANK(bank) (bank)
+#define STOPWATCH_PCI_VECTOR_TIMERS(banks, line) ((banks) + (line))
+#define STOPWATCH_PCI_VECTOR_CLOCKEVENT(banks, irqs) ((banks) + (irqs))
+
 #define STOPWATCH_TIMEOUT_MAX 10 // seconds
+#define STOPWATCH_TIMEOUT_MAX_NS (STOPWATCH_TIMEOUT_MAX * 1000000000ULL)
 
 enum {
-	STOPWATCH_ACTION_RESET,  // 0
+	STOPWATCH_ACTION_RESET,  // 0: cancels the timeout, one-shot or periodic
 	STOPWATCH_ACTION_START,  // 1
 	STOPWATCH_ACTION_PAUSE,  // 2
 	STOPWATCH_ACTION_UPDATE, // 3
 	STOPWATCH_ACTION_TIMEOUT, // 4
 	STOPWATCH_ACTION_TIMEOUT_ACK, // 5
+	STOPWATCH_ACTION_TIMER_ARM,   // 6: command ring only
+	STOPWATCH_ACTION_TIMER_CANCEL, // 7: command ring only
+	STOPWATCH_ACTION_LAP,          // 8
+	STOPWATCH_ACTION_LAP_CLEAR,    // 9: clear the lap statistics
+	STOPWATCH_ACTION_PERIODIC,     // 10: periodic timeout, 0 to stop
 
 	STOPWATCH_ACTION_LAST // keep last
 };
 
+enum {
+	STOPWATCH_OK,          // 0
+	STOPWATCH_ERR_INVALID, // 1: invalid action or bank
+	STOPWATCH_ERR_STATE,   // 2: action not allowed in the current state
+	STOPWATCH_ERR_RANGE,   // 3: argument out of range
+	STOPWATCH_ERR_BUSY,    // 4: timeout already ongoing
+
+	STOPWATCH_ERR_LAST // keep last
+};
+
 enum {
 	STOPWATCH_STATE_RUNNING, // 0
 	STOPWATCH_STATE_RESET,   // 1
@@ -0,0 +1,154 @@
+#ifndef STOPWATCH_IOCTL_H
+#define STOPWATCH_IOCTL_H
+
+/*
+ * ioctl interface of /dev/stopwatch<N>. The actions and states are the
+ * STOPWATCH_ACTION_* and STOPWATCH_STATE_* of stopwatch_hw-sw.h.
+ */
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * Bumped with every new ioctl or flag, marked "since version N" below:
+ * 2 events (SUBSCRIBE, SET_EVENTFD), 3 timer engine (TIMER_ARM/CANCEL),
+ * 4 laps (LAP, STATS), 5 STOPWATCH_IOC_CMD_REG, 6 PERIODIC.
+ */
+#define STOPWATCH_IOCTL_VERSION 6
+
+#define STOPWATCH_IOC_MAGIC 0xB7
+
+struct stopwatch_ioc_version {
+	__u32 version; // STOPWATCH_IOCTL_VERSION
+	__u32 banks;   // number of banks of the device
+};
+
+struct stopwatch_ioc_cmd {
+	__u32 bank;
+	__u32 flags;   // STOPWATCH_IOC_CMD_*, since version 5
+	__u64 arg;     // STOPWATCH_IOC_TIMEOUT: timeout in ns
+	               // STOPWATCH_IOC_PERIODIC: period in ns, 0 to stop
+};
+
+/*
+ * START, PAUSE, RESET and LAP through the command register of the bank
+ * instead of the command ring: one trap and no lock, the commands to
+ * different banks run in parallel. The state is checked on the time
+ * page, so a concurrent command on the same bank can make it fail
+ * silently (counted by the device, see the stats-errors property).
+ */
+#define STOPWATCH_IOC_CMD_REG 0x1
+
+struct stopwatch_ioc_snapshot {
+	__u32 bank;    // in
+	__u32 status;  // out: STOPWATCH_STATE_*
+	__u64 value_ns;
+	__u64 started_at_ns;
+	__u64 total_ns;
+	__u64 now_ns;  // device clock at the time of the snapshot
+};
+
+struct stopwatch_ioc_op {
+	__u16 action;  // STOPWATCH_ACTION_*
+	__u16 flags;
+	__u32 bank;
+	__u64 arg;
+};
+
+struct stopwatch_ioc_result {
+	__s32 error;   // 0 or -errno
+	__u32 pad;
+	__u64 value_ns; // stopwatch value after the operation
+};
+
+/*
+ * Lap statistics of a bank, see STOPWATCH_ACTION_LAP. The quantiles come
+ * from the device histogram: upper bound of the bucket, 12.5% precision.
+ */
+struct stopwatch_ioc_stats {
+	__u32 bank;    // in
+	__u32 pad;
+	__u64 count;
+	__u64 min_ns;
+	__u64 max_ns;
+	__u64 sum_ns;
+	__u64 mean_ns;
+	__u64 p50_ns;
+	__u64 p99_ns;
+	__u64 p999_ns;
+};
+
+#define STOPWATCH_BATCH_MAX 1024
+
+struct stopwatch_ioc_batch {
+	__u32 count;   // number of operations, up to STOPWATCH_BATCH_MAX
+	__u32 flags;
+	__u64 ops;     // struct stopwatch_ioc_op[count]
+	__u64 results; // struct stopwatch_ioc_result[count]
+};
+
+/*
+ * Events, read() from /dev/stopwatch<N> once subscribed to some banks
+ * with STOPWATCH_IOC_SUBSCRIBE. read() blocks unless O_NONBLOCK, and
+ * poll() reports EPOLLIN when events are pending. An eventfd set with
+ * STOPWATCH_IOC_SET_EVENTFD is signalled for every event of the file.
+ */
+enum {
+	STOPWATCH_EVENT_TIMEOUT = 1, // timeout of a bank expired
+	STOPWATCH_EVENT_TIMER,       // timer of the timer engine expired
+};
+
+/* subscription mask bit of the timer engine events */
+#define STOPWATCH_SUBSCRIBE_TIMERS (1ULL << 63)
+
+struct stopwatch_event {
+	__u32 type;    // STOPWATCH_EVENT_*
+	__u32 index;   // bank, or timer id
+	__u64 count;   // number of such events of the bank (timer engine) so far
+	               // periodic TIMEOUT: periods expired, the coalesced
+	               // ones (overruns) show as gaps
+	__u64 timestamp_ns; // device clock, when the guest got the IRQ
+	                    // TIMER: when the device posted the expiry
+};
+
+/*
+ * One-shot timers of the device timer engine, STOPWATCH_TIMERS_MAX of
+ * them. Arming an armed timer moves its deadline. The expiries are
+ * STOPWATCH_EVENT_TIMER events.
+ */
+struct stopwatch_ioc_timer {
+	__u32 id;      // < STOPWATCH_TIMERS_MAX
+	__u32 flags;   // STOPWATCH_TIMER_ABS: absolute deadline, else relative
+	__u64 deadline_ns; // in; out (TIMER_ARM): absolute deadline
+};
+
+#define STOPWATCH_IOC_VERSION \
+	_IOR(STOPWATCH_IOC_MAGIC, 0, struct stopwatch_ioc_version)
+#define STOPWATCH_IOC_START \
+	_IOW(STOPWATCH_IOC_MAGIC, 1, struct stopwatch_ioc_cmd)
+#define STOPWATCH_IOC_PAUSE \
+	_IOW(STOPWATCH_IOC_MAGIC, 2, struct stopwatch_ioc_cmd)
+#define STOPWATCH_IOC_RESET \
+	_IOW(STOPWATCH_IOC_MAGIC, 3, struct stopwatch_ioc_cmd)
+#define STOPWATCH_IOC_TIMEOUT \
+	_IOW(STOPWATCH_IOC_MAGIC, 4, struct stopwatch_ioc_cmd)
+#define STOPWATCH_IOC_SNAPSHOT \
+	_IOWR(STOPWATCH_IOC_MAGIC, 5, struct stopwatch_ioc_snapshot)
+#define STOPWATCH_IOC_BATCH \
+	_IOWR(STOPWATCH_IOC_MAGIC, 6, struct stopwatch_ioc_batch)
+#define STOPWATCH_IOC_SUBSCRIBE \
+	_IOW(STOPWATCH_IOC_MAGIC, 7, __u64)   // bank mask, 0 to unsubscribe, since version 2
+#define STOPWATCH_IOC_SET_EVENTFD \
+	_IOW(STOPWATCH_IOC_MAGIC, 8, __s32)   // eventfd, -1 to unset, since version 2
+#define STOPWATCH_IOC_TIMER_ARM \
+	_IOWR(STOPWATCH_IOC_MAGIC, 9, struct stopwatch_ioc_timer) // since version 3
+#define STOPWATCH_IOC_TIMER_CANCEL \
+	_IOW(STOPWATCH_IOC_MAGIC, 10, struct stopwatch_ioc_timer) // since version 3
+#define STOPWATCH_IOC_LAP \
+	_IOW(STOPWATCH_IOC_MAGIC, 11, struct stopwatch_ioc_cmd) // since version 4
+#define STOPWATCH_IOC_STATS \
+	_IOWR(STOPWATCH_IOC_MAGIC, 12, struct stopwatch_ioc_stats) // since version 4
+#define STOPWATCH_IOC_PERIODIC \
+	_IOW(STOPWATCH_IOC_MAGIC, 13, struct stopwatch_ioc_cmd) // since version 6
+
+#endif /* STOPWATCH_IOCTL_H */
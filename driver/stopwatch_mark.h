@@ -0,0 +1,23 @@
+#ifndef STOPWATCH_MARK_H
+#define STOPWATCH_MARK_H
+
+/*
+ * Trace marks for the guest kernel, timestamped with the clock of the
+ * stopwatch device and recorded in its shared memory, see
+ * stopwatch_mark() in drivers/misc/stopwatch.c.
+ */
+
+#include <linux/kconfig.h>
+#include <linux/types.h>
+
+/*
+ * The driver defines STOPWATCH_MARK_EXPORT before the include when built
+ * out of tree, where CONFIG_STOPWATCH is not set.
+ */
+#if IS_ENABLED(CONFIG_STOPWATCH) || defined(STOPWATCH_MARK_EXPORT)
+void stopwatch_mark(u32 id, u64 arg);
+#else
+static inline void stopwatch_mark(u32 id, u64 arg) {}
+#endif
+
+#endif /* STOPWATCH_MARK_H */
@@ -0,0 +1,139 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM stopwatch
+
+#if !defined(STOPWATCH_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define STOPWATCH_TRACE_H
+
+/*
+ * Tracepoints of the stopwatch driver, disabled (static keys) until
+ * enabled in /sys/kernel/debug/tracing/events/stopwatch/.
+ */
+
+#include <linux/tracepoint.h>
+
+#include "stopwatch_ioctl.h"
+
+TRACE_DEFINE_ENUM(STOPWATCH_EVENT_TIMEOUT);
+TRACE_DEFINE_ENUM(STOPWATCH_EVENT_TIMER);
+
+/* register command, one trap */
+TRACE_EVENT(stopwatch_cmd,
+	TP_PROTO(const char *name, unsigned int bank, u64 cmd, u64 trap_ns),
+	TP_ARGS(name, bank, cmd, trap_ns),
+
+	TP_STRUCT__entry(
+		__string(name, name)
+		__field(unsigned int, bank)
+		__field(u64, cmd)
+		__field(u64, trap_ns)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->bank = bank;
+		__entry->cmd = cmd;
+		__entry->trap_ns = trap_ns;
+	),
+
+	TP_printk("%s.%u cmd=%llu trap=%lluns", __get_str(name), __entry->bank,
+			  __entry->cmd, __entry->trap_ns)
+);
+
+/* @n commands through the command ring, @errors failed */
+TRACE_EVENT(stopwatch_submit,
+	TP_PROTO(const char *name, unsigned int n, unsigned int errors, int ret),
+	TP_ARGS(name, n, errors, ret),
+
+	TP_STRUCT__entry(
+		__string(name, name)
+		__field(unsigned int, n)
+		__field(unsigned int, errors)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->n = n;
+		__entry->errors = errors;
+		__entry->ret = ret;
+	),
+
+	TP_printk("%s n=%u errors=%u ret=%d", __get_str(name), __entry->n,
+			  __entry->errors, __entry->ret)
+);
+
+/* stopwatch value computed from the time page, no trap */
+TRACE_EVENT(stopwatch_read,
+	TP_PROTO(const char *name, unsigned int bank, u64 value_ns),
+	TP_ARGS(name, bank, value_ns),
+
+	TP_STRUCT__entry(
+		__string(name, name)
+		__field(unsigned int, bank)
+		__field(u64, value_ns)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->bank = bank;
+		__entry->value_ns = value_ns;
+	),
+
+	TP_printk("%s.%u value=%lluns", __get_str(name), __entry->bank,
+			  __entry->value_ns)
+);
+
+TRACE_EVENT(stopwatch_irq,
+	TP_PROTO(const char *name, unsigned int line, u64 pending),
+	TP_ARGS(name, line, pending),
+
+	TP_STRUCT__entry(
+		__string(name, name)
+		__field(unsigned int, line)
+		__field(u64, pending)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->line = line;
+		__entry->pending = pending;
+	),
+
+	TP_printk("%s line=%u pending=0x%llx", __get_str(name), __entry->line,
+			  __entry->pending)
+);
+
+/* event posted to the subscribers, see struct stopwatch_event */
+TRACE_EVENT(stopwatch_event,
+	TP_PROTO(const char *name, u32 type, u32 index, u64 count),
+	TP_ARGS(name, type, index, count),
+
+	TP_STRUCT__entry(
+		__string(name, name)
+		__field(u32, type)
+		__field(u32, index)
+		__field(u64, count)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->type = type;
+		__entry->index = index;
+		__entry->count = count;
+	),
+
+	TP_printk("%s %s %u count=%llu", __get_str(name),
+			  __print_symbolic(__entry->type,
+							   { STOPWATCH_EVENT_TIMEOUT, "timeout" },
+							   { STOPWATCH_EVENT_TIMER, "timer" }),
+			  __entry->index, __entry->count)
+);
+
+#endif /* STOPWATCH_TRACE_H */
+
+/* the header is next to stopwatch.c, built with -I$(src) */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE stopwatch_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,58 @@
+#ifndef STOPWATCH_VIRTIO_H
+#define STOPWATCH_VIRTIO_H
+
+/*
+ * virtio transport of the stopwatch device (virtio-stopwatch-device,
+ * virtio-stopwatch-pci, and their vhost-user-stopwatch forms). Same
+ * commands and completions as the command ring of stopwatch_hw-sw.h,
+ * carried by virtqueues instead of the shared memory, which the
+ * transport does not have: the values come back in the completions.
+ *
+ * The fields are little-endian with VIRTIO_F_VERSION_1, in the guest
+ * endianness with legacy virtio-mmio.
+ */
+
+#include "stopwatch_hw-sw.h"
+
+/* outside of the range allocated by the virtio specification */
+#define VIRTIO_ID_STOPWATCH 63
+
+/*
+ * Command queue: each request is an array of struct StopWatch_cmd
+ * (device-readable), followed by as many struct StopWatch_cpl
+ * (device-writable). The device runs the commands in order and
+ * completes the request once, so a batch costs a single notification.
+ * The IRQ line of the commands (STOPWATCH_CMD_LINE()) must be 0.
+ */
+#define STOPWATCH_VIRTIO_CMDQ 0
+#define STOPWATCH_VIRTIO_CMDS_MAX 1024 // commands per request
+
+/*
+ * Event queue: the guest keeps it filled with device-writable buffers of
+ * one struct StopWatch_virtio_event. A bank timeout stays pending, and
+ * the bank busy, until the guest sends STOPWATCH_ACTION_TIMEOUT_ACK
+ * through the command queue. The timer expiries need no acknowledgment.
+ */
+#define STOPWATCH_VIRTIO_EVENTQ 1
+
+#define STOPWATCH_VIRTIO_QUEUES 2
+#define STOPWATCH_VIRTIO_QUEUE_SIZE 256
+
+enum {
+	STOPWATCH_VIRTIO_EVENT_TIMEOUT = 1, // timeout of bank 'index' expired
+	STOPWATCH_VIRTIO_EVENT_TIMER,       // timer 'index' of the timer engine
+};
+
+struct StopWatch_virtio_event {
+	uint32_t type;  // STOPWATCH_VIRTIO_EVENT_*
+	uint32_t index; // bank, or timer id
+	uint64_t deadline_ns; // TIMER: deadline of the timer
+	uint64_t expired_ns;  // device clock when the event was posted
+};
+
+struct StopWatch_virtio_config {
+	uint32_t banks;  // RO: number of stopwatch banks
+	uint32_t timers; // RO: number of timers, STOPWATCH_TIMERS_MAX
+};
+
+#endif /* STOPWATCH_VIRTIO_H */
@@ -0,0 +1,888 @@
+#include <linux/module.h>
+#include <linux/virtio.h>
+#include <linux/virtio_config.h>
+#include <linux/miscdevice.h>
+#include <linux/scatterlist.h>
+#include <linux/completion.h>
+#include <linux/workqueue.h>
+#include <linux/idr.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/kfifo.h>
+#include <linux/eventfd.h>
+#include <linux/kref.h>
+#include <linux/compat.h>
+
+#include "stopwatch_hw-sw.h"
+#include "stopwatch_ioctl.h"
+#include "stopwatch_virtio.h"
+
+/*
+ * Driver of the virtio transport of the stopwatch device (see
+ * stopwatch_virtio.h), with the ioctl interface of stopwatch.c on
+ * /dev/vstopwatch<N>. Without shared memory, there is no time page to
+ * read: SNAPSHOT, STATS and mmap() are not supported, and the register
+ * commands (STOPWATCH_IOC_CMD_REG) go through the command queue too.
+ */
+
+#define DRIVERNAME "vstopwatch"
+#define DRV_VERSION "0.0.1"
+
+/* dynamic debug, see Documentation/admin-guide/dynamic-debug-howto.rst */
+#define DEBUG_MSG(fmt, args...) pr_debug(DRIVERNAME ": " fmt "\n", ## args)
+
+struct vstopwatch_data {
+	int id;
+	char name[16];
+
+	/* the open files keep the data after vstopwatch_remove */
+	struct kref ref;
+
+	struct virtio_device *vdev;
+	struct miscdevice mdev;
+
+	unsigned int nb_banks;
+
+	/* requests in flight, completed by vstopwatch_cmdq_done */
+	struct virtqueue *cmdq;
+	spinlock_t cmdq_lock;
+	bool dead; /* under cmdq_lock, device removed */
+
+	/* one buffer per descriptor, always queued but while being read */
+	struct virtqueue *eventq;
+	struct StopWatch_virtio_event *events;
+	unsigned int nb_events;
+	bool removing; /* under event_lock, no more TIMEOUT_ACK */
+
+	/* bank timeouts to acknowledge, from process context (ack_work) */
+	unsigned long ack_pending;
+	struct work_struct ack_work;
+
+	u64 timeout_cnt[STOPWATCH_BANKS_MAX];
+	u64 timers_expired_cnt;
+
+	/* event subscribers (struct vstopwatch_file), see vstopwatch_post_event */
+	spinlock_t event_lock;
+	struct list_head event_files;
+	wait_queue_head_t event_wq;
+};
+
+/* per open file of /dev/vstopwatch<N> */
+#define STOPWATCH_FILE_EVENTS 128
+
+struct vstopwatch_file {
+	struct vstopwatch_data *sw;
+
+	/* events of the subscribed banks, protected by sw->event_lock */
+	struct list_head node;
+	u64 bank_mask;
+	DECLARE_KFIFO(events, struct stopwatch_event, STOPWATCH_FILE_EVENTS);
+	struct eventfd_ctx *eventfd;
+};
+
+/*
+ * Request of the command queue with its buffers, completed with the
+ * length written. A request abandoned by its submitter (signal, timeout)
+ * is freed when the device returns it.
+ */
+struct vstopwatch_req {
+	struct completion done;
+	unsigned int len;
+	bool abandoned; /* under cmdq_lock */
+	struct StopWatch_cpl *cpls; /* after the commands */
+	struct StopWatch_cmd cmds[];
+};
+
+#define VSTOPWATCH_CMD_TIMEOUT HZ
+
+static DEFINE_IDA(vstopwatch_ida);
+
+/* errno of a command completion, see stopwatch_errno */
+static int vstopwatch_errno(int64_t result)
+{
+	switch (-result) {
+	case STOPWATCH_OK:        return 0;
+	case STOPWATCH_ERR_STATE: return -EPERM;
+	case STOPWATCH_ERR_RANGE: return -ERANGE;
+	case STOPWATCH_ERR_BUSY:  return -EBUSY;
+	default:                  return -EINVAL;
+	}
+}
+
+static void vstopwatch_cmdq_done(struct virtqueue *vq)
+{
+	struct vstopwatch_data *sw = vq->vdev->priv;
+	struct vstopwatch_req *req;
+	unsigned long flags;
+	unsigned int len;
+
+	spin_lock_irqsave(&sw->cmdq_lock, flags);
+	do {
+		virtqueue_disable_cb(vq);
+		while ((req = virtqueue_get_buf(vq, &len))) {
+			if (req->abandoned) {
+				kfree(req);
+				continue;
+			}
+			req->len = len;
+			complete(&req->done);
+		}
+	} while (!virtqueue_enable_cb(vq));
+	spin_unlock_irqrestore(&sw->cmdq_lock, flags);
+}
+
+/*
+ * Run @n commands in one request of the command queue, and wait for
+ * their completions in @cpls. Returns -EINTR or -ETIMEDOUT if the wait
+ * was cut short, the commands may have run then.
+ */
+static int vstopwatch_submit(struct vstopwatch_data *sw,
+							 const struct StopWatch_cmd *cmds,
+							 struct StopWatch_cpl *cpls, unsigned int n)
+{
+	struct virtio_device *vdev = sw->vdev;
+	struct scatterlist out, in, *sgs[] = { &out, &in };
+	struct vstopwatch_req *req;
+	unsigned long flags;
+	unsigned int i;
+	long left;
+	int ret;
+
+	req = kmalloc(sizeof(*req) + n * (sizeof(*cmds) + sizeof(*cpls)),
+				  GFP_KERNEL);
+	if (!req)
+		return -ENOMEM;
+	req->cpls = (struct StopWatch_cpl *) &req->cmds[n];
+	req->len = 0;
+	req->abandoned = false;
+	init_completion(&req->done);
+
+	for (i = 0; i < n; i++) {
+		req->cmds[i].action = cpu_to_virtio16(vdev, cmds[i].action);
+		req->cmds[i].flags = cpu_to_virtio16(vdev, cmds[i].flags);
+		req->cmds[i].index = cpu_to_virtio32(vdev, cmds[i].index);
+		req->cmds[i].arg = cpu_to_virtio64(vdev, cmds[i].arg);
+		req->cmds[i].tag = cpu_to_virtio64(vdev, cmds[i].tag);
+	}
+
+	sg_init_one(&out, req->cmds, n * sizeof(*cmds));
+	sg_init_one(&in, req->cpls, n * sizeof(*cpls));
+
+	spin_lock_irqsave(&sw->cmdq_lock, flags);
+	if (sw->dead) {
+		ret = -ENODEV;
+	} else {
+		ret = virtqueue_add_sgs(sw->cmdq, sgs, 1, 1, req, GFP_ATOMIC);
+		if (!ret)
+			virtqueue_kick(sw->cmdq);
+	}
+	spin_unlock_irqrestore(&sw->cmdq_lock, flags);
+
+	if (ret) {
+		kfree(req);
+		return ret == -ENOSPC ? -EBUSY : ret;
+	}
+
+	left = wait_for_completion_interruptible_timeout(&req->done,
+													 VSTOPWATCH_CMD_TIMEOUT);
+	if (left <= 0) {
+		/* completed meanwhile, or left to vstopwatch_cmdq_done */
+		spin_lock_irqsave(&sw->cmdq_lock, flags);
+		req->abandoned = !completion_done(&req->done);
+		spin_unlock_irqrestore(&sw->cmdq_lock, flags);
+
+		if (req->abandoned) {
+			if (!left)
+				pr_err(DRIVERNAME ": %s: command queue stuck\n", sw->name);
+			return left ? -EINTR : -ETIMEDOUT;
+		}
+	}
+
+	/* invalid request (see virtio_stopwatch_handle_cmdq), or removed */
+	if (req->len < n * sizeof(*cpls)) {
+		ret = READ_ONCE(sw->dead) ? -ENODEV : -EIO;
+		goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		cpls[i].tag = virtio64_to_cpu(vdev, req->cpls[i].tag);
+		cpls[i].result = virtio64_to_cpu(vdev, req->cpls[i].result);
+		cpls[i].value = virtio64_to_cpu(vdev, req->cpls[i].value);
+	}
+
+  out:
+	kfree(req);
+	return ret;
+}
+
+/* Commands address a bank, except the timer engine ones (timer id) */
+static bool vstopwatch_op_valid(struct vstopwatch_data *sw, uint16_t action,
+								uint32_t index, uint16_t flags)
+{
+	switch (action) {
+	case STOPWATCH_ACTION_TIMER_ARM:
+		return index < STOPWATCH_TIMERS_MAX && !(flags & ~STOPWATCH_TIMER_ABS);
+	case STOPWATCH_ACTION_TIMER_CANCEL:
+		return index < STOPWATCH_TIMERS_MAX && !flags;
+	default:
+		return index < sw->nb_banks && !flags;
+	}
+}
+
+/* Single command, through the command queue */
+static int vstopwatch_exec(struct vstopwatch_data *sw, uint16_t action,
+						   uint32_t index, uint16_t flags, uint64_t arg,
+						   uint64_t *value)
+{
+	struct StopWatch_cmd cmd = {
+		.action = action,
+		.flags = flags,
+		.index = index,
+		.arg = arg,
+	};
+	struct StopWatch_cpl cpl;
+	int ret;
+
+	if (!vstopwatch_op_valid(sw, action, index, flags))
+		return -EINVAL;
+
+	ret = vstopwatch_submit(sw, &cmd, &cpl, 1);
+	if (!ret) {
+		ret = vstopwatch_errno(cpl.result);
+		if (value)
+			*value = cpl.value;
+	}
+
+	return ret;
+}
+
+/* Acknowledge the bank timeouts received, in one request */
+static void vstopwatch_ack_work(struct work_struct *work)
+{
+	struct vstopwatch_data *sw =
+		container_of(work, struct vstopwatch_data, ack_work);
+	unsigned long pending = xchg(&sw->ack_pending, 0);
+	struct StopWatch_cmd *cmds;
+	struct StopWatch_cpl *cpls;
+	unsigned int n = 0;
+	int i;
+
+	if (!pending)
+		return;
+
+	cmds = kcalloc(STOPWATCH_BANKS_MAX, sizeof(*cmds), GFP_KERNEL);
+	cpls = kcalloc(STOPWATCH_BANKS_MAX, sizeof(*cpls), GFP_KERNEL);
+	if (!cmds || !cpls) {
+		/* the banks stay busy: STOPWATCH_ERR_BUSY on their next TIMEOUT */
+		pr_err(DRIVERNAME ": %s: cannot acknowledge the timeouts\n",
+			   sw->name);
+		goto out;
+	}
+
+	for_each_set_bit(i, &pending, sw->nb_banks) {
+		cmds[n].action = STOPWATCH_ACTION_TIMEOUT_ACK;
+		cmds[n].index = i;
+		n++;
+	}
+
+	if (vstopwatch_submit(sw, cmds, cpls, n))
+		pr_err(DRIVERNAME ": %s: timeout acknowledgment failed\n", sw->name);
+
+  out:
+	kfree(cpls);
+	kfree(cmds);
+}
+
+/* Queue @ev to the files subscribed to its bank, see stopwatch_post_event */
+static void vstopwatch_post_event(struct vstopwatch_data *sw,
+								  const struct stopwatch_event *ev)
+{
+	struct vstopwatch_file *file;
+	u64 bit = ev->type == STOPWATCH_EVENT_TIMER ?
+		STOPWATCH_SUBSCRIBE_TIMERS : BIT_ULL(ev->index);
+
+	list_for_each_entry(file, &sw->event_files, node) {
+		if (!(file->bank_mask & bit))
+			continue;
+
+		/* when the reader lags behind, gaps show in ev->count */
+		kfifo_put(&file->events, *ev);
+
+		if (file->eventfd)
+			eventfd_signal(file->eventfd, 1);
+	}
+}
+
+static void vstopwatch_add_event_buf(struct vstopwatch_data *sw,
+									 struct StopWatch_virtio_event *buf)
+{
+	struct scatterlist sg;
+
+	sg_init_one(&sg, buf, sizeof(*buf));
+	virtqueue_add_inbuf(sw->eventq, &sg, 1, buf, GFP_ATOMIC);
+}
+
+/*
+ * Deliver the events of the device, and give the buffers back in bulk:
+ * a single kick for all the events handled.
+ */
+static void vstopwatch_eventq_done(struct virtqueue *vq)
+{
+	struct vstopwatch_data *sw = vq->vdev->priv;
+	struct virtio_device *vdev = sw->vdev;
+	struct StopWatch_virtio_event *buf;
+	struct stopwatch_event ev;
+	unsigned long flags;
+	unsigned int len;
+	bool ack = false, posted = false;
+
+	spin_lock_irqsave(&sw->event_lock, flags);
+	do {
+		virtqueue_disable_cb(vq);
+		while ((buf = virtqueue_get_buf(vq, &len))) {
+			u32 type = virtio32_to_cpu(vdev, buf->type);
+			u32 index = virtio32_to_cpu(vdev, buf->index);
+
+			ev.type = 0;
+			if (len < sizeof(*buf)) {
+				/* nothing to deliver */
+			} else if (type == STOPWATCH_VIRTIO_EVENT_TIMEOUT
+					   && index < sw->nb_banks) {
+				ev.type = STOPWATCH_EVENT_TIMEOUT;
+				ev.count = ++sw->timeout_cnt[index];
+				set_bit(index, &sw->ack_pending);
+				ack = true;
+			} else if (type == STOPWATCH_VIRTIO_EVENT_TIMER) {
+				ev.type = STOPWATCH_EVENT_TIMER;
+				ev.count = ++sw->timers_expired_cnt;
+			}
+
+			if (ev.type) {
+				ev.index = index;
+				ev.timestamp_ns = virtio64_to_cpu(vdev, buf->expired_ns);
+				vstopwatch_post_event(sw, &ev);
+				posted = true;
+			}
+
+			vstopwatch_add_event_buf(sw, buf);
+		}
+	} while (!virtqueue_enable_cb(vq));
+
+	virtqueue_kick(vq);
+
+	if (ack && !sw->removing)
+		schedule_work(&sw->ack_work);
+	spin_unlock_irqrestore(&sw->event_lock, flags);
+
+	if (posted)
+		wake_up_interruptible(&sw->event_wq);
+}
+
+/*****************************************/
+/* Char device functions and structures */
+/*****************************************/
+
+static void vstopwatch_free(struct kref *ref)
+{
+	struct vstopwatch_data *sw = container_of(ref, struct vstopwatch_data,
+											  ref);
+
+	put_device(&sw->vdev->dev);
+	kfree(sw->events);
+	kfree(sw);
+}
+
+static int vstopwatch_open(struct inode *inode, struct file *filp)
+{
+	struct vstopwatch_data *sw =
+		container_of(filp->private_data, struct vstopwatch_data, mdev);
+	struct vstopwatch_file *file;
+
+	file = kzalloc(sizeof(*file), GFP_KERNEL);
+	if (!file)
+		return -ENOMEM;
+
+	/* misc_deregister waits for the open in progress */
+	kref_get(&sw->ref);
+
+	file->sw = sw;
+	INIT_LIST_HEAD(&file->node);
+	INIT_KFIFO(file->events);
+
+	filp->private_data = file;
+
+	return 0;
+}
+
+static int vstopwatch_release(struct inode *inode, struct file *filp)
+{
+	struct vstopwatch_file *file = filp->private_data;
+	struct vstopwatch_data *sw = file->sw;
+
+	spin_lock_irq(&sw->event_lock);
+	list_del(&file->node);
+	spin_unlock_irq(&sw->event_lock);
+
+	if (file->eventfd)
+		eventfd_ctx_put(file->eventfd);
+	kfree(file);
+
+	kref_put(&sw->ref, vstopwatch_free);
+
+	return 0;
+}
+
+/* see stopwatch_ioctl_batch: one request of the command queue */
+static long vstopwatch_ioctl_batch(struct vstopwatch_data *sw,
+								   void __user *argp)
+{
+	struct stopwatch_ioc_batch batch;
+	struct stopwatch_ioc_op *ops = NULL;
+	struct stopwatch_ioc_result *results = NULL;
+	struct StopWatch_cmd *cmds = NULL;
+	struct StopWatch_cpl *cpls = NULL;
+	unsigned int i;
+	long ret;
+
+	if (copy_from_user(&batch, argp, sizeof(batch)))
+		return -EFAULT;
+
+	if (batch.count == 0)
+		return 0;
+	if (batch.count > STOPWATCH_BATCH_MAX || batch.flags)
+		return -EINVAL;
+
+	ops = memdup_user(u64_to_user_ptr(batch.ops),
+					  batch.count * sizeof(*ops));
+	if (IS_ERR(ops))
+		return PTR_ERR(ops);
+
+	results = kcalloc(batch.count, sizeof(*results), GFP_KERNEL);
+	cmds = kcalloc(batch.count, sizeof(*cmds), GFP_KERNEL);
+	cpls = kcalloc(batch.count, sizeof(*cpls), GFP_KERNEL);
+	if (!results || !cmds || !cpls) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < batch.count; i++) {
+		if (!vstopwatch_op_valid(sw, ops[i].action, ops[i].bank,
+								 ops[i].flags)) {
+			ret = -EINVAL;
+			goto out;
+		}
+		cmds[i].action = ops[i].action;
+		cmds[i].flags = ops[i].flags;
+		cmds[i].index = ops[i].bank;
+		cmds[i].arg = ops[i].arg;
+		cmds[i].tag = i;
+	}
+
+	ret = vstopwatch_submit(sw, cmds, cpls, batch.count);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < batch.count; i++) {
+		results[i].error = vstopwatch_errno(cpls[i].result);
+		results[i].value_ns = cpls[i].value;
+	}
+
+	if (copy_to_user(u64_to_user_ptr(batch.results), results,
+					 batch.count * sizeof(*results)))
+		ret = -EFAULT;
+
+  out:
+	kfree(cpls);
+	kfree(cmds);
+	kfree(results);
+	kfree(ops);
+
+	return ret;
+}
+
+static long vstopwatch_ioctl_timer(struct vstopwatch_data *sw,
+								   unsigned int cmd, void __user *argp)
+{
+	struct stopwatch_ioc_timer timer;
+	uint16_t action;
+	u64 deadline;
+	long ret;
+
+	if (copy_from_user(&timer, argp, sizeof(timer)))
+		return -EFAULT;
+
+	if (timer.flags > U16_MAX)
+		return -EINVAL;
+
+	action = cmd == STOPWATCH_IOC_TIMER_ARM ?
+		STOPWATCH_ACTION_TIMER_ARM : STOPWATCH_ACTION_TIMER_CANCEL;
+
+	ret = vstopwatch_exec(sw, action, timer.id, timer.flags,
+						  timer.deadline_ns, &deadline);
+	if (ret || cmd != STOPWATCH_IOC_TIMER_ARM)
+		return ret;
+
+	timer.deadline_ns = deadline;
+
+	return copy_to_user(argp, &timer, sizeof(timer)) ? -EFAULT : 0;
+}
+
+static long vstopwatch_ioctl_subscribe(struct vstopwatch_file *file,
+									   u64 __user *argp)
+{
+	struct vstopwatch_data *sw = file->sw;
+	u64 mask;
+
+	if (get_user(mask, argp))
+		return -EFAULT;
+
+	if (mask & ~(GENMASK_ULL(sw->nb_banks - 1, 0) | STOPWATCH_SUBSCRIBE_TIMERS))
+		return -EINVAL;
+
+	spin_lock_irq(&sw->event_lock);
+	file->bank_mask = mask;
+	list_del_init(&file->node);
+	if (mask)
+		list_add_tail(&file->node, &sw->event_files);
+	spin_unlock_irq(&sw->event_lock);
+
+	return 0;
+}
+
+static long vstopwatch_ioctl_set_eventfd(struct vstopwatch_file *file,
+										 s32 __user *argp)
+{
+	struct vstopwatch_data *sw = file->sw;
+	struct eventfd_ctx *eventfd = NULL, *old;
+	s32 fd;
+
+	if (get_user(fd, argp))
+		return -EFAULT;
+
+	if (fd >= 0) {
+		eventfd = eventfd_ctx_fdget(fd);
+		if (IS_ERR(eventfd))
+			return PTR_ERR(eventfd);
+	}
+
+	spin_lock_irq(&sw->event_lock);
+	old = file->eventfd;
+	file->eventfd = eventfd;
+	spin_unlock_irq(&sw->event_lock);
+
+	if (old)
+		eventfd_ctx_put(old);
+
+	return 0;
+}
+
+static long vstopwatch_ioctl(struct file *filp, unsigned int cmd,
+							 unsigned long arg)
+{
+	struct vstopwatch_file *file = filp->private_data;
+	struct vstopwatch_data *sw = file->sw;
+	void __user *argp = (void __user *) arg;
+	struct stopwatch_ioc_version version;
+	struct stopwatch_ioc_cmd ioc;
+
+	switch (cmd) {
+	case STOPWATCH_IOC_VERSION:
+		version.version = STOPWATCH_IOCTL_VERSION;
+		version.banks = sw->nb_banks;
+
+		return copy_to_user(argp, &version, sizeof(version)) ? -EFAULT : 0;
+	case STOPWATCH_IOC_START:
+	case STOPWATCH_IOC_PAUSE:
+	case STOPWATCH_IOC_RESET:
+	case STOPWATCH_IOC_TIMEOUT:
+	case STOPWATCH_IOC_PERIODIC:
+	case STOPWATCH_IOC_LAP:
+		if (copy_from_user(&ioc, argp, sizeof(ioc)))
+			return -EFAULT;
+		/* STOPWATCH_IOC_CMD_REG is accepted, there is no register */
+		if (ioc.flags & ~STOPWATCH_IOC_CMD_REG ||
+			(ioc.flags && (cmd == STOPWATCH_IOC_TIMEOUT ||
+						   cmd == STOPWATCH_IOC_PERIODIC)))
+			return -EINVAL;
+		break;
+	case STOPWATCH_IOC_BATCH:
+		return vstopwatch_ioctl_batch(sw, argp);
+	case STOPWATCH_IOC_TIMER_ARM:
+	case STOPWATCH_IOC_TIMER_CANCEL:
+		return vstopwatch_ioctl_timer(sw, cmd, argp);
+	case STOPWATCH_IOC_SUBSCRIBE:
+		return vstopwatch_ioctl_subscribe(file, argp);
+	case STOPWATCH_IOC_SET_EVENTFD:
+		return vstopwatch_ioctl_set_eventfd(file, argp);
+	case STOPWATCH_IOC_SNAPSHOT:
+	case STOPWATCH_IOC_STATS:
+		return -EOPNOTSUPP; /* no time page nor lap statistics */
+	default:
+		return -ENOTTY;
+	}
+
+	switch (cmd) {
+	case STOPWATCH_IOC_START:
+		return vstopwatch_exec(sw, STOPWATCH_ACTION_START, ioc.bank, 0, 0,
+							   NULL);
+	case STOPWATCH_IOC_PAUSE:
+		return vstopwatch_exec(sw, STOPWATCH_ACTION_PAUSE, ioc.bank, 0, 0,
+							   NULL);
+	case STOPWATCH_IOC_RESET:
+		return vstopwatch_exec(sw, STOPWATCH_ACTION_RESET, ioc.bank, 0, 0,
+							   NULL);
+	case STOPWATCH_IOC_LAP:
+		return vstopwatch_exec(sw, STOPWATCH_ACTION_LAP, ioc.bank, 0, 0,
+							   NULL);
+	case STOPWATCH_IOC_PERIODIC:
+		/* no shared memory: the event count is the number of IRQs */
+		return vstopwatch_exec(sw, STOPWATCH_ACTION_PERIODIC, ioc.bank, 0,
+							   ioc.arg, NULL);
+	default: /* STOPWATCH_IOC_TIMEOUT */
+		return vstopwatch_exec(sw, STOPWATCH_ACTION_TIMEOUT, ioc.bank, 0,
+							   ioc.arg, NULL);
+	}
+}
+
+/* read() of the events, see stopwatch_misc_read. EOF without subscription. */
+static ssize_t vstopwatch_read(struct file *filp, char __user *buf,
+							   size_t count, loff_t *offset)
+{
+	struct vstopwatch_file *file = filp->private_data;
+	struct vstopwatch_data *sw = file->sw;
+	struct stopwatch_event ev;
+	size_t done = 0;
+	int ret;
+
+	if (!file->bank_mask)
+		return 0;
+
+	if (count < sizeof(ev))
+		return -EINVAL;
+
+	while (done + sizeof(ev) <= count) {
+		spin_lock_irq(&sw->event_lock);
+		ret = kfifo_get(&file->events, &ev);
+		spin_unlock_irq(&sw->event_lock);
+
+		if (!ret) {
+			if (done)
+				break;
+			if (filp->f_flags & O_NONBLOCK)
+				return -EAGAIN;
+
+			ret = wait_event_interruptible(sw->event_wq,
+										   !kfifo_is_empty(&file->events) ||
+										   READ_ONCE(sw->removing));
+			if (ret)
+				return ret;
+			if (kfifo_is_empty(&file->events))
+				return -ENODEV;
+			continue;
+		}
+
+		if (copy_to_user(buf + done, &ev, sizeof(ev)))
+			return -EFAULT;
+		done += sizeof(ev);
+	}
+
+	return done;
+}
+
+static __poll_t vstopwatch_poll(struct file *filp, poll_table *wait)
+{
+	struct vstopwatch_file *file = filp->private_data;
+
+	if (!file->bank_mask) /* EOF */
+		return EPOLLIN | EPOLLRDNORM;
+
+	poll_wait(filp, &file->sw->event_wq, wait);
+
+	if (!kfifo_is_empty(&file->events))
+		return EPOLLIN | EPOLLRDNORM;
+
+	return READ_ONCE(file->sw->removing) ? EPOLLHUP | EPOLLERR : 0;
+}
+
+#ifdef CONFIG_COMPAT
+/* see stopwatch_compat_ioctl */
+static long vstopwatch_compat_ioctl(struct file *filp, unsigned int cmd,
+									unsigned long arg)
+{
+	return vstopwatch_ioctl(filp, cmd, (unsigned long) compat_ptr(arg));
+}
+#endif
+
+static const struct file_operations vstopwatch_fops = {
+	.owner      = THIS_MODULE,
+	.open       = vstopwatch_open,
+	.read       = vstopwatch_read,
+	.poll       = vstopwatch_poll,
+	.release    = vstopwatch_release,
+	.unlocked_ioctl = vstopwatch_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl   = vstopwatch_compat_ioctl,
+#endif
+	.llseek     = no_llseek,
+};
+
+/*****************************************/
+/* virtio driver */
+/*****************************************/
+
+static int vstopwatch_probe(struct virtio_device *vdev)
+{
+	vq_callback_t *callbacks[] = { vstopwatch_cmdq_done,
+								   vstopwatch_eventq_done };
+	static const char * const names[] = { "cmdq", "eventq" };
+	struct virtqueue *vqs[STOPWATCH_VIRTIO_QUEUES];
+	struct vstopwatch_data *sw;
+	unsigned long flags;
+	unsigned int i;
+	int ret;
+
+	sw = kzalloc(sizeof(*sw), GFP_KERNEL);
+	if (!sw)
+		return -ENOMEM;
+
+	sw->vdev = vdev;
+	vdev->priv = sw;
+	kref_init(&sw->ref);
+	spin_lock_init(&sw->cmdq_lock);
+	spin_lock_init(&sw->event_lock);
+	INIT_LIST_HEAD(&sw->event_files);
+	init_waitqueue_head(&sw->event_wq);
+	INIT_WORK(&sw->ack_work, vstopwatch_ack_work);
+
+	virtio_cread(vdev, struct StopWatch_virtio_config, banks, &sw->nb_banks);
+	if (sw->nb_banks == 0 || sw->nb_banks > STOPWATCH_BANKS_MAX) {
+		pr_err(DRIVERNAME ": invalid number of banks (%u)\n", sw->nb_banks);
+		ret = -EINVAL;
+		goto fail_free;
+	}
+
+	ret = virtio_find_vqs(vdev, STOPWATCH_VIRTIO_QUEUES, vqs, callbacks,
+						  names, NULL);
+	if (ret)
+		goto fail_free;
+	sw->cmdq = vqs[STOPWATCH_VIRTIO_CMDQ];
+	sw->eventq = vqs[STOPWATCH_VIRTIO_EVENTQ];
+
+	sw->nb_events = virtqueue_get_vring_size(sw->eventq);
+	sw->events = kcalloc(sw->nb_events, sizeof(*sw->events), GFP_KERNEL);
+	if (!sw->events) {
+		ret = -ENOMEM;
+		goto fail_vqs;
+	}
+
+	sw->id = ida_simple_get(&vstopwatch_ida, 0, 0, GFP_KERNEL);
+	if (sw->id < 0) {
+		ret = sw->id;
+		goto fail_events;
+	}
+	snprintf(sw->name, sizeof(sw->name), DRIVERNAME "%d", sw->id);
+
+	virtio_device_ready(vdev);
+
+	/* the device posts the pending events once the buffers are there */
+	spin_lock_irqsave(&sw->event_lock, flags);
+	for (i = 0; i < sw->nb_events; i++)
+		vstopwatch_add_event_buf(sw, &sw->events[i]);
+	virtqueue_kick(sw->eventq);
+	spin_unlock_irqrestore(&sw->event_lock, flags);
+
+	sw->mdev.minor = MISC_DYNAMIC_MINOR;
+	sw->mdev.name = sw->name;
+	sw->mdev.fops = &vstopwatch_fops;
+	sw->mdev.parent = &vdev->dev;
+	ret = misc_register(&sw->mdev);
+	if (ret) {
+		pr_err(DRIVERNAME ": unable to register misc device\n");
+		goto fail_reset;
+	}
+
+	/* the byte order of the commands, after vstopwatch_remove */
+	get_device(&vdev->dev);
+
+	DEBUG_MSG("Registered virtio stopwatch %s (%u banks)", sw->name,
+			  sw->nb_banks);
+
+	return 0;
+
+  fail_reset:
+	vdev->config->reset(vdev);
+	ida_simple_remove(&vstopwatch_ida, sw->id);
+  fail_events:
+	kfree(sw->events);
+  fail_vqs:
+	vdev->config->del_vqs(vdev);
+  fail_free:
+	kfree(sw);
+	return ret;
+}
+
+/*
+ * The files still open keep the data: their commands fail with -ENODEV
+ * and their reads return -ENODEV once the events are consumed.
+ */
+static void vstopwatch_remove(struct virtio_device *vdev)
+{
+	struct vstopwatch_data *sw = vdev->priv;
+	struct vstopwatch_req *req;
+
+	misc_deregister(&sw->mdev);
+
+	/* the acknowledgments wait for the device, before its reset */
+	spin_lock_irq(&sw->event_lock);
+	sw->removing = true;
+	spin_unlock_irq(&sw->event_lock);
+	cancel_work_sync(&sw->ack_work);
+	wake_up_interruptible(&sw->event_wq);
+
+	spin_lock_irq(&sw->cmdq_lock);
+	sw->dead = true;
+	spin_unlock_irq(&sw->cmdq_lock);
+
+	vdev->config->reset(vdev);
+
+	/* the requests in flight complete with nothing written */
+	spin_lock_irq(&sw->cmdq_lock);
+	while ((req = virtqueue_detach_unused_buf(sw->cmdq))) {
+		if (req->abandoned) {
+			kfree(req);
+			continue;
+		}
+		complete(&req->done);
+	}
+	spin_unlock_irq(&sw->cmdq_lock);
+
+	vdev->config->del_vqs(vdev);
+
+	ida_simple_remove(&vstopwatch_ida, sw->id);
+	kref_put(&sw->ref, vstopwatch_free);
+}
+
+static const struct virtio_device_id vstopwatch_id_table[] = {
+	{ VIRTIO_ID_STOPWATCH, VIRTIO_DEV_ANY_ID },
+	{ 0 },
+};
+
+static struct virtio_driver vstopwatch_driver = {
+	.driver.name  = DRIVERNAME,
+	.driver.owner = THIS_MODULE,
+	.id_table     = vstopwatch_id_table,
+	.probe        = vstopwatch_probe,
+	.remove       = vstopwatch_remove,
+};
+
+module_virtio_driver(vstopwatch_driver);
+MODULE_DEVICE_TABLE(virtio, vstopwatch_id_table);
+
+MODULE_AUTHOR("Kevin Pouget <blog.qemu_stopwatch@972.ovh>");
+MODULE_DESCRIPTION("Stopwatch guest driver, virtio transport (Qemu virtual device)");
+MODULE_VERSION(DRV_VERSION);
+MODULE_LICENSE("GPL v2");
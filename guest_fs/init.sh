@@ -6,7 +6,20 @@ if cat /proc/cmdline | grep -q "stopwatch=test"; then
     RET=$?
 fi
 
-if cat /proc/cmdline | grep -q "stopwatch=test_and_quit"; then
+if cat /proc/cmdline | grep -q "stopwatch=bench"; then
+    echo "Running stopwatch_bench (CSV)"
+    # stress with one thread per vCPU, up to all of them
+    stopwatch_bench -t $(grep -c ^processor /proc/cpuinfo)
+    RET=$?
+
+    if [ "$(cat /sys/module/stopwatch/parameters/clock 2>/dev/null)" = "Y" ]; then
+        # the stopwatch clocksource against the arch timer
+        stopwatch_bench -H -C arch_sys_counter,stopwatch0 clock-read clock-sleep \
+            || RET=$?
+    fi
+fi
+
+if cat /proc/cmdline | grep -q "stopwatch=[a-z]*_and_quit"; then
     echo "Bye bye! (return code: $RET)"
     echo o > /proc/sysrq-trigger
 fi
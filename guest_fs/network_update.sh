@@ -8,12 +8,6 @@ stopwatch_test() {
     chmod u+x stopwatch_test.sh
 }
 
-stopwatch_ctrl() {
-    rm -f /guest_fs/stopwatch_ctrl.sh
-    wget $HTTP_SERVER/guest_fs/stopwatch_ctrl.sh
-    chmod u+x stopwatch_ctrl.sh
-}
-
 stopwatch_module() {
     rmmod stopwatch
     rm -f stopwatch.ko
@@ -21,7 +15,7 @@ stopwatch_module() {
     insmod stopwatch.ko
 }
 
-ACTIONS="stopwatch_test stopwatch_ctrl stopwatch_module"
+ACTIONS="stopwatch_test stopwatch_module"
 
 help() {
     echo "Possible actions for script '$(basename $0)':"
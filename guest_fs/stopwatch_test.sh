@@ -2,34 +2,32 @@
 
 set -ex
 
-CMD="/guest_fs/stopwatch_ctrl.sh"
+CMD="stopwatch"
 
-$CMD reset
-$CMD start
-sleep 1
-$CMD pause
-RES_1=$($CMD show)
+RES_1=$($CMD reset start sleep 1s pause read)
 
-$CMD start
+RES_3=$($CMD start timeout 1s wait 2s timeout 1s wait 2s)
+RES_2=$($CMD read)
 
-$CMD timeout 1
-sleep 2
-$CMD timeout 1
-sleep 2
-RES_2=$($CMD show)
-RES_3=$($CMD timeout)
-
-$CMD reset
-RES_4=$($CMD show)
+RES_4=$($CMD reset read)
 set +x
 
 cat <<EOF
 
 Results:
 1) after 1s: $RES_1
-2) after 5s: $RES_2
-3) after irq: $RES_3
+2) after 2 timeouts: $RES_2
+3) timeout events:
+$RES_3
 4) after reset: $RES_4
 EOF
 
+$CMD -l -r 1000 -f - <<EOF
+reset
+start
+read
+lap
+pause
+EOF
+
 exit 0
@@ -0,0 +1,399 @@
+/*
+ * libstopwatch, see libstopwatch.h. Statically linked into the tools of
+ * the rootfs: no dependency besides the libc.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libstopwatch.h"
+
+struct stopwatch {
+	int fd;
+	unsigned int bank;
+	unsigned int banks;
+	uint32_t cmd_flags; /* STOPWATCH_IOC_CMD_REG if the driver has it */
+	int subscribed;
+
+	struct StopWatch_mem *mem; /* NULL: STOPWATCH_IOC_SNAPSHOT instead */
+	size_t mem_size;
+
+	struct StopWatch_shared *shared; /* mapped on first use */
+	unsigned int slots;
+	uint64_t owner; /* id of the process, see struct StopWatch_shared */
+};
+
+struct stopwatch *stopwatch_open(const char *device, unsigned int bank)
+{
+	struct stopwatch_ioc_version version;
+	long page = sysconf(_SC_PAGESIZE);
+	struct stopwatch *sw;
+	int err;
+
+	sw = calloc(1, sizeof(*sw));
+	if (!sw)
+		return NULL;
+
+	sw->fd = open(device ? device : STOPWATCH_DEFAULT_DEVICE, O_RDWR);
+	if (sw->fd < 0)
+		goto fail;
+
+	if (ioctl(sw->fd, STOPWATCH_IOC_VERSION, &version))
+		goto fail_close;
+	if (bank >= version.banks) {
+		errno = EINVAL;
+		goto fail_close;
+	}
+	sw->bank = bank;
+	sw->banks = version.banks;
+	sw->cmd_flags = version.version >= 5 ? STOPWATCH_IOC_CMD_REG : 0;
+
+	/* the ioctl snapshot is the fallback, e.g. for the virtio driver */
+	sw->mem_size = (sizeof(struct StopWatch_mem) + page - 1) & ~(page - 1);
+	sw->mem = mmap(NULL, sw->mem_size, PROT_READ, MAP_SHARED, sw->fd, 0);
+	if (sw->mem == MAP_FAILED)
+		sw->mem = NULL;
+
+	return sw;
+
+  fail_close:
+	err = errno;
+	close(sw->fd);
+	errno = err;
+  fail:
+	free(sw);
+	return NULL;
+}
+
+void stopwatch_close(struct stopwatch *sw)
+{
+	if (sw->shared)
+		munmap(sw->shared, sw->mem->shared_size);
+	if (sw->mem)
+		munmap(sw->mem, sw->mem_size);
+	close(sw->fd);
+	free(sw);
+}
+
+unsigned int stopwatch_banks(const struct stopwatch *sw)
+{
+	return sw->banks;
+}
+
+static int stopwatch_cmd(struct stopwatch *sw, unsigned long request,
+						 uint32_t flags, uint64_t arg)
+{
+	struct stopwatch_ioc_cmd cmd = {
+		.bank = sw->bank,
+		.flags = flags,
+		.arg = arg,
+	};
+
+	return ioctl(sw->fd, request, &cmd);
+}
+
+int stopwatch_start(struct stopwatch *sw)
+{
+	return stopwatch_cmd(sw, STOPWATCH_IOC_START, sw->cmd_flags, 0);
+}
+
+int stopwatch_pause(struct stopwatch *sw)
+{
+	return stopwatch_cmd(sw, STOPWATCH_IOC_PAUSE, sw->cmd_flags, 0);
+}
+
+int stopwatch_reset(struct stopwatch *sw)
+{
+	return stopwatch_cmd(sw, STOPWATCH_IOC_RESET, sw->cmd_flags, 0);
+}
+
+int stopwatch_lap(struct stopwatch *sw)
+{
+	return stopwatch_cmd(sw, STOPWATCH_IOC_LAP, sw->cmd_flags, 0);
+}
+
+/* device clock, from the guest clock and the offset of the driver */
+static uint64_t stopwatch_now_ns(struct stopwatch *sw)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec
+		+ __atomic_load_n(&sw->mem->clock_offset_ns, __ATOMIC_RELAXED);
+}
+
+/* a time page, under its sequence counter, and the guest clock */
+static void stopwatch_read_time(struct stopwatch *sw,
+								const struct StopWatch_time *t,
+								uint64_t *value_ns, uint32_t *status)
+{
+	uint64_t started_at_ns, total_ns, now;
+	uint32_t seq, st;
+
+	do {
+		seq = __atomic_load_n(&t->seq, __ATOMIC_ACQUIRE);
+		st = t->status;
+		started_at_ns = t->started_at_ns;
+		total_ns = t->total_ns;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n(&t->seq, __ATOMIC_RELAXED));
+
+	*value_ns = total_ns;
+	if (st == STOPWATCH_STATE_RUNNING) {
+		now = stopwatch_now_ns(sw);
+		if (now > started_at_ns)
+			*value_ns += now - started_at_ns;
+	}
+	if (status)
+		*status = st;
+}
+
+int stopwatch_read(struct stopwatch *sw, uint64_t *value_ns, uint32_t *status)
+{
+	struct stopwatch_ioc_snapshot snap = { .bank = sw->bank };
+
+	if (sw->mem) {
+		stopwatch_read_time(sw, &sw->mem->time[sw->bank], value_ns, status);
+		return 0;
+	}
+
+	if (ioctl(sw->fd, STOPWATCH_IOC_SNAPSHOT, &snap))
+		return -1;
+
+	*value_ns = snap.value_ns;
+	if (status)
+		*status = snap.status;
+
+	return 0;
+}
+
+static int stopwatch_subscribe(struct stopwatch *sw)
+{
+	uint64_t mask = 1ULL << sw->bank;
+
+	if (sw->subscribed)
+		return 0;
+	if (ioctl(sw->fd, STOPWATCH_IOC_SUBSCRIBE, &mask))
+		return -1;
+	sw->subscribed = 1;
+
+	return 0;
+}
+
+int stopwatch_timeout(struct stopwatch *sw, uint64_t timeout_ns)
+{
+	if (stopwatch_subscribe(sw))
+		return -1;
+
+	return stopwatch_cmd(sw, STOPWATCH_IOC_TIMEOUT, 0, timeout_ns);
+}
+
+int stopwatch_wait(struct stopwatch *sw, struct stopwatch_event *ev,
+				   int timeout_ms)
+{
+	struct pollfd pfd = { .fd = sw->fd, .events = POLLIN };
+	ssize_t len;
+	int ret;
+
+	if (stopwatch_subscribe(sw))
+		return -1;
+
+	do {
+		ret = poll(&pfd, 1, timeout_ms);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -1;
+	if (!ret) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
+	/* one event per call, the others stay queued in the driver */
+	len = read(sw->fd, ev, sizeof(*ev));
+	if (len < 0)
+		return -1;
+	if (len != sizeof(*ev)) {
+		errno = EIO;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* the shared memory, once set up by the first device, see hw-sw.h */
+static int stopwatch_shared_map(struct stopwatch *sw)
+{
+	void *shared;
+
+	if (sw->shared)
+		return 0;
+	if (!sw->mem || !sw->mem->shared_size) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	shared = mmap(NULL, sw->mem->shared_size, PROT_READ | PROT_WRITE,
+				  MAP_SHARED, sw->fd, sw->mem->shared_offset);
+	if (shared == MAP_FAILED)
+		return -1;
+
+	if (__atomic_load_n(&((struct StopWatch_shared *) shared)->magic,
+						__ATOMIC_ACQUIRE) != STOPWATCH_SHARED_MAGIC) {
+		munmap(shared, sw->mem->shared_size);
+		errno = EAGAIN;
+		return -1;
+	}
+
+	sw->shared = shared;
+	sw->slots = STOPWATCH_SHARED_SLOTS(sw->mem->shared_size);
+	sw->owner = sw->mem->shared_id << 32 | (uint32_t) getpid();
+
+	return 0;
+}
+
+static struct StopWatch_shared_slot *stopwatch_slot(struct stopwatch *sw,
+													unsigned int slot)
+{
+	if (stopwatch_shared_map(sw))
+		return NULL;
+	if (slot >= sw->slots) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return &sw->shared->slot[slot];
+}
+
+int stopwatch_shared_slots(struct stopwatch *sw)
+{
+	if (stopwatch_shared_map(sw))
+		return -1;
+
+	return sw->slots;
+}
+
+int stopwatch_shared_claim(struct stopwatch *sw, unsigned int slot)
+{
+	struct StopWatch_shared_slot *s = stopwatch_slot(sw, slot);
+	uint64_t owner = 0;
+
+	if (!s)
+		return -1;
+
+	if (!__atomic_compare_exchange_n(&s->owner, &owner, sw->owner, 0,
+									 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) &&
+		owner != sw->owner) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	return 0;
+}
+
+int stopwatch_shared_release(struct stopwatch *sw, unsigned int slot)
+{
+	struct StopWatch_shared_slot *s = stopwatch_slot(sw, slot);
+	uint64_t owner = sw->owner;
+
+	if (!s)
+		return -1;
+
+	/* release: the updates of the slot are visible to the next owner */
+	if (!__atomic_compare_exchange_n(&s->owner, &owner, 0, 0,
+									 __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		errno = EPERM;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* the slot, owned by the caller, moves to @status as a device bank would */
+static int stopwatch_shared_action(struct stopwatch *sw, unsigned int slot,
+								   uint32_t status)
+{
+	struct StopWatch_shared_slot *s = stopwatch_slot(sw, slot);
+	struct StopWatch_time *t;
+	uint64_t now;
+	uint32_t seq;
+
+	if (!s)
+		return -1;
+	if (__atomic_load_n(&s->owner, __ATOMIC_RELAXED) != sw->owner) {
+		errno = EPERM;
+		return -1;
+	}
+	t = &s->time;
+
+	/* the only writer: no retry, the state is stable */
+	if ((status == STOPWATCH_STATE_RUNNING &&
+		 t->status == STOPWATCH_STATE_RUNNING) ||
+		(status == STOPWATCH_STATE_PAUSED &&
+		 t->status == STOPWATCH_STATE_RESET)) {
+		errno = EPERM;
+		return -1;
+	}
+	if (status == STOPWATCH_STATE_PAUSED &&
+		t->status == STOPWATCH_STATE_PAUSED)
+		return 0;
+
+	now = stopwatch_now_ns(sw);
+
+	seq = t->seq;
+	__atomic_store_n(&t->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	switch (status) {
+	case STOPWATCH_STATE_RUNNING:
+		t->started_at_ns = now;
+		break;
+	case STOPWATCH_STATE_PAUSED:
+		if (now > t->started_at_ns)
+			t->total_ns += now - t->started_at_ns;
+		break;
+	case STOPWATCH_STATE_RESET:
+		t->started_at_ns = 0;
+		t->total_ns = 0;
+		break;
+	}
+	t->status = status;
+	t->now_ns = now;
+
+	__atomic_store_n(&t->seq, seq + 2, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+int stopwatch_shared_start(struct stopwatch *sw, unsigned int slot)
+{
+	return stopwatch_shared_action(sw, slot, STOPWATCH_STATE_RUNNING);
+}
+
+int stopwatch_shared_pause(struct stopwatch *sw, unsigned int slot)
+{
+	return stopwatch_shared_action(sw, slot, STOPWATCH_STATE_PAUSED);
+}
+
+int stopwatch_shared_reset(struct stopwatch *sw, unsigned int slot)
+{
+	return stopwatch_shared_action(sw, slot, STOPWATCH_STATE_RESET);
+}
+
+int stopwatch_shared_read(struct stopwatch *sw, unsigned int slot,
+						  uint64_t *value_ns, uint32_t *status)
+{
+	struct StopWatch_shared_slot *s = stopwatch_slot(sw, slot);
+
+	if (!s)
+		return -1;
+
+	stopwatch_read_time(sw, &s->time, value_ns, status);
+
+	return 0;
+}
@@ -0,0 +1,70 @@
+#ifndef LIBSTOPWATCH_H
+#define LIBSTOPWATCH_H
+
+/*
+ * libstopwatch: typed access to one bank of /dev/stopwatch<N>, through
+ * the fastest interface of the driver: the bank command register for
+ * the commands (one trap, no lock), the mapped time page for the reads
+ * (no trap and no system call), and the event interface for the
+ * timeouts. The functions return 0, or -1 with errno set, like the
+ * system calls they wrap.
+ */
+
+#include <stdint.h>
+
+#include "stopwatch_hw-sw.h"
+#include "stopwatch_ioctl.h"
+
+#define STOPWATCH_DEFAULT_DEVICE "/dev/stopwatch0"
+
+struct stopwatch;
+
+/* @bank of @device (STOPWATCH_DEFAULT_DEVICE if NULL), NULL on error */
+struct stopwatch *stopwatch_open(const char *device, unsigned int bank);
+void stopwatch_close(struct stopwatch *sw);
+
+unsigned int stopwatch_banks(const struct stopwatch *sw);
+
+/* EPERM when the transition is not allowed in the current state */
+int stopwatch_start(struct stopwatch *sw);
+int stopwatch_pause(struct stopwatch *sw);
+int stopwatch_reset(struct stopwatch *sw);
+int stopwatch_lap(struct stopwatch *sw);
+
+/* current value, and the STOPWATCH_STATE_* in @status if not NULL */
+int stopwatch_read(struct stopwatch *sw, uint64_t *value_ns,
+				   uint32_t *status);
+
+/*
+ * One-shot timeout in @timeout_ns, EBUSY while the previous one is
+ * pending. Its expiry is a STOPWATCH_EVENT_TIMEOUT for stopwatch_wait.
+ */
+int stopwatch_timeout(struct stopwatch *sw, uint64_t timeout_ns);
+
+/*
+ * Next event of the bank, waiting up to @timeout_ms (forever if < 0):
+ * ETIMEDOUT if none came. The bank is subscribed at the first call, or
+ * by stopwatch_timeout, so no expiry is missed in between.
+ */
+int stopwatch_wait(struct stopwatch *sw, struct stopwatch_event *ev,
+				   int timeout_ms);
+
+/*
+ * Shared stopwatches (memdev property of the device, see struct
+ * StopWatch_shared): slots on the host clock, common to all the VMs and
+ * host tools attached to the same memory. Any process reads a slot, only
+ * its owner updates it: ENODEV without shared memory, EBUSY when the
+ * slot is owned by another process, EPERM when not owned.
+ */
+int stopwatch_shared_slots(struct stopwatch *sw); /* number of slots, or -1 */
+int stopwatch_shared_claim(struct stopwatch *sw, unsigned int slot);
+int stopwatch_shared_release(struct stopwatch *sw, unsigned int slot);
+
+int stopwatch_shared_start(struct stopwatch *sw, unsigned int slot);
+int stopwatch_shared_pause(struct stopwatch *sw, unsigned int slot);
+int stopwatch_shared_reset(struct stopwatch *sw, unsigned int slot);
+
+int stopwatch_shared_read(struct stopwatch *sw, unsigned int slot,
+						  uint64_t *value_ns, uint32_t *status);
+
+#endif /* LIBSTOPWATCH_H */
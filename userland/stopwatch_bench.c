@@ -0,0 +1,743 @@
+/*
+ * Guest-side latency benchmark of the stopwatch access paths.
+ *
+ * Every operation is timed with CLOCK_MONOTONIC_RAW. Each benchmark
+ * reports its ops/s and its latency distribution, in CSV on stdout (the
+ * serial console when started by init.sh):
+ *
+ *   summary,<bench>,<ops>,<elapsed_ns>,<ops_per_s>,<min_ns>,<mean_ns>,
+ *           <p50_ns>,<p99_ns>,<p999_ns>,<max_ns>
+ *   hist,<bench>,<bucket_start_ns>,<bucket_end_ns>,<count>
+ *   stress,<bench>,<threads>,<ops>,<elapsed_ns>,<ops_per_s>
+ *
+ * The histogram has the bucket layout of the device lap statistics (see
+ * stopwatch_hist_bucket), so the results of two builds can be compared
+ * bucket by bucket.
+ *
+ * The stress mode (-t) runs the register commands from 1 to N threads,
+ * one per CPU and one bank each: the aggregated ops/s shows how the
+ * device scales with the vCPUs.
+ *
+ * The clock-* benchmarks measure the guest clock (clocksource reads,
+ * and hrtimer sleeps on the clock event device of the CPU). With -C,
+ * they run once per clocksource of the list, to compare the stopwatch
+ * clocksource (stopwatch.clock=1) with the arch timer.
+ */
+#define _GNU_SOURCE /* sched_setaffinity */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stopwatch_hw-sw.h"
+#include "stopwatch_ioctl.h"
+
+#define DEFAULT_DEVICE "/dev/stopwatch0"
+#define DEBUGFS_DIR "/sys/kernel/debug/stopwatch"
+#define PARAMS_DIR "/sys/module/stopwatch/parameters"
+#define CLOCKSOURCE_FILE \
+	"/sys/devices/system/clocksource/clocksource0/current_clocksource"
+
+#define DEFAULT_OPS 10000
+#define DEFAULT_IRQ_OPS 1000 /* each one waits for the device clock */
+#define DEFAULT_BATCH 64
+#define STRESS_THREADS_MAX 64
+#define CLOCK_SLEEP_NS 100000
+
+struct bench_ctx {
+	const char *device;
+	const char *name; /* stopwatch<N>, for debugfs */
+	unsigned int bank;
+	unsigned int batch;
+
+	int fd;
+	int param_fd;
+	char path[128];
+	struct StopWatch_mem *mem;
+	size_t mem_size;
+
+	struct stopwatch_ioc_op *ops;
+	struct stopwatch_ioc_result *results;
+};
+
+struct bench {
+	const char *name;
+	const char *desc;
+	unsigned int default_ops;
+	int (*setup)(struct bench_ctx *ctx);
+	int (*op)(struct bench_ctx *ctx); /* 0, or -1 with errno */
+	void (*teardown)(struct bench_ctx *ctx);
+	int batched; /* one op() call is ctx->batch operations */
+};
+
+struct bench_hist {
+	uint64_t count;
+	uint64_t min_ns;
+	uint64_t max_ns;
+	uint64_t sum_ns;
+	uint64_t buckets[STOPWATCH_HIST_BUCKETS];
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Register command: the module parameter writes STOPWATCH_ACTION_UPDATE
+ * to the command register of bank 0, one MMIO trap.
+ */
+static int param_open(struct bench_ctx *ctx, const char *param, int flags)
+{
+	snprintf(ctx->path, sizeof(ctx->path), PARAMS_DIR "/%s", param);
+	ctx->param_fd = open(ctx->path, flags);
+
+	return ctx->param_fd < 0 ? -1 : 0;
+}
+
+static int param_write_setup(struct bench_ctx *ctx)
+{
+	return param_open(ctx, "stopwatch_status", O_WRONLY);
+}
+
+static int param_write_op(struct bench_ctx *ctx)
+{
+	static const char update[] = { '0' + STOPWATCH_ACTION_UPDATE, '\n' };
+
+	return pwrite(ctx->param_fd, update, sizeof(update), 0) < 0 ? -1 : 0;
+}
+
+static int param_read_setup(struct bench_ctx *ctx)
+{
+	return param_open(ctx, "stopwatch_timeout", O_RDONLY);
+}
+
+static int param_read_op(struct bench_ctx *ctx)
+{
+	char buf[32];
+
+	return pread(ctx->param_fd, buf, sizeof(buf), 0) < 0 ? -1 : 0;
+}
+
+static void param_teardown(struct bench_ctx *ctx)
+{
+	close(ctx->param_fd);
+}
+
+/* debugfs bank file: the value is computed at open time */
+static int debugfs_setup(struct bench_ctx *ctx)
+{
+	snprintf(ctx->path, sizeof(ctx->path), DEBUGFS_DIR "/%s/bank%u",
+			 ctx->name, ctx->bank);
+
+	return access(ctx->path, R_OK);
+}
+
+static int debugfs_op(struct bench_ctx *ctx)
+{
+	char buf[STOPWATCH_MEM_DATA_LENGTH];
+	ssize_t len;
+	int fd;
+
+	fd = open(ctx->path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	len = read(fd, buf, sizeof(buf));
+	close(fd);
+
+	return len < 0 ? -1 : 0;
+}
+
+/* one command through the command ring, one doorbell trap */
+static int ioctl_cmd_op(struct bench_ctx *ctx)
+{
+	struct stopwatch_ioc_cmd cmd = { .bank = ctx->bank };
+
+	return ioctl(ctx->fd, STOPWATCH_IOC_LAP, &cmd);
+}
+
+static int ioctl_cmd_setup(struct bench_ctx *ctx)
+{
+	struct stopwatch_ioc_cmd cmd = { .bank = ctx->bank };
+
+	/* LAP needs a started stopwatch, EPERM when it already runs */
+	if (ioctl(ctx->fd, STOPWATCH_IOC_START, &cmd) && errno != EPERM)
+		return -1;
+
+	return 0;
+}
+
+/* ctx->batch commands, one syscall and one doorbell trap */
+static int ioctl_batch_setup(struct bench_ctx *ctx)
+{
+	unsigned int i;
+
+	ctx->ops = calloc(ctx->batch, sizeof(*ctx->ops));
+	ctx->results = calloc(ctx->batch, sizeof(*ctx->results));
+	if (!ctx->ops || !ctx->results)
+		return -1;
+
+	for (i = 0; i < ctx->batch; i++) {
+		ctx->ops[i].action = STOPWATCH_ACTION_UPDATE;
+		ctx->ops[i].bank = ctx->bank;
+	}
+
+	return 0;
+}
+
+static int ioctl_batch_op(struct bench_ctx *ctx)
+{
+	struct stopwatch_ioc_batch batch = {
+		.count = ctx->batch,
+		.ops = (uintptr_t) ctx->ops,
+		.results = (uintptr_t) ctx->results,
+	};
+
+	return ioctl(ctx->fd, STOPWATCH_IOC_BATCH, &batch);
+}
+
+static void ioctl_batch_teardown(struct bench_ctx *ctx)
+{
+	free(ctx->ops);
+	free(ctx->results);
+}
+
+/* time page and guest clock, in the kernel: no trap */
+static int ioctl_snapshot_op(struct bench_ctx *ctx)
+{
+	struct stopwatch_ioc_snapshot snap = { .bank = ctx->bank };
+
+	return ioctl(ctx->fd, STOPWATCH_IOC_SNAPSHOT, &snap);
+}
+
+/* time page and guest clock, in userspace: no trap and no syscall */
+static int mmap_setup(struct bench_ctx *ctx)
+{
+	long page = sysconf(_SC_PAGESIZE);
+
+	ctx->mem_size = (sizeof(struct StopWatch_mem) + page - 1) & ~(page - 1);
+	ctx->mem = mmap(NULL, ctx->mem_size, PROT_READ, MAP_SHARED, ctx->fd, 0);
+
+	return ctx->mem == MAP_FAILED ? -1 : 0;
+}
+
+static int mmap_op(struct bench_ctx *ctx)
+{
+	const struct StopWatch_time *t = &ctx->mem->time[ctx->bank];
+	uint64_t started_at_ns, total_ns, now;
+	uint32_t seq, status;
+	volatile uint64_t value;
+
+	do {
+		seq = __atomic_load_n(&t->seq, __ATOMIC_ACQUIRE);
+		status = t->status;
+		started_at_ns = t->started_at_ns;
+		total_ns = t->total_ns;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n(&t->seq, __ATOMIC_RELAXED));
+
+	value = total_ns;
+	if (status == STOPWATCH_STATE_RUNNING) {
+		now = now_ns() + ctx->mem->clock_offset_ns;
+		if (now > started_at_ns)
+			value += now - started_at_ns;
+	}
+	(void) value;
+
+	return 0;
+}
+
+static void mmap_teardown(struct bench_ctx *ctx)
+{
+	munmap(ctx->mem, ctx->mem_size);
+}
+
+/*
+ * IRQ round trip: command, device timer, IRQ, handler, acknowledge and
+ * wake-up of the blocked read().
+ */
+static int subscribe(struct bench_ctx *ctx, uint64_t mask)
+{
+	return ioctl(ctx->fd, STOPWATCH_IOC_SUBSCRIBE, &mask);
+}
+
+static int wait_event(struct bench_ctx *ctx, uint32_t type)
+{
+	struct stopwatch_event ev;
+
+	do {
+		if (read(ctx->fd, &ev, sizeof(ev)) != sizeof(ev))
+			return -1;
+	} while (ev.type != type);
+
+	return 0;
+}
+
+static int irq_timer_setup(struct bench_ctx *ctx)
+{
+	return subscribe(ctx, STOPWATCH_SUBSCRIBE_TIMERS);
+}
+
+static int irq_timer_op(struct bench_ctx *ctx)
+{
+	struct stopwatch_ioc_timer timer = { .id = 0, .deadline_ns = 0 };
+
+	/* expires during the doorbell trap */
+	if (ioctl(ctx->fd, STOPWATCH_IOC_TIMER_ARM, &timer))
+		return -1;
+
+	return wait_event(ctx, STOPWATCH_EVENT_TIMER);
+}
+
+static int irq_timeout_setup(struct bench_ctx *ctx)
+{
+	return subscribe(ctx, 1ULL << ctx->bank);
+}
+
+static int irq_timeout_op(struct bench_ctx *ctx)
+{
+	struct stopwatch_ioc_cmd cmd = { .bank = ctx->bank, .arg = 0 };
+	int ret;
+
+	/* EBUSY until the handler acknowledged the previous timeout */
+	while ((ret = ioctl(ctx->fd, STOPWATCH_IOC_TIMEOUT, &cmd)) && errno == EBUSY)
+		;
+	if (ret)
+		return -1;
+
+	return wait_event(ctx, STOPWATCH_EVENT_TIMEOUT);
+}
+
+static void irq_teardown(struct bench_ctx *ctx)
+{
+	subscribe(ctx, 0);
+}
+
+/* through the vDSO with the arch timer, a system call otherwise */
+static int clock_read_op(struct bench_ctx *ctx)
+{
+	struct timespec ts;
+
+	return clock_gettime(CLOCK_MONOTONIC, &ts);
+}
+
+/* the latency beyond CLOCK_SLEEP_NS is the timer jitter */
+static int clock_sleep_op(struct bench_ctx *ctx)
+{
+	struct timespec ts = { .tv_nsec = CLOCK_SLEEP_NS };
+
+	errno = clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+
+	return errno ? -1 : 0;
+}
+
+static const struct bench benches[] = {
+	{ "param-write", "register command through the module parameter",
+	  DEFAULT_OPS, param_write_setup, param_write_op, param_teardown },
+	{ "param-read", "module parameter read",
+	  DEFAULT_OPS, param_read_setup, param_read_op, param_teardown },
+	{ "debugfs-read", "open/read/close of the debugfs bank file",
+	  DEFAULT_OPS, debugfs_setup, debugfs_op, NULL },
+	{ "ioctl-cmd", "single command through the command ring",
+	  DEFAULT_OPS, ioctl_cmd_setup, ioctl_cmd_op, NULL },
+	{ "ioctl-batch", "batched commands, per command",
+	  DEFAULT_OPS, ioctl_batch_setup, ioctl_batch_op, ioctl_batch_teardown,
+	  1 },
+	{ "ioctl-snapshot", "value from the time page, in the kernel",
+	  DEFAULT_OPS, NULL, ioctl_snapshot_op, NULL },
+	{ "mmap-read", "value from the mapped time page",
+	  DEFAULT_OPS, mmap_setup, mmap_op, mmap_teardown },
+	{ "irq-timer", "timer engine arm to event",
+	  DEFAULT_IRQ_OPS, irq_timer_setup, irq_timer_op, irq_teardown },
+	{ "irq-timeout", "bank timeout to event",
+	  DEFAULT_IRQ_OPS, irq_timeout_setup, irq_timeout_op, irq_teardown },
+	{ "clock-read", "clock_gettime(CLOCK_MONOTONIC)",
+	  DEFAULT_OPS, NULL, clock_read_op, NULL },
+	{ "clock-sleep", "100 us hrtimer sleep",
+	  DEFAULT_IRQ_OPS, NULL, clock_sleep_op, NULL },
+};
+
+#define NB_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+static void hist_add(struct bench_hist *h, uint64_t ns)
+{
+	if (!h->count || ns < h->min_ns)
+		h->min_ns = ns;
+	if (ns > h->max_ns)
+		h->max_ns = ns;
+	h->count++;
+	h->sum_ns += ns;
+	h->buckets[stopwatch_hist_bucket(ns)]++;
+}
+
+/* upper bound of the bucket of the @permille quantile, see read_lap_stats */
+static uint64_t hist_quantile(const struct bench_hist *h, unsigned int permille)
+{
+	uint64_t rank = (h->count * permille + 999) / 1000, seen = 0, end;
+	unsigned int b;
+
+	for (b = 0; b < STOPWATCH_HIST_BUCKETS; b++) {
+		seen += h->buckets[b];
+		if (seen >= rank)
+			break;
+	}
+	end = stopwatch_hist_bucket_end(b) - 1;
+
+	return end < h->min_ns ? h->min_ns : end > h->max_ns ? h->max_ns : end;
+}
+
+static void report(const struct bench *bench, const struct bench_hist *h,
+				   uint64_t elapsed_ns, int print_hist)
+{
+	uint64_t start = 0;
+	unsigned int b;
+
+	printf("summary,%s,%" PRIu64 ",%" PRIu64 ",%.0f,%" PRIu64 ",%" PRIu64
+		   ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+		   bench->name, h->count, elapsed_ns,
+		   elapsed_ns ? h->count * 1e9 / elapsed_ns : 0.0,
+		   h->min_ns, h->count ? h->sum_ns / h->count : 0,
+		   hist_quantile(h, 500), hist_quantile(h, 990),
+		   hist_quantile(h, 999), h->max_ns);
+
+	for (b = 0; print_hist && b < STOPWATCH_HIST_BUCKETS; b++) {
+		uint64_t end = stopwatch_hist_bucket_end(b);
+
+		if (h->buckets[b])
+			printf("hist,%s,%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+				   bench->name, start, end, h->buckets[b]);
+		start = end;
+	}
+	fflush(stdout);
+}
+
+static int run_bench(const struct bench *bench, struct bench_ctx *ctx,
+					 unsigned int ops, int print_hist)
+{
+	unsigned int per_call = bench->batched ? ctx->batch : 1;
+	struct bench_hist *h;
+	uint64_t start, before, after;
+	unsigned int i, j;
+	int ret = 0;
+
+	if (bench->setup && bench->setup(ctx)) {
+		fprintf(stderr, "%s: setup failed: %s\n", bench->name, strerror(errno));
+		return -1;
+	}
+
+	h = calloc(1, sizeof(*h));
+	if (!h) {
+		ret = -1;
+		goto out;
+	}
+
+	start = now_ns();
+	for (i = 0; i < ops; i += per_call) {
+		before = now_ns();
+		if (bench->op(ctx)) {
+			fprintf(stderr, "%s: operation %u failed: %s\n", bench->name, i,
+					strerror(errno));
+			ret = -1;
+			break;
+		}
+		after = now_ns();
+
+		for (j = 0; j < per_call; j++)
+			hist_add(h, (after - before) / per_call);
+	}
+
+	report(bench, h, now_ns() - start, print_hist);
+	free(h);
+
+  out:
+	if (bench->teardown)
+		bench->teardown(ctx);
+
+	return ret;
+}
+
+static int get_clocksource(char *name, size_t size)
+{
+	FILE *f = fopen(CLOCKSOURCE_FILE, "r");
+	int ret = 0;
+
+	if (!f)
+		return -1;
+	if (!fgets(name, size, f))
+		ret = -1;
+	fclose(f);
+
+	name[strcspn(name, "\n")] = '\0';
+
+	return ret;
+}
+
+/* the kernel ignores the unknown names: checked by reading back */
+static int set_clocksource(const char *name)
+{
+	char current[64];
+	int fd, ret;
+
+	fd = open(CLOCKSOURCE_FILE, O_WRONLY);
+	if (fd < 0)
+		return -1;
+	ret = write(fd, name, strlen(name)) < 0 ? -1 : 0;
+	close(fd);
+
+	if (!ret && (get_clocksource(current, sizeof(current)) ||
+				 strcmp(current, name))) {
+		errno = ENODEV;
+		ret = -1;
+	}
+
+	return ret;
+}
+
+/*
+ * Run @bench once per clocksource of the comma-separated @list, named
+ * <bench>:<clocksource>, then restore the current clocksource.
+ */
+static int run_clocksources(const struct bench *bench, struct bench_ctx *ctx,
+							unsigned int ops, int print_hist, const char *list)
+{
+	struct bench b = *bench;
+	char saved[64], name[128];
+	char *names, *cs, *save = NULL;
+	int ret = 0;
+
+	if (get_clocksource(saved, sizeof(saved))) {
+		fprintf(stderr, "%s: %s\n", CLOCKSOURCE_FILE, strerror(errno));
+		return -1;
+	}
+
+	names = strdup(list);
+	if (!names)
+		return -1;
+
+	for (cs = strtok_r(names, ",", &save); cs; cs = strtok_r(NULL, ",", &save)) {
+		if (set_clocksource(cs)) {
+			fprintf(stderr, "%s: clocksource %s: %s\n", bench->name, cs,
+					strerror(errno));
+			ret = -1;
+			continue;
+		}
+
+		snprintf(name, sizeof(name), "%s:%s", bench->name, cs);
+		b.name = name;
+		if (run_bench(&b, ctx, ops, print_hist))
+			ret = -1;
+	}
+
+	set_clocksource(saved);
+	free(names);
+
+	return ret;
+}
+
+/*
+ * Stress: each thread pins itself to a CPU and sends LAP commands to its
+ * own bank, through the bank command register (STOPWATCH_IOC_CMD_REG).
+ */
+struct stress_thread {
+	pthread_t thread;
+	int fd;
+	unsigned int cpu;
+	unsigned int bank;
+	unsigned int ops;
+	pthread_barrier_t *barrier;
+	int err; /* errno of the failed command, or 0 */
+};
+
+static void *stress_thread(void *arg)
+{
+	struct stress_thread *t = arg;
+	struct stopwatch_ioc_cmd cmd = {
+		.bank = t->bank,
+		.flags = STOPWATCH_IOC_CMD_REG,
+	};
+	cpu_set_t cpus;
+	unsigned int i;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(t->cpu, &cpus);
+	sched_setaffinity(0, sizeof(cpus), &cpus);
+
+	/* LAP needs a started stopwatch, EPERM when it already runs */
+	if (ioctl(t->fd, STOPWATCH_IOC_START, &cmd) && errno != EPERM)
+		t->err = errno;
+
+	pthread_barrier_wait(t->barrier);
+
+	for (i = 0; !t->err && i < t->ops; i++)
+		if (ioctl(t->fd, STOPWATCH_IOC_LAP, &cmd))
+			t->err = errno;
+
+	return NULL;
+}
+
+static int run_stress(struct bench_ctx *ctx, unsigned int max_threads,
+					  unsigned int ops)
+{
+	struct stopwatch_ioc_version version;
+	struct stress_thread threads[STRESS_THREADS_MAX];
+	pthread_barrier_t barrier;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int n, i;
+	uint64_t start, elapsed;
+	int ret = 0;
+
+	if (ioctl(ctx->fd, STOPWATCH_IOC_VERSION, &version))
+		return -1;
+	if (version.version < 5) {
+		fprintf(stderr, "stress: the driver has no register commands\n");
+		return -1;
+	}
+
+	for (n = 1; !ret && n <= max_threads; n++) {
+		pthread_barrier_init(&barrier, NULL, n + 1);
+
+		for (i = 0; i < n; i++) {
+			threads[i] = (struct stress_thread) {
+				.fd = ctx->fd,
+				.cpu = i % (cpus > 0 ? cpus : 1),
+				.bank = (ctx->bank + i) % version.banks,
+				.ops = ops,
+				.barrier = &barrier,
+			};
+			pthread_create(&threads[i].thread, NULL, stress_thread,
+						   &threads[i]);
+		}
+
+		pthread_barrier_wait(&barrier);
+		start = now_ns();
+
+		for (i = 0; i < n; i++) {
+			pthread_join(threads[i].thread, NULL);
+			if (threads[i].err) {
+				fprintf(stderr, "stress: thread %u failed: %s\n", i,
+						strerror(threads[i].err));
+				ret = -1;
+			}
+		}
+		elapsed = now_ns() - start;
+
+		pthread_barrier_destroy(&barrier);
+
+		printf("stress,reg-lap,%u,%" PRIu64 ",%" PRIu64 ",%.0f\n", n,
+			   (uint64_t) n * ops, elapsed,
+			   elapsed ? (double) n * ops * 1e9 / elapsed : 0.0);
+		fflush(stdout);
+	}
+
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	unsigned int i;
+
+	fprintf(stderr,
+			"Usage: %s [-d DEVICE] [-b BANK] [-n OPS] [-B BATCH] [-H] [-t THREADS]\n"
+			"       [-C CLOCKSOURCES] [BENCH...]\n"
+			"  -d DEVICE  stopwatch device (default " DEFAULT_DEVICE ")\n"
+			"  -b BANK    bank to use (default 0)\n"
+			"  -n OPS     operations per benchmark (default %d, %d for irq-*)\n"
+			"  -B BATCH   commands per ioctl-batch call (default %d, max %d)\n"
+			"  -H         no histogram rows\n"
+			"  -t THREADS then stress the register commands, from 1 to THREADS\n"
+			"             threads (max %d), OPS commands per thread\n"
+			"  -C LIST    run the clock-* benchmarks once per clocksource of\n"
+			"             LIST, e.g. arch_sys_counter,stopwatch0\n"
+			"Benchmarks (default all):\n",
+			prog, DEFAULT_OPS, DEFAULT_IRQ_OPS, DEFAULT_BATCH,
+			STOPWATCH_BATCH_MAX, STRESS_THREADS_MAX);
+
+	for (i = 0; i < NB_BENCHES; i++)
+		fprintf(stderr, "  %-15s %s\n", benches[i].name, benches[i].desc);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_ctx ctx = {
+		.device = DEFAULT_DEVICE,
+		.batch = DEFAULT_BATCH,
+	};
+	const char *clocksources = NULL;
+	unsigned int ops = 0, stress = 0, i;
+	int print_hist = 1, failed = 0, opt, j;
+
+	while ((opt = getopt(argc, argv, "d:b:n:B:Ht:C:h")) != -1) {
+		switch (opt) {
+		case 'd': ctx.device = optarg; break;
+		case 'b': ctx.bank = strtoul(optarg, NULL, 0); break;
+		case 'n': ops = strtoul(optarg, NULL, 0); break;
+		case 'B': ctx.batch = strtoul(optarg, NULL, 0); break;
+		case 'H': print_hist = 0; break;
+		case 't': stress = strtoul(optarg, NULL, 0); break;
+		case 'C': clocksources = optarg; break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (ctx.bank >= STOPWATCH_BANKS_MAX || !ctx.batch ||
+		ctx.batch > STOPWATCH_BATCH_MAX || stress > STRESS_THREADS_MAX) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	ctx.name = strrchr(ctx.device, '/');
+	ctx.name = ctx.name ? ctx.name + 1 : ctx.device;
+
+	ctx.fd = open(ctx.device, O_RDWR);
+	if (ctx.fd < 0) {
+		fprintf(stderr, "%s: %s\n", ctx.device, strerror(errno));
+		return 1;
+	}
+
+	printf("record,bench,ops,elapsed_ns,ops_per_s,min_ns,mean_ns,"
+		   "p50_ns,p99_ns,p999_ns,max_ns\n");
+
+	for (i = 0; i < NB_BENCHES; i++) {
+		const struct bench *bench = &benches[i];
+
+		if (optind < argc) {
+			for (j = optind; j < argc; j++)
+				if (!strcmp(argv[j], bench->name))
+					break;
+			if (j == argc)
+				continue;
+		}
+
+		if (clocksources && !strncmp(bench->name, "clock-", 6)) {
+			if (run_clocksources(bench, &ctx, ops ? ops : bench->default_ops,
+								 print_hist, clocksources))
+				failed++;
+		} else if (run_bench(bench, &ctx, ops ? ops : bench->default_ops,
+							 print_hist)) {
+			failed++;
+		}
+	}
+
+	if (stress && run_stress(&ctx, stress, ops ? ops : DEFAULT_OPS))
+		failed++;
+
+	close(ctx.fd);
+
+	return failed ? 1 : 0;
+}
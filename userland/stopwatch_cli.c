@@ -0,0 +1,504 @@
+/*
+ * Command-line client of the stopwatch driver, on libstopwatch: runs a
+ * whole script of commands in one process, instead of one process per
+ * command. The commands come from the command line and from the script
+ * files (-f), one or more per line, '#' starts a comment:
+ *
+ *   stopwatch -b 1 reset start sleep 1s pause read
+ *   stopwatch -f - <<EOF
+ *   timeout 500ms
+ *   wait 1s
+ *   EOF
+ *
+ * With a shared memory (memdev property of the device), 'slot' switches
+ * start, pause, reset and read to a shared slot, once claimed:
+ *
+ *   stopwatch slot 0 claim reset start release
+ *
+ * The script is parsed first, then run -r times. With -l, each command
+ * is timed (CLOCK_MONOTONIC_RAW) and its latency distribution reported
+ * at the end, in CSV:
+ *
+ *   latency,<command>,<count>,<min_ns>,<mean_ns>,<p50_ns>,<p99_ns>,
+ *           <p999_ns>,<max_ns>
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libstopwatch.h"
+
+#define LINE_MAX_LEN 1024
+
+enum {
+	CMD_START,
+	CMD_PAUSE,
+	CMD_RESET,
+	CMD_LAP,
+	CMD_READ,
+	CMD_TIMEOUT,
+	CMD_WAIT,
+	CMD_SLEEP,
+	CMD_BANK,
+	CMD_SLOT,
+	CMD_CLAIM,
+	CMD_RELEASE,
+
+	CMD_LAST
+};
+
+struct cmd_desc {
+	const char *name;
+	const char *arg; /* argument, NULL if none */
+	int optional;    /* the argument may be omitted */
+	const char *desc;
+};
+
+static const struct cmd_desc cmd_descs[CMD_LAST] = {
+	[CMD_START]   = { "start", NULL, 0, "start the stopwatch" },
+	[CMD_PAUSE]   = { "pause", NULL, 0, "pause the stopwatch" },
+	[CMD_RESET]   = { "reset", NULL, 0, "reset the stopwatch" },
+	[CMD_LAP]     = { "lap", NULL, 0, "record a lap" },
+	[CMD_READ]    = { "read", NULL, 0, "print the value, in ns" },
+	[CMD_TIMEOUT] = { "timeout", "DURATION", 0, "arm the timeout of the bank" },
+	[CMD_WAIT]    = { "wait", "DURATION", 1,
+					  "print the next event, waiting up to DURATION" },
+	[CMD_SLEEP]   = { "sleep", "DURATION", 0, "sleep, in the guest" },
+	[CMD_BANK]    = { "bank", "BANK", 0, "use BANK for the next commands" },
+	[CMD_SLOT]    = { "slot", "SLOT", 0,
+					  "use the shared SLOT for the next commands" },
+	[CMD_CLAIM]   = { "claim", NULL, 0, "become the owner of the slot" },
+	[CMD_RELEASE] = { "release", NULL, 0, "give the slot back" },
+};
+
+struct cmd {
+	int op; /* CMD_* */
+	int has_arg;
+	uint64_t arg;
+	const char *where; /* for the errors: argv, or file:line */
+	unsigned int line;
+};
+
+struct cli {
+	const char *device;
+	struct stopwatch *banks[STOPWATCH_BANKS_MAX]; /* opened on first use */
+	unsigned int bank;
+	int slot; /* shared slot of the commands, -1 for the bank */
+	int keep_going;
+
+	struct cmd *cmds;
+	unsigned int nb_cmds;
+	unsigned int max_cmds;
+
+	struct latency {
+		uint64_t count;
+		uint64_t min_ns;
+		uint64_t max_ns;
+		uint64_t sum_ns;
+		uint64_t buckets[STOPWATCH_HIST_BUCKETS];
+	} *latency; /* one per CMD_*, NULL without -l */
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* DURATION: an integer, in ns unless followed by us, ms or s */
+static int parse_duration(const char *s, uint64_t *ns)
+{
+	static const struct { const char *suffix; uint64_t scale; } units[] = {
+		{ "", 1 }, { "ns", 1 }, { "us", 1000 }, { "ms", 1000000 },
+		{ "s", 1000000000 },
+	};
+	unsigned long long value;
+	unsigned int i;
+	char *end;
+
+	errno = 0;
+	value = strtoull(s, &end, 10);
+	if (errno || end == s)
+		return -1;
+
+	for (i = 0; i < sizeof(units) / sizeof(units[0]); i++) {
+		if (!strcmp(end, units[i].suffix)) {
+			*ns = value * units[i].scale;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static int add_cmd(struct cli *cli, const struct cmd *cmd)
+{
+	struct cmd *cmds;
+
+	if (cli->nb_cmds == cli->max_cmds) {
+		cli->max_cmds = cli->max_cmds ? cli->max_cmds * 2 : 64;
+		cmds = realloc(cli->cmds, cli->max_cmds * sizeof(*cmds));
+		if (!cmds)
+			return -1;
+		cli->cmds = cmds;
+	}
+	cli->cmds[cli->nb_cmds++] = *cmd;
+
+	return 0;
+}
+
+/*
+ * Parse the @n words of @words, from @where (line @line). An argument
+ * is a word that does not name a command, so 'wait' can omit it.
+ */
+static int parse_words(struct cli *cli, char **words, int n, const char *where,
+					   unsigned int line)
+{
+	struct cmd cmd = { .where = where, .line = line };
+	int i = 0;
+
+	while (i < n) {
+		for (cmd.op = 0; cmd.op < CMD_LAST; cmd.op++)
+			if (!strcmp(words[i], cmd_descs[cmd.op].name))
+				break;
+		if (cmd.op == CMD_LAST) {
+			fprintf(stderr, "%s:%u: unknown command '%s'\n", where, line,
+					words[i]);
+			return -1;
+		}
+		i++;
+
+		cmd.has_arg = 0;
+		if (cmd_descs[cmd.op].arg && i < n) {
+			if (cmd.op == CMD_BANK || cmd.op == CMD_SLOT) {
+				char *end;
+
+				cmd.arg = strtoul(words[i], &end, 0);
+				cmd.has_arg = !*end && end != words[i];
+			} else {
+				cmd.has_arg = !parse_duration(words[i], &cmd.arg);
+			}
+		}
+		if (cmd.has_arg) {
+			i++;
+		} else if (cmd_descs[cmd.op].arg && !cmd_descs[cmd.op].optional) {
+			fprintf(stderr, "%s:%u: %s: missing or invalid %s\n", where, line,
+					cmd_descs[cmd.op].name, cmd_descs[cmd.op].arg);
+			return -1;
+		}
+
+		if (cmd.op == CMD_BANK && cmd.arg >= STOPWATCH_BANKS_MAX) {
+			fprintf(stderr, "%s:%u: invalid bank %" PRIu64 "\n", where, line,
+					cmd.arg);
+			return -1;
+		}
+
+		if (add_cmd(cli, &cmd))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int parse_file(struct cli *cli, const char *path)
+{
+	/* one-character words: LINE_MAX_LEN / 2, and the NULL of strtok_r */
+	char buf[LINE_MAX_LEN], *words[LINE_MAX_LEN / 2 + 1], *save;
+	unsigned int line = 0;
+	FILE *f;
+	int n, ret = 0;
+
+	f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	if (!f) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	while (!ret && fgets(buf, sizeof(buf), f)) {
+		line++;
+		buf[strcspn(buf, "#")] = '\0';
+
+		n = 0;
+		for (words[n] = strtok_r(buf, " \t\r\n", &save);
+			 words[n] && n < LINE_MAX_LEN / 2;
+			 words[n] = strtok_r(NULL, " \t\r\n", &save))
+			n++;
+
+		/* the words point into buf, parsed before the next line */
+		ret = parse_words(cli, words, n, path, line);
+	}
+
+	if (f != stdin)
+		fclose(f);
+
+	return ret;
+}
+
+/* a wait of @ns at least, for poll() */
+static int wait_ms(uint64_t ns)
+{
+	uint64_t ms = ns / 1000000 + (ns % 1000000 != 0);
+
+	return ms > INT_MAX ? INT_MAX : (int) ms;
+}
+
+static struct stopwatch *cli_bank(struct cli *cli)
+{
+	struct stopwatch **sw = &cli->banks[cli->bank];
+
+	if (!*sw)
+		*sw = stopwatch_open(cli->device, cli->bank);
+
+	return *sw;
+}
+
+static const char *state_name(uint32_t status)
+{
+	switch (status) {
+	case STOPWATCH_STATE_RUNNING: return "running";
+	case STOPWATCH_STATE_RESET:   return "reset";
+	case STOPWATCH_STATE_PAUSED:  return "paused";
+	default:                      return "unknown";
+	}
+}
+
+static int run_cmd(struct cli *cli, const struct cmd *cmd)
+{
+	struct stopwatch_event ev;
+	struct timespec ts;
+	struct stopwatch *sw;
+	uint64_t value;
+	uint32_t status;
+
+	switch (cmd->op) {
+	case CMD_SLEEP:
+		ts.tv_sec = cmd->arg / 1000000000ULL;
+		ts.tv_nsec = cmd->arg % 1000000000ULL;
+		while (nanosleep(&ts, &ts))
+			if (errno != EINTR)
+				return -1;
+		return 0;
+	case CMD_BANK:
+		cli->bank = cmd->arg;
+		cli->slot = -1;
+		return cli_bank(cli) ? 0 : -1;
+	case CMD_SLOT:
+		cli->slot = cmd->arg;
+		return 0;
+	}
+
+	sw = cli_bank(cli);
+	if (!sw)
+		return -1;
+
+	if (cli->slot >= 0) {
+		switch (cmd->op) {
+		case CMD_CLAIM:   return stopwatch_shared_claim(sw, cli->slot);
+		case CMD_RELEASE: return stopwatch_shared_release(sw, cli->slot);
+		case CMD_START:   return stopwatch_shared_start(sw, cli->slot);
+		case CMD_PAUSE:   return stopwatch_shared_pause(sw, cli->slot);
+		case CMD_RESET:   return stopwatch_shared_reset(sw, cli->slot);
+		case CMD_READ:
+			if (stopwatch_shared_read(sw, cli->slot, &value, &status))
+				return -1;
+			printf("%" PRIu64 " %s\n", value, state_name(status));
+			return 0;
+		}
+		errno = EINVAL; /* bank commands only */
+		return -1;
+	}
+
+	switch (cmd->op) {
+	case CMD_START:   return stopwatch_start(sw);
+	case CMD_PAUSE:   return stopwatch_pause(sw);
+	case CMD_RESET:   return stopwatch_reset(sw);
+	case CMD_LAP:     return stopwatch_lap(sw);
+	case CMD_TIMEOUT: return stopwatch_timeout(sw, cmd->arg);
+	case CMD_READ:
+		if (stopwatch_read(sw, &value, &status))
+			return -1;
+		printf("%" PRIu64 " %s\n", value, state_name(status));
+		return 0;
+	case CMD_WAIT:
+		if (stopwatch_wait(sw, &ev, cmd->has_arg ? wait_ms(cmd->arg) : -1))
+			return -1;
+		printf("%s %u %" PRIu64 " %" PRIu64 "\n",
+			   ev.type == STOPWATCH_EVENT_TIMER ? "timer" : "timeout",
+			   ev.index, (uint64_t) ev.count, (uint64_t) ev.timestamp_ns);
+		return 0;
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+static void latency_add(struct latency *l, uint64_t ns)
+{
+	if (!l->count || ns < l->min_ns)
+		l->min_ns = ns;
+	if (ns > l->max_ns)
+		l->max_ns = ns;
+	l->count++;
+	l->sum_ns += ns;
+	l->buckets[stopwatch_hist_bucket(ns)]++;
+}
+
+/* upper bound of the bucket of the @permille quantile, as stopwatch_bench */
+static uint64_t latency_quantile(const struct latency *l, unsigned int permille)
+{
+	uint64_t rank = (l->count * permille + 999) / 1000, seen = 0, end;
+	unsigned int b;
+
+	for (b = 0; b < STOPWATCH_HIST_BUCKETS; b++) {
+		seen += l->buckets[b];
+		if (seen >= rank)
+			break;
+	}
+	end = stopwatch_hist_bucket_end(b) - 1;
+
+	return end < l->min_ns ? l->min_ns : end > l->max_ns ? l->max_ns : end;
+}
+
+static void latency_report(const struct cli *cli)
+{
+	unsigned int op;
+
+	printf("record,command,count,min_ns,mean_ns,p50_ns,p99_ns,p999_ns,"
+		   "max_ns\n");
+
+	for (op = 0; op < CMD_LAST; op++) {
+		const struct latency *l = &cli->latency[op];
+
+		if (!l->count)
+			continue;
+
+		printf("latency,%s,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+			   ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+			   cmd_descs[op].name, l->count, l->min_ns, l->sum_ns / l->count,
+			   latency_quantile(l, 500), latency_quantile(l, 990),
+			   latency_quantile(l, 999), l->max_ns);
+	}
+}
+
+static int run(struct cli *cli, unsigned int repeat)
+{
+	uint64_t before;
+	unsigned int r, i;
+	int failed = 0;
+
+	for (r = 0; r < repeat; r++) {
+		for (i = 0; i < cli->nb_cmds; i++) {
+			const struct cmd *cmd = &cli->cmds[i];
+			int ret;
+
+			before = now_ns();
+			ret = run_cmd(cli, cmd);
+			if (cli->latency && !ret)
+				latency_add(&cli->latency[cmd->op], now_ns() - before);
+
+			if (ret) {
+				fprintf(stderr, "%s:%u: %s: %s\n", cmd->where, cmd->line,
+						cmd_descs[cmd->op].name, strerror(errno));
+				failed = 1;
+				if (!cli->keep_going)
+					return -1;
+			}
+		}
+	}
+
+	return failed ? -1 : 0;
+}
+
+static void usage(const char *prog)
+{
+	unsigned int op;
+
+	fprintf(stderr,
+			"Usage: %s [-d DEVICE] [-b BANK] [-f SCRIPT]... [-r REPEAT] [-k] [-l]\n"
+			"       [COMMAND [ARG]]...\n"
+			"  -d DEVICE  stopwatch device (default " STOPWATCH_DEFAULT_DEVICE ")\n"
+			"  -b BANK    initial bank (default 0)\n"
+			"  -f SCRIPT  read commands from SCRIPT ('-' for stdin), after\n"
+			"             the ones of the command line\n"
+			"  -r REPEAT  run the commands REPEAT times (default 1)\n"
+			"  -k         keep going after a failed command\n"
+			"  -l         report the latency of each command, in CSV\n"
+			"Commands (DURATION in ns, or with a us, ms or s suffix):\n",
+			prog);
+
+	for (op = 0; op < CMD_LAST; op++)
+		fprintf(stderr, "  %-7s %-9s %s\n", cmd_descs[op].name,
+				cmd_descs[op].arg ? cmd_descs[op].arg : "",
+				cmd_descs[op].desc);
+}
+
+int main(int argc, char **argv)
+{
+	struct cli cli = { .device = STOPWATCH_DEFAULT_DEVICE, .slot = -1 };
+	const char *scripts[16];
+	unsigned int nb_scripts = 0, repeat = 1, i;
+	int latency = 0, opt, ret = 0;
+
+	while ((opt = getopt(argc, argv, "d:b:f:r:klh")) != -1) {
+		switch (opt) {
+		case 'd': cli.device = optarg; break;
+		case 'b': cli.bank = strtoul(optarg, NULL, 0); break;
+		case 'f':
+			if (nb_scripts == sizeof(scripts) / sizeof(scripts[0])) {
+				fprintf(stderr, "too many scripts\n");
+				return 1;
+			}
+			scripts[nb_scripts++] = optarg;
+			break;
+		case 'r': repeat = strtoul(optarg, NULL, 0); break;
+		case 'k': cli.keep_going = 1; break;
+		case 'l': latency = 1; break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (cli.bank >= STOPWATCH_BANKS_MAX) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (parse_words(&cli, argv + optind, argc - optind, "argv", 0))
+		return 1;
+	for (i = 0; i < nb_scripts; i++)
+		if (parse_file(&cli, scripts[i]))
+			return 1;
+
+	if (!cli.nb_cmds) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (latency) {
+		cli.latency = calloc(CMD_LAST, sizeof(*cli.latency));
+		if (!cli.latency)
+			return 1;
+	}
+
+	ret = run(&cli, repeat);
+
+	if (cli.latency)
+		latency_report(&cli);
+
+	for (i = 0; i < STOPWATCH_BANKS_MAX; i++)
+		if (cli.banks[i])
+			stopwatch_close(cli.banks[i]);
+	free(cli.latency);
+	free(cli.cmds);
+
+	return ret ? 1 : 0;
+}